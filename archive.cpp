@@ -0,0 +1,352 @@
+/*
+########################################################################
+# This file is part of the toolchain for WRAMP assembly
+#
+# Copyright (C) 2019 The University of Waikato, Hamilton, New Zealand.
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <https://www.gnu.org/licenses/>.
+########################################################################
+*/
+
+#include <string.h>
+#include <stddef.h>
+
+#include "archive.h"
+#include "symbol_table.h"
+
+using namespace std;
+
+// Appends raw bytes to the archive
+static void append(string &archive, const void *data, size_t length)
+{
+	archive.append((const char *)data, length);
+}
+
+// Appends a table of structs made up of unsigned ints, each as a little
+// endian word, so archives are the same whatever machine built them
+static void append_words(string &archive, const void *data, size_t length)
+{
+	const unsigned int *words = (const unsigned int *)data;
+	char bytes[sizeof(unsigned int)];
+
+	for (size_t i = 0; i < length / sizeof(unsigned int); i++)
+	{
+		put_le32(bytes, words[i]);
+		archive.append(bytes, sizeof(bytes));
+	}
+}
+
+static void read_member(const char *ptr, archive_member &member)
+{
+	member.name_ptr = get_le32(ptr + offsetof(archive_member, name_ptr));
+	member.offset = get_le32(ptr + offsetof(archive_member, offset));
+	member.length = get_le32(ptr + offsetof(archive_member, length));
+}
+
+static void read_index_entry(const char *ptr, archive_index_entry &entry)
+{
+	entry.symbol_ptr = get_le32(ptr + offsetof(archive_index_entry, symbol_ptr));
+	entry.hash = get_le32(ptr + offsetof(archive_index_entry, hash));
+	entry.member = get_le32(ptr + offsetof(archive_index_entry, member));
+}
+
+// Pads the archive out to where the next member can start
+static void pad_to_member(string &archive)
+{
+	while (archive.size() % OBJ_SECTION_ALIGN != 0)
+		archive += '\0';
+}
+
+// A global declared by one of the members
+struct archive_symbol
+{
+	const char *name;
+	unsigned int hash;
+	unsigned int member;
+};
+
+// Checks an object file is whole, and adds the globals it declares
+static bool read_globals(const object_buffer &object, unsigned int member, vector<archive_symbol> &globals, ostream &messages)
+{
+	object_view view;
+
+	const char *problem = open_object(object.data, object.length, view);
+	if (problem != NULL)
+	{
+		messages << "ERROR: " << problem << object.filename << endl;
+		return false;
+	}
+
+	const object_header &header = view.header;
+	const char *symbol_names = view.names;
+
+	// The file's own symbol index holds the globals, along with their hashes
+	if (view.symbols != NULL)
+	{
+		for (unsigned int i = 0; i < view.num_symbol_slots; i++)
+		{
+			object_symbol symbol;
+			if (!get_symbol(view, i, symbol) || symbol.type == EXTERNAL_REF)
+				continue;
+
+			archive_symbol global = {symbol.name, symbol.hash, member};
+			globals.push_back(global);
+		}
+		return true;
+	}
+
+	reloc_reader relocs(view);
+	for (unsigned int i = 0; i < header.num_references; i++)
+	{
+		reloc_entry reloc;
+		if (!relocs.next(reloc))
+		{
+			messages << "ERROR: Bad relocation in object file : " << object.filename << endl;
+			return false;
+		}
+
+		if (reloc.type != GLOBAL_TEXT && reloc.type != GLOBAL_DATA && reloc.type != GLOBAL_BSS)
+			continue;
+
+		if (reloc.symbol_ptr >= header.symbol_name_table_size)
+		{
+			messages << "ERROR: Bad symbol in object file : " << object.filename << endl;
+			return false;
+		}
+
+		archive_symbol global = {symbol_names + reloc.symbol_ptr, hash_name(symbol_names + reloc.symbol_ptr), member};
+		globals.push_back(global);
+	}
+	return true;
+}
+
+bool build_archive(const vector<object_buffer> &objects, string &archive, ostream &messages)
+{
+	unsigned int i;
+	vector<archive_symbol> globals;
+
+	archive.clear();
+
+	for (i = 0; i < objects.size(); i++)
+	{
+		if (!read_globals(objects[i], i, globals, messages))
+			return false;
+	}
+
+	// Each global may only be declared once in the archive
+	symbol_table declared;
+	for (i = 0; i < globals.size(); i++)
+	{
+		archive_symbol *first = (archive_symbol *)declared.find(globals[i].name, globals[i].hash);
+		if (first != NULL)
+		{
+			messages << "ERROR: Duplicate label in file " << objects[globals[i].member].filename << ". '"
+					 << globals[i].name << "' already declared in file " << objects[first->member].filename << endl;
+			return false;
+		}
+		declared.insert(globals[i].name, globals[i].hash, &globals[i]);
+	}
+
+	// The names of the members, then the globals
+	string names;
+	vector<archive_member> members(objects.size());
+	for (i = 0; i < objects.size(); i++)
+	{
+		const char *name = strrchr(objects[i].filename, '/');
+		name = (name == NULL) ? objects[i].filename : name + 1;
+
+		members[i].name_ptr = names.size();
+		members[i].length = objects[i].length;
+		names.append(name, strlen(name) + 1);
+	}
+
+	// The index is kept at most half full
+	unsigned int index_size = 1;
+	while (index_size < 2 * globals.size() + 1)
+		index_size *= 2;
+
+	vector<archive_index_entry> index(index_size);
+	for (i = 0; i < index_size; i++)
+	{
+		index[i].symbol_ptr = 0;
+		index[i].hash = 0;
+		index[i].member = ARCHIVE_NO_MEMBER;
+	}
+
+	for (i = 0; i < globals.size(); i++)
+	{
+		unsigned int hash = globals[i].hash;
+		unsigned int slot = hash & (index_size - 1);
+
+		while (index[slot].member != ARCHIVE_NO_MEMBER)
+			slot = (slot + 1) & (index_size - 1);
+
+		index[slot].symbol_ptr = names.size();
+		index[slot].hash = hash;
+		index[slot].member = globals[i].member;
+		names.append(globals[i].name, strlen(globals[i].name) + 1);
+	}
+
+	archive_header header;
+	header.magic_number = ARCHIVE_MAGIC_NUM;
+	header.num_members = objects.size();
+	header.index_size = index_size;
+	header.name_table_size = names.size();
+
+	// Work out where each member goes
+	size_t offset = sizeof(archive_header) + members.size() * sizeof(archive_member) +
+					index_size * sizeof(archive_index_entry) + names.size();
+	for (i = 0; i < objects.size(); i++)
+	{
+		offset = (offset + OBJ_SECTION_ALIGN - 1) & ~(size_t)(OBJ_SECTION_ALIGN - 1);
+		members[i].offset = offset;
+		offset += objects[i].length;
+	}
+
+	archive.reserve(offset);
+	append_words(archive, &header, sizeof(header));
+	if (members.size() > 0)
+		append_words(archive, &members[0], members.size() * sizeof(archive_member));
+	append_words(archive, &index[0], index_size * sizeof(archive_index_entry));
+	append(archive, names.data(), names.size());
+
+	for (i = 0; i < objects.size(); i++)
+	{
+		pad_to_member(archive);
+		append(archive, objects[i].data, objects[i].length);
+	}
+
+	return true;
+}
+
+bool is_archive(const object_buffer &buffer)
+{
+	if (buffer.length < sizeof(unsigned int))
+		return false;
+
+	return get_le32(buffer.data) == ARCHIVE_MAGIC_NUM;
+}
+
+archive_reader::archive_reader()
+{
+	index = NULL;
+	index_size = 0;
+	names = NULL;
+	name_table_size = 0;
+}
+
+bool archive_reader::open(const object_buffer &buffer, ostream &messages)
+{
+	archive_header header;
+	unsigned int i;
+
+	members.clear();
+	member_names.clear();
+
+	if (!is_archive(buffer) || buffer.length < sizeof(archive_header))
+	{
+		messages << "ERROR: File is not an archive : " << buffer.filename << endl;
+		return false;
+	}
+	header.magic_number = get_le32(buffer.data + offsetof(archive_header, magic_number));
+	header.num_members = get_le32(buffer.data + offsetof(archive_header, num_members));
+	header.index_size = get_le32(buffer.data + offsetof(archive_header, index_size));
+	header.name_table_size = get_le32(buffer.data + offsetof(archive_header, name_table_size));
+
+	// The tables must all be there, and the index must have an empty slot
+	// to stop each search
+	size_t index_offset = sizeof(archive_header) + (size_t)header.num_members * sizeof(archive_member);
+	size_t names_offset = index_offset + (size_t)header.index_size * sizeof(archive_index_entry);
+	if (header.index_size == 0 || (header.index_size & (header.index_size - 1)) != 0 ||
+		header.num_members > buffer.length / sizeof(archive_member) ||
+		header.index_size > buffer.length / sizeof(archive_index_entry) ||
+		buffer.length < names_offset + header.name_table_size ||
+		header.name_table_size == 0 || buffer.data[names_offset + header.name_table_size - 1] != '\0')
+	{
+		messages << "ERROR: Archive is truncated : " << buffer.filename << endl;
+		return false;
+	}
+
+	index = buffer.data + index_offset;
+	index_size = header.index_size;
+	names = buffer.data + names_offset;
+	name_table_size = header.name_table_size;
+
+	bool empty_slot = false;
+	for (i = 0; i < index_size; i++)
+	{
+		archive_index_entry entry;
+		read_index_entry(index + i * sizeof(archive_index_entry), entry);
+
+		if (entry.member == ARCHIVE_NO_MEMBER)
+			empty_slot = true;
+		else if (entry.member >= header.num_members || entry.symbol_ptr >= name_table_size)
+		{
+			messages << "ERROR: Bad symbol index in archive : " << buffer.filename << endl;
+			return false;
+		}
+	}
+	if (!empty_slot)
+	{
+		messages << "ERROR: Bad symbol index in archive : " << buffer.filename << endl;
+		return false;
+	}
+
+	vector<archive_member> entries(header.num_members);
+	for (i = 0; i < header.num_members; i++)
+	{
+		read_member(buffer.data + sizeof(archive_header) + i * sizeof(archive_member), entries[i]);
+
+		if (entries[i].name_ptr >= name_table_size || entries[i].offset > buffer.length ||
+			entries[i].length > buffer.length - entries[i].offset)
+		{
+			messages << "ERROR: Archive is truncated : " << buffer.filename << endl;
+			return false;
+		}
+
+		member_names.push_back(string(buffer.filename) + "(" + (names + entries[i].name_ptr) + ")");
+	}
+
+	// The names are all in place now, so they won't move
+	for (i = 0; i < header.num_members; i++)
+	{
+		object_buffer member;
+		member.filename = member_names[i].c_str();
+		member.data = buffer.data + entries[i].offset;
+		member.length = entries[i].length;
+		members.push_back(member);
+	}
+
+	return true;
+}
+
+int archive_reader::find(const char *name) const
+{
+	unsigned int hash = hash_name(name);
+	unsigned int i = hash & (index_size - 1);
+
+	// Linear probing, stopping at the first empty slot
+	for (;;)
+	{
+		archive_index_entry entry;
+		read_index_entry(index + i * sizeof(archive_index_entry), entry);
+
+		if (entry.member == ARCHIVE_NO_MEMBER)
+			return -1;
+		if (entry.hash == hash && strcmp(names + entry.symbol_ptr, name) == 0)
+			return entry.member;
+
+		i = (i + 1) & (index_size - 1);
+	}
+}
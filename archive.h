@@ -0,0 +1,72 @@
+/*
+########################################################################
+# This file is part of the toolchain for WRAMP assembly
+#
+# Copyright (C) 2019 The University of Waikato, Hamilton, New Zealand.
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <https://www.gnu.org/licenses/>.
+########################################################################
+*/
+
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "object_file.h"
+#include "linker.h"
+
+// Builds an archive of object files held in memory, indexing the globals
+// they declare. Members are named after their files, without the
+// directories. Returns false if there were errors, which are written to
+// messages.
+bool build_archive(const std::vector<object_buffer> &objects, std::string &archive, std::ostream &messages);
+
+// Returns true if the buffer holds an archive rather than an object file
+bool is_archive(const object_buffer &buffer);
+
+// An archive held in memory. The members point into the archive's buffer,
+// which must stay valid for as long as the reader is used.
+class archive_reader
+{
+public:
+	archive_reader();
+
+	// Checks the whole archive is there, returning false and writing to
+	// messages if it isn't
+	bool open(const object_buffer &buffer, std::ostream &messages);
+
+	unsigned int num_members() const { return members.size(); }
+	// A member's object file, with its filename given as archive(member)
+	const object_buffer &member(unsigned int i) const { return members[i]; }
+	// Returns the member that declares this global, or -1 if none does
+	int find(const char *name) const;
+
+private:
+	const char *index;
+	unsigned int index_size;
+	const char *names;
+	unsigned int name_table_size;
+
+	std::vector<object_buffer> members;
+	std::vector<std::string> member_names;
+
+	// Not copyable, the members point at the names
+	archive_reader(const archive_reader &);
+	archive_reader &operator=(const archive_reader &);
+};
+
+#endif
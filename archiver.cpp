@@ -0,0 +1,120 @@
+/*
+########################################################################
+# This is the archiver part of the toolchain for WRAMP assembly
+#
+# Copyright (C) 2019 The University of Waikato, Hamilton, New Zealand.
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <https://www.gnu.org/licenses/>.
+########################################################################
+*/
+
+#include <iostream>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+#include <string.h>
+#include <stdlib.h>
+
+#include "archive.h"
+
+using namespace std;
+
+void usage(char *progname)
+{
+	cerr << "USAGE: " << progname << " archive file1 file2 ...\n";
+	cerr << "       " << progname << " -t archive\n";
+	exit(1);
+}
+
+// Reads a whole file into memory
+void read_file(const char *filename, string &contents)
+{
+	ifstream file;
+	file.open(filename, ios::in | ios::binary);
+
+	if (!file)
+	{
+		cerr << "ERROR: Could not open file for input : " << filename << endl;
+		exit(1);
+	}
+
+	contents.assign(istreambuf_iterator<char>(file), istreambuf_iterator<char>());
+}
+
+// Lists the members of an archive
+int list_archive(const char *archive_filename)
+{
+	string contents;
+	read_file(archive_filename, contents);
+
+	object_buffer buffer = {archive_filename, contents.data(), contents.size()};
+	archive_reader reader;
+	if (!reader.open(buffer, cerr))
+		return 1;
+
+	for (unsigned int i = 0; i < reader.num_members(); i++)
+		cout << reader.member(i).filename << " : " << reader.member(i).length << " bytes" << endl;
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int i;
+
+	if (argc < 2)
+		usage(argv[0]);
+
+	if (strcmp(argv[1], "-t") == 0)
+	{
+		if (argc != 3)
+			usage(argv[0]);
+		return list_archive(argv[2]);
+	}
+
+	if (argv[1][0] == '-' || argc < 3)
+		usage(argv[0]);
+
+	char *archive_filename = argv[1];
+	int num_files = argc - 2;
+
+	// Read all the object files into memory
+	vector<string> contents(num_files);
+	vector<object_buffer> objects(num_files);
+	for (i = 0; i < num_files; i++)
+	{
+		read_file(argv[i + 2], contents[i]);
+
+		objects[i].filename = argv[i + 2];
+		objects[i].data = contents[i].data();
+		objects[i].length = contents[i].size();
+	}
+
+	string archive;
+	if (!build_archive(objects, archive, cerr))
+		exit(1);
+
+	ofstream outputfile;
+	outputfile.open(archive_filename, ios::out | ios::binary);
+	if (!outputfile)
+	{
+		cerr << "ERROR: Could not open output file " << archive_filename << endl;
+		exit(1);
+	}
+
+	outputfile.write(archive.data(), archive.size());
+
+	return 0;
+}
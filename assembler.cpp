@@ -23,38 +23,22 @@
 #include <iostream>
 #include <iomanip>
 #include <fstream>
+#include <algorithm>
+#include <stdio.h>
 #include <string.h>
 #include <ctype.h>
 #include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include "instructions.h"
-#include "object_file.h"
+#include "assembler.h"
 
 using namespace std;
 
-int num_globals = 0, num_local_refs = 0, num_unresolved = 0;
-
-char *input_filename = NULL;
-int current_line = 1;
-
-const int max_line = 10000;
-const int max_string = 10000;
-unsigned int address[NUM_SEGMENTS];
-seg_type current_segment;
-const int max_label_length = 30;
-char string_buffer[max_string];
-
-struct label_entry
-{
-	char name[max_label_length];
-	int address;
-	seg_type segment;
-	bool resolved;
-	bool global;
-	label_entry *next;
-	int name_ptr;
-	int line;
-};
+const char assembler_version[] = "wasm 1.5";
 
 // GPR table
 reg_type GPR_table[] = {
@@ -77,37 +61,81 @@ reg_type SPR_table[] = {
 	{"rbase", 13},
 	{NULL, 0}};
 
-enum label_descriptor
+
+assembler::assembler()
+{
+	text_regions = false;
+	line_table = false;
+	label_list = NULL;
+	init();
+}
+
+assembler::~assembler()
 {
-	absolute,
-	relative,
-	immediate
-};
+	cleanup();
+}
 
-struct memory_entry
+bool assembler::assemble(const char *input, const char *output)
 {
-	int line;			  // The line in the program file that caused this entry
-	unsigned int address; // The address that this will lie
-	unsigned int data;	// The data
+	input_filename = input;
+	messages.str("");
+	messages.clear();
+
+	try
+	{
+		process_file(output);
+	}
+	catch (assembly_error &)
+	{
+		return false;
+	}
+	return true;
+}
 
-	char label[max_label_length];	// The name of a label this entry needs resolved
-	label_descriptor reference_type; // The value we want from this label when resolved
-	memory_entry *next;
-};
+bool assembler::assemble(const char *source, size_t length, const char *name, vector<char> &object)
+{
+	input_filename = name;
+	messages.str("");
+	messages.clear();
+	object.clear();
 
-label_entry *label_list = NULL;
-memory_entry *segment[NUM_SEGMENTS], *segment_end[NUM_SEGMENTS];
+	// The source is split into lines in place, so work on a copy
+	vector<char> text(source, source + length);
 
-char symbol_buffer[max_label_length];
+	try
+	{
+		assemble_source(text.empty() ? NULL : &text[0], length);
+		build_object(object);
+		cleanup();
+	}
+	catch (assembly_error &)
+	{
+		object.clear();
+		return false;
+	}
+	return true;
+}
 
-void init()
+bool assemble(const char *source, size_t length, const char *name, vector<char> &object, string &messages)
+{
+	assembler as;
+
+	bool succeeded = as.assemble(source, length, name, object);
+	messages = as.messages.str();
+
+	return succeeded;
+}
+
+void assembler::init()
 {
 	for (int i = 0; i < NUM_SEGMENTS; i++)
 	{
-		segment[i] = NULL;
-		segment_end[i] = NULL;
+		segment[i].clear();
+		fixups[i].clear();
 		address[i] = 0;
 	}
+	line_runs[TEXT].clear();
+	line_runs[DATA].clear();
 
 	current_segment = TEXT;
 
@@ -118,7 +146,7 @@ void init()
 }
 
 // Remove all dynamically allocated data structures
-void cleanup()
+void assembler::cleanup()
 {
 	while (label_list != NULL)
 	{
@@ -126,48 +154,48 @@ void cleanup()
 		delete label_list;
 		label_list = temp;
 	}
+	label_table.clear();
 	for (int i = 0; i < NUM_SEGMENTS; i++)
 	{
-		while (segment[i] != NULL)
-		{
-			memory_entry *temp = segment[i]->next;
-			delete segment[i];
-			segment[i] = temp;
-		}
+		segment[i].clear();
+		fixups[i].clear();
 	}
+	line_runs[TEXT].clear();
+	line_runs[DATA].clear();
 }
 
-void bailout()
+// Give up on the current file
+void assembler::bailout()
 {
 	cleanup();
-	exit(1);
+	throw assembly_error();
 }
 
-// Display an error message and die
-void error(char *filename, int line_no, char *msg, char *param)
+// Record an error message and give up on the current file
+void assembler::error(const char *filename, int line_no, const char *msg, const char *param)
 {
 	if (filename)
-		cerr << filename << ":" << current_line << ": ";
-	cerr << "ERROR: " << msg;
+		messages << filename << ":" << current_line << ": ";
+	messages << "ERROR: " << msg;
 
 	if (param)
-		cerr << "`" << param << "'";
+		messages << "`" << param << "'";
 
-	cerr << endl;
+	messages << endl;
 	bailout();
 }
 
-// Display an warning message
-void warning(char *filename, int line_no, char *msg, char *param)
+// Record a warning message
+void assembler::warning(const char *filename, int line_no, const char *msg, const char *param)
 {
 	if (filename)
-		cerr << filename << ":" << current_line << ": ";
-	cerr << "WARNING: " << msg;
+		messages << filename << ":" << current_line << ": ";
+	messages << "WARNING: " << msg;
 
 	if (param)
-		cerr << "`" << param << "'";
+		messages << "`" << param << "'";
 
-	cerr << endl;
+	messages << endl;
 }
 
 void chew_whitespace(char *&ptr)
@@ -187,7 +215,7 @@ int still_more(char *&ptr)
 }
 
 // This function will parse a symbol, returning true if one is found, or false otherwise
-bool parse_symbol(char *&ptr, char *buffer)
+bool assembler::parse_symbol(char *&ptr, char *buffer)
 {
 	int char_count = 0;
 
@@ -212,7 +240,7 @@ bool parse_symbol(char *&ptr, char *buffer)
 
 // This searches for a reference to a label, creating a new entry
 // if none is found
-label_entry *get_label(char *name)
+label_entry *assembler::get_label(char *name)
 {
 	// Check for a label that is too long
 	int len = strlen(name);
@@ -224,59 +252,37 @@ label_entry *get_label(char *name)
 		error(input_filename, current_line, "Label too long.", NULL);
 
 
-	label_entry *temp = label_list;
-
 	// Check for the label already existing
-	while (temp != NULL)
-	{
-		if (strcmp(temp->name, name) == 0)
-			return temp;
-		temp = temp->next;
-	}
+	label_entry *temp = (label_entry *)label_table.find(name);
+	if (temp != NULL)
+		return temp;
 
 	temp = new label_entry;
 
 	temp->next = label_list;
 	temp->resolved = false;
 	temp->global = false;
+	temp->segment = NONE;
+	temp->address = 0;
+	temp->line = current_line;
 	strcpy(temp->name, name);
 
 	//  cerr << "New label : '" << name << "'\n";
 
 	label_list = temp;
+	label_table.insert(temp->name, temp);
 
 	return label_list;
 }
 
-void clean_up_line(char *&buf)
-{
-	char *temp;
-
-	// Remove any stray newline or carriage return characters
-	temp = buf;
-	while (*temp != '\0')
-	{
-		if (*temp == '\r' || *temp == '\n')
-		{
-			*temp = '\0';
-			break;
-		}
-		temp++;
-	}
-
-	// Change tabs into spaces
-	while ((temp = strchr(buf, '\t')) != NULL)
-		*temp = ' ';
-}
-
-void check_labels(char *&buf)
+void assembler::check_labels(char *&buf, const line_info &info)
 {
 	char *temp;
 	char *comment;
-	comment = strchr(buf, '#');
+	comment = info.comment;
 
 	// Check for a label on this line
-	if ((temp = strchr(buf, ':')) != NULL)
+	if ((temp = info.colon) != NULL)
 	{
 
 		// Check to see if the colon is after a comment marker
@@ -284,7 +290,7 @@ void check_labels(char *&buf)
 			return;
 
 		// Check to see if the colon is within a string
-		if ((strchr(buf, '\"') != NULL) && (strchr(buf, '\"') < temp))
+		if (info.quote != NULL && info.quote < temp)
 			return;
 
 		// Check to see if the colon is a character constant
@@ -323,36 +329,52 @@ void check_labels(char *&buf)
 	}
 }
 
-// This function creates a new empty program entry in the specified segment
-memory_entry *add_entry(seg_type seg_no, int current_line)
+// This function adds a new zeroed word to the end of the specified segment.
+// The pointer returned is only valid until the next word is added.
+unsigned int *assembler::add_entry(seg_type seg_no)
 {
-	memory_entry *new_entry;
-	if (segment[seg_no] == NULL && segment_end[seg_no] == NULL)
-	{
-		new_entry = (segment[seg_no] = (segment_end[seg_no] = new memory_entry));
-	}
-	else
+	segment[seg_no].push_back(0);
+
+	// A new line starts a new run in the line table
+	if (line_table == true && seg_no <= DATA &&
+		(line_runs[seg_no].empty() || line_runs[seg_no].back().line != (unsigned int)current_line))
 	{
-		segment_end[seg_no]->next = (new_entry = new memory_entry);
-		segment_end[seg_no] = new_entry;
+		line_run run = {address[seg_no], (unsigned int)current_line};
+		line_runs[seg_no].push_back(run);
 	}
 
-	if (new_entry == NULL)
-		error(input_filename, current_line, "Assembler error, could not allocate memory.", NULL);
-
-	new_entry->next = NULL;
-	new_entry->line = current_line;
-	new_entry->address = address[seg_no];
-	new_entry->label[0] = 0;
-	new_entry->data = 0;
-
 	// Increment the address counter for this segment
 	address[seg_no]++;
 
-	return new_entry;
+	return &segment[seg_no].back();
+}
+
+// This notes that the last word added to the specified segment needs the
+// value of a label filled in
+void assembler::add_fixup(seg_type seg_no, label_descriptor reference_type, char *label, int current_line)
+{
+	fixup_entry new_fixup;
+
+	new_fixup.line = current_line;
+	new_fixup.address = address[seg_no] - 1;
+	new_fixup.reference_type = reference_type;
+	strcpy(new_fixup.label, label);
+
+	fixups[seg_no].push_back(new_fixup);
+}
+
+// This reserves a run of words in the specified segment without storing
+// them, so they cost the same whatever their size
+void assembler::reserve_space(seg_type seg_no, unsigned int num_words, int current_line)
+{
+	if (num_words > 0x100000 - address[seg_no])
+		error(input_filename, current_line, "Reserved space too large.", NULL);
+
+	// Increment the address counter for this segment
+	address[seg_no] += num_words;
 }
 
-void decode_char(char *&buf, unsigned char &chr)
+void assembler::decode_char(char *&buf, unsigned char &chr)
 {
 	if (*buf == '\\')
 	{
@@ -401,7 +423,7 @@ void decode_char(char *&buf, unsigned char &chr)
 	buf++;
 }
 
-int decode_GPR(char *&ptr)
+int assembler::decode_GPR(char *&ptr)
 {
 	// We must scan until we get an end-of-line ('\0')
 	// or until we see a comma, or until the register is too large
@@ -472,7 +494,7 @@ int decode_GPR(char *&ptr)
 	return reg_no;
 }
 
-int decode_SPR(char *&ptr)
+int assembler::decode_SPR(char *&ptr)
 {
 	// We must scan until we get an end-of-line ('\0')
 	// or until we see a comma, or until the register is too large
@@ -519,7 +541,7 @@ int decode_SPR(char *&ptr)
 	return reg_no;
 }
 
-unsigned int parse_address(char *&ptr)
+unsigned int assembler::parse_address(char *&ptr)
 {
 	unsigned int value = 0;
 
@@ -553,7 +575,7 @@ unsigned int parse_address(char *&ptr)
 	return value;
 }
 
-unsigned int parse_word(char *&ptr)
+unsigned int assembler::parse_word(char *&ptr)
 {
 	unsigned int value = 0;
 
@@ -613,7 +635,7 @@ unsigned int parse_word(char *&ptr)
 	return value;
 }
 
-unsigned int parse_half(char *&ptr)
+unsigned int assembler::parse_half(char *&ptr)
 {
 	unsigned int value = 0;
 
@@ -681,7 +703,7 @@ unsigned int parse_half(char *&ptr)
 	return value;
 }
 
-int parse_string(char *&ptr, char *buffer)
+int assembler::parse_string(char *&ptr, char *buffer)
 {
 	int i = 0;
 
@@ -709,15 +731,263 @@ int parse_string(char *&ptr, char *buffer)
 	return i;
 }
 
-void parse_line(char *buf)
+void assembler::directive_word(char *&operands)
+{
+	if (current_segment != BSS)
+	{
+		if (operands == NULL)
+		{
+			error(input_filename, current_line, "Expecting value or label.", NULL);
+		}
+		chew_whitespace(operands);
+		if (*operands == '\0')
+			error(input_filename, current_line, "Expecting value or label.", NULL);
+		if (strchr(operands, '"') != NULL)
+		{
+			error(input_filename, current_line, "Expecting value or label.", NULL);
+		}
+
+		do
+		{
+			unsigned int *word = add_entry(current_segment);
+			if (isdigit(*operands) || *operands == '-')
+			{
+				*word = parse_word(operands);
+			}
+			else
+			{
+				if (parse_symbol(operands, symbol_buffer))
+				{
+					// This word holds the value of a symbol
+					add_fixup(current_segment, absolute, symbol_buffer, current_line);
+				}
+				else
+				{
+					// This word could be a character in '' or otherwise
+					unsigned char chr;
+					if (*operands == '\'')
+					{
+						// Skip the opening quote
+						operands++;
+						decode_char(operands, chr);
+						// Check and skip the ending quote
+						if (*operands != '\'')
+						{
+							error(input_filename, current_line, "Bad character constant.", NULL);
+						}
+						operands++;
+						*word = chr;
+					}
+					else
+					{
+						// Otherwise is invalid.
+						error(input_filename, current_line, "Expecting value or label.", NULL);
+					}
+				}
+			}
+
+			chew_whitespace(operands);
+
+			if (*operands == ',')
+				operands++;
+
+			chew_whitespace(operands);
+		} while (*operands != '\0');
+
+		if (*(operands - 1) == ',')
+			error(input_filename, current_line, "Expecting value or label.", NULL);
+	}
+	else
+	{
+		reserve_space(current_segment, 1, current_line);
+		if (operands != NULL && operands[0] != 0)
+		{
+			// Attempt to initialise data in the bss segment
+			warning(input_filename, current_line, "Ignoring initial value in .bss segment.", NULL);
+		}
+	}
+}
+
+void assembler::directive_space(char *&operands)
+{
+	if (current_segment != BSS)
+	{
+		error(input_filename, current_line, "Can only use .space directive in .bss segment.", NULL);
+	}
+	// Possible here we should just parse an int (not allow hex values)
+	int num_words = parse_word(operands);
+	// Reserve the appropriate number of data items
+	if (num_words > 0)
+		reserve_space(current_segment, num_words, current_line);
+
+	//      cerr << "operands = '" << operands << "'\n";
+
+	if (still_more(operands))
+		error(input_filename, current_line, "Additional text after directive argument.", NULL);
+}
+
+void assembler::add_string(char *&operands, bool zero_terminate)
+{
+	if (current_segment == BSS)
+	{
+		error(input_filename, current_line, "Cannot specify a string in .bss segment.", NULL);
+	}
+	//cerr << "calling parse_string : " << operands << endl;
+	int len = parse_string(operands, string_buffer);
+
+	for (int i = 0; i < len; i++)
+	{
+		// Add the character
+		*add_entry(current_segment) = string_buffer[i];
+	}
+
+	//      cerr << "left : " << operands << endl;
+	if (still_more(operands))
+		error(input_filename, current_line, "Additional text after string.", NULL);
+
+	// Add the null terminator
+	if (zero_terminate)
+		add_entry(current_segment);
+}
+
+void assembler::directive_ascii(char *&operands)
+{
+	add_string(operands, false);
+}
+
+void assembler::directive_asciiz(char *&operands)
+{
+	add_string(operands, true);
+}
+
+void assembler::directive_equ(char *&operands)
+{
+	unsigned int offset;
+
+	if (operands == NULL)
+	{
+		error(input_filename, current_line, ".equ directive must specify a symbol name and value.", NULL);
+	}
+
+	if (parse_symbol(operands, symbol_buffer) == false)
+		error(input_filename, current_line, "Expected symbol name.", NULL);
+
+	chew_whitespace(operands);
+	if (*operands++ != ',')
+		error(input_filename, current_line, "Expected ',' after symbol name.", NULL);
+
+	// Make the specified symbol
+	label_entry *new_label = get_label(symbol_buffer);
+
+	if (new_label->resolved == true)
+		error(input_filename, current_line, "Duplicate label : ", symbol_buffer);
+
+	offset = parse_word(operands);
+	if (offset > 0x000fffff){
+		error(input_filename, current_line, "Constant is too large", NULL);
+	}
+	new_label->address = offset;
+
+	new_label->line = current_line;
+	new_label->resolved = true;
+	new_label->segment = NONE;
+
+	if (still_more(operands))
+		error(input_filename, current_line, "Additional text after directive arguments.", NULL);
+}
+
+void assembler::directive_data(char *&operands)
+{
+	current_segment = DATA;
+	if (still_more(operands))
+		error(input_filename, current_line, "Additional text after directive.", NULL);
+}
+
+void assembler::directive_text(char *&operands)
+{
+	current_segment = TEXT;
+	if (still_more(operands))
+		error(input_filename, current_line, "Additional text after directive.", NULL);
+}
+
+void assembler::directive_bss(char *&operands)
+{
+	current_segment = BSS;
+	if (still_more(operands))
+		error(input_filename, current_line, "Additional text after directive.", NULL);
+}
+
+void assembler::directive_global(char *&operands)
+{
+	if (operands == NULL || parse_symbol(operands, symbol_buffer) == false)
+		error(input_filename, current_line, "Global directive must specify a label.", NULL);
+
+	// Make the specified label global
+	label_entry *temp = get_label(symbol_buffer);
+	if (temp->global == false)
+	{
+		// Increment the global count
+		num_globals++;
+		temp->global = true;
+		temp->line = current_line;
+	}
+
+	if (still_more(operands))
+		error(input_filename, current_line, "Additional text after directive arguments.", NULL);
+}
+
+// Accepted, but have no effect
+void assembler::directive_ignore(char *&operands)
+{
+}
+
+directive_type assembler::directive_table[] = {
+	{".word", &assembler::directive_word},
+	{".ascii", &assembler::directive_ascii},
+	{".asciiz", &assembler::directive_asciiz},
+	{".space", &assembler::directive_space},
+	{".equ", &assembler::directive_equ},
+	{".global", &assembler::directive_global},
+	{".extern", &assembler::directive_ignore},
+	{".data", &assembler::directive_data},
+	{".text", &assembler::directive_text},
+	{".bss", &assembler::directive_bss},
+	{".frame", &assembler::directive_ignore},
+	{".mask", &assembler::directive_ignore},
+	{NULL, NULL}};
+
+// The handler for each directive in insn_table, indexed in the same way as
+// insn_table, so a looked up mnemonic leads straight to its handler
+directive_handler *assembler::build_directive_handlers()
+{
+	int num_insns = 0;
+	while (insn_table[num_insns].mnemonic != NULL)
+		num_insns++;
+
+	directive_handler *handlers = new directive_handler[num_insns];
+	for (int insn_num = 0; insn_num < num_insns; insn_num++)
+	{
+		handlers[insn_num] = NULL;
+		if (insn_table[insn_num].type != DIRECTIVE)
+			continue;
+
+		for (int i = 0; directive_table[i].name != NULL; i++)
+			if (strcmp(directive_table[i].name, insn_table[insn_num].mnemonic) == 0)
+				handlers[insn_num] = directive_table[i].handler;
+	}
+	return handlers;
+}
+
+directive_handler *assembler::directive_handlers = assembler::build_directive_handlers();
+
+void assembler::parse_line(char *buf, const line_info &info)
 {
 	char *temp;
 
 	//  cerr << "parse_line : " << buf << endl;
 
-	clean_up_line(buf);
 	chew_whitespace(buf);
-	check_labels(buf);
+	check_labels(buf, info);
 
 	//  cerr << "tohere";
 
@@ -742,7 +1012,6 @@ void parse_line(char *buf)
 
 	chew_whitespace(operands);
 
-	int insn_num = 0;
 	unsigned int offset;
 
 	// Convert the mnemonic to lower case
@@ -756,14 +1025,11 @@ void parse_line(char *buf)
 	//  cerr << "up to here...";
 
 	// Here we look up the mnemonic in our table.
-	while (insn_table[insn_num].mnemonic != NULL && (strcmp(insn_table[insn_num].mnemonic, mnemonic) != 0))
-	{
-		insn_num++;
-	}
+	insn_type *insn = lookup_mnemonic(mnemonic);
 
 	//  cerr << "now here...";
 
-	if (insn_table[insn_num].mnemonic == NULL)
+	if (insn == NULL)
 	{
 		//  cerr << "mnemonic is : " << mnemonic << endl;
 		error(input_filename, current_line, "Bad mnemonic : ", mnemonic);
@@ -772,213 +1038,13 @@ void parse_line(char *buf)
 	//  cerr << "then here...";
 
 	// Handle assembler directives
-	if (insn_table[insn_num].type == DIRECTIVE)
+	if (insn->type == DIRECTIVE)
 	{
-		if (strcmp(mnemonic, ".word") == 0)
-		{
-
-			if (current_segment != BSS)
-			{
-				if (operands == NULL)
-				{
-					error(input_filename, current_line, "Expecting value or label.", NULL);
-				}
-				chew_whitespace(operands);
-				if (*operands == '\0')
-					error(input_filename, current_line, "Expecting value or label.", NULL);
-				if (strchr(operands, '"') != NULL)
-				{
-					error(input_filename, current_line, "Expecting value or label.", NULL);
-				}
-
-				do
-				{
-					memory_entry *new_entry = add_entry(current_segment, current_line);
-					if (isdigit(*operands) || *operands == '-')
-					{
-						new_entry->data = parse_word(operands);
-					}
-					else
-					{
-						if (parse_symbol(operands, symbol_buffer))
-						{
-							// This word holds the value of a symbol
-							new_entry->reference_type = absolute;
-							strcpy(new_entry->label, symbol_buffer);
-							new_entry->data = 0;
-						}
-						else
-						{
-							// This word could be a character in '' or otherwise
-							unsigned char chr;
-							if (*operands == '\'')
-							{
-								// Skip the opening quote
-								operands++;
-								decode_char(operands, chr);
-								// Check and skip the ending quote
-								if (*operands != '\'')
-								{
-									error(input_filename, current_line, "Bad character constant.", NULL);
-								}
-								operands++;
-								new_entry->data = chr;
-							}
-							else
-							{
-								// Otherwise is invalid.
-								error(input_filename, current_line, "Expecting value or label.", NULL);
-							}
-						}
-					}
-
-					chew_whitespace(operands);
-
-					if (*operands == ',')
-						operands++;
-
-					chew_whitespace(operands);
-				} while (*operands != '\0');
-
-				if (*(operands - 1) == ',')
-					error(input_filename, current_line, "Expecting value or label.", NULL);
-			}
-			else
-			{
-				memory_entry *new_entry = add_entry(current_segment, current_line);
-				if (operands != NULL && operands[0] != 0)
-				{
-					// Attempt to initialise data in the bss segment
-					warning(input_filename, current_line, "Ignoring initial value in .bss segment.", NULL);
-				}
-				new_entry->data = 0;
-			}
-		}
-		else if (strcmp(mnemonic, ".space") == 0)
-		{
-			if (current_segment != BSS)
-			{
-				error(input_filename, current_line, "Can only use .space directive in .bss segment.", NULL);
-			}
-			// Possible here we should just parse an int (not allow hex values)
-			int num_words = parse_word(operands);
-			// Add the appropriate number of data items
-			for (int i = 0; i < num_words; i++)
-				add_entry(current_segment, current_line);
-
-			//      cerr << "operands = '" << operands << "'\n";
-
-			if (still_more(operands))
-				error(input_filename, current_line, "Additional text after directive argument.", NULL);
-		}
-		else if (strcmp(mnemonic, ".asciiz") == 0 || strcmp(mnemonic, ".ascii") == 0)
-		{
-			if (current_segment == BSS)
-			{
-				error(input_filename, current_line, "Cannot specify a string in .bss segment.", NULL);
-			}
-			memory_entry *new_entry;
-
-			//cerr << "calling parse_string : " << operands << endl;
-			int len = parse_string(operands, string_buffer);
-
-			for (int i = 0; i < len; i++)
-			{
-				// Add the character
-				new_entry = add_entry(current_segment, current_line);
-				new_entry->data = string_buffer[i];
-			}
-
-			//      cerr << "left : " << operands << endl;
-			if (still_more(operands))
-				error(input_filename, current_line, "Additional text after string.", NULL);
-
-			// Add the null terminator
-			if (strcmp(mnemonic, ".asciiz") == 0)
-			{
-				new_entry = add_entry(current_segment, current_line);
-				new_entry->data = 0;
-			}
-		}
-		else if (strcmp(mnemonic, ".equ") == 0)
-		{
-			if (operands == NULL)
-			{
-				error(input_filename, current_line, ".equ directive must specify a symbol name and value.", NULL);
-			}
+		directive_handler handler = directive_handlers[insn - insn_table];
 
-			if (parse_symbol(operands, symbol_buffer) == false)
-				error(input_filename, current_line, "Expected symbol name.", NULL);
-
-			chew_whitespace(operands);
-			if (*operands++ != ',')
-				error(input_filename, current_line, "Expected ',' after symbol name.", NULL);
-
-			// Make the specified symbol
-			label_entry *new_label = get_label(symbol_buffer);
-
-			if (new_label->resolved == true)
-				error(input_filename, current_line, "Duplicate label : ", symbol_buffer);
-
-			offset = parse_word(operands);
-			if (offset > 0x000fffff){
-				error(input_filename, current_line, "Constant is too large", NULL);
-			}
-			new_label->address = offset;
-
-			new_label->line = current_line;
-			new_label->resolved = true;
-			new_label->segment = NONE;
-
-			if (still_more(operands))
-				error(input_filename, current_line, "Additional text after directive arguments.", NULL);
-		}
-		else if (strcmp(mnemonic, ".data") == 0)
-		{
-			current_segment = DATA;
-			if (still_more(operands))
-				error(input_filename, current_line, "Additional text after directive.", NULL);
-		}
-		else if (strcmp(mnemonic, ".text") == 0)
-		{
-			current_segment = TEXT;
-			if (still_more(operands))
-				error(input_filename, current_line, "Additional text after directive.", NULL);
-		}
-		else if (strcmp(mnemonic, ".bss") == 0)
-		{
-			current_segment = BSS;
-			if (still_more(operands))
-				error(input_filename, current_line, "Additional text after directive.", NULL);
-		}
-		else if (strcmp(mnemonic, ".global") == 0)
-		{
-			if (operands == NULL || parse_symbol(operands, symbol_buffer) == false)
-				error(input_filename, current_line, "Global directive must specify a label.", NULL);
-
-			// Make the specified label global
-			label_entry *temp = get_label(symbol_buffer);
-			if (temp->global == false)
-			{
-				// Increment the global count
-				num_globals++;
-				temp->global = true;
-				temp->line = current_line;
-			}
-
-			if (still_more(operands))
-				error(input_filename, current_line, "Additional text after directive arguments.", NULL);
-		}
-		
-		else if (strcmp(mnemonic, ".mask") == 0)
-			;
-		else if (strcmp(mnemonic, ".frame") == 0)
-			;
-		else if (strcmp(mnemonic, ".extern") == 0)
-			;
-		
-		else
+		if (handler == NULL)
 			error(input_filename, current_line, "Unknown directive : ", mnemonic);
+		(this->*handler)(operands);
 		return;
 	}
 
@@ -994,38 +1060,37 @@ void parse_line(char *buf)
 		error(input_filename, current_line, "Instructions not permitted in bss segment.", NULL);
 	}
 
-	memory_entry *new_entry = add_entry(current_segment, current_line);
-	new_entry->data = 0;
+	unsigned int *word = add_entry(current_segment);
 
 	// Copy in the func & OPCode fields
-	new_entry->data |= (insn_table[insn_num].OPCode << 28);
-	new_entry->data |= (insn_table[insn_num].func << 16);
+	*word |= (insn->OPCode << 28);
+	*word |= (insn->func << 16);
 
 	//  cerr << "here.\n";
 	// Scan through the operand format string
-	for (unsigned int i = 0; i < strlen(insn_table[insn_num].operands); i++)
+	for (unsigned int i = 0; i < strlen(insn->operands); i++)
 	{
-		//    cerr << "parsing : '" << insn_table[insn_num].operands[i] << "'\n";
+		//    cerr << "parsing : '" << insn->operands[i] << "'\n";
 		chew_whitespace(operands);
 		if (operands == NULL || *operands == '\0')
 			error(input_filename, current_line, "Expecting more on line.", NULL);
 		//    cerr << "done.\n";
-		switch (insn_table[insn_num].operands[i])
+		switch (insn->operands[i])
 		{
 		case 'd':
-			new_entry->data |= (decode_GPR(operands) & 0xf) << 24;
+			*word |= (decode_GPR(operands) & 0xf) << 24;
 			break;
 		case 'D':
-			new_entry->data |= (decode_SPR(operands) & 0xf) << 24;
+			*word |= (decode_SPR(operands) & 0xf) << 24;
 			break;
 		case 's':
-			new_entry->data |= (decode_GPR(operands) & 0xf) << 20;
+			*word |= (decode_GPR(operands) & 0xf) << 20;
 			break;
 		case 'S':
-			new_entry->data |= (decode_SPR(operands) & 0xf) << 20;
+			*word |= (decode_SPR(operands) & 0xf) << 20;
 			break;
 		case 't':
-			new_entry->data |= (decode_GPR(operands) & 0xf);
+			*word |= (decode_GPR(operands) & 0xf);
 			break;
 		case 'o': // Twenty bit offset
 
@@ -1108,8 +1173,7 @@ void parse_line(char *buf)
 				}
 
 				// Make a note of this label
-				new_entry->reference_type = absolute;
-				strcpy(new_entry->label, symbol_buffer);
+				add_fixup(current_segment, absolute, symbol_buffer, current_line);
 
 				offset &= 0xfffff;
 			}
@@ -1117,36 +1181,34 @@ void parse_line(char *buf)
 			if (offset > 0xfffff)
 				error(input_filename, current_line, "Constant too large.", NULL);
 
-			new_entry->data |= (offset & 0xfffff);
+			*word |= (offset & 0xfffff);
 
-			//     cerr << "data here is : 0x" << setw(8) << hex << setfill('0') << new_entry->data << endl;
+			//     cerr << "data here is : 0x" << setw(8) << hex << setfill('0') << *word << endl;
 			break;
 		case 'b':
 			if (parse_symbol(operands, symbol_buffer) == false)
 				error(input_filename, current_line, "Label expected.", NULL);
 
-			new_entry->reference_type = relative;
-			strcpy(new_entry->label, symbol_buffer);
+			add_fixup(current_segment, relative, symbol_buffer, current_line);
 			break;
 		case 'i': // 16 bit immediate value
 			// Must be lower cased
-			new_entry->data |= (parse_half(operands) & 0xffff);
+			*word |= (parse_half(operands) & 0xffff);
 			break;
 		case 'j':
 			if (*operands == '0' && tolower(*(operands + 1)) == 'x')
 			{
-				new_entry->data |= (parse_address(operands) & 0xfffff);
+				*word |= (parse_address(operands) & 0xfffff);
 			}
 			else
 			{
 				if (parse_symbol(operands, symbol_buffer) == false)
 					error(input_filename, current_line, "Label expected.", NULL);
-				new_entry->reference_type = absolute;
-				strcpy(new_entry->label, symbol_buffer);
+				add_fixup(current_segment, absolute, symbol_buffer, current_line);
 			}
 			break;
 		default:
-			if (*operands != insn_table[insn_num].operands[i])
+			if (*operands != insn->operands[i])
 			{
 				error(input_filename, current_line, "Unexpected character encountered on line.", NULL);
 			}
@@ -1161,105 +1223,284 @@ void parse_line(char *buf)
 
 // This function will resolve all the label references that it can within the text segment
 // After this only external absolute references should remain unresolved
-void resolve_labels()
+void assembler::resolve_labels()
 {
 	for (int i = 0; i < NUM_SEGMENTS; i++)
 		if (i == TEXT || i == DATA)
 		{
 			// The only unresolved labels should be in the text segment or the data segment
-			memory_entry *walk = segment[i];
-
-			// Walk through the text segment
-			while (walk != NULL)
+			for (unsigned int j = 0; j < fixups[i].size(); j++)
 			{
-				current_line = walk->line;
+				fixup_entry &fixup = fixups[i][j];
+				unsigned int &data = segment[i][fixup.address];
 
-				// If this line refers to a label
-				if (walk->label[0] != '\0')
-				{
-					// We must get the entry for this label
-					label_entry *temp = get_label(walk->label);
+				current_line = fixup.line;
 
-					// cerr << "checking out reference to " << walk->label << endl;
+				// We must get the entry for this label
+				label_entry *temp = get_label(fixup.label);
 
-					// If we have resolved this label
-					if (temp->resolved == true)
-					{
+				// cerr << "checking out reference to " << fixup.label << endl;
 
-						// We have found the label now we resolve the address
-						// Check to see if we are looking for an absolute address or a branch
-						switch (walk->reference_type)
-						{
-						case absolute:
-									//cerr << "changed absolute data from 0x" << setw(8) << setfill('0') << hex << walk->data;
-							walk->data = (walk->data&0xfff00000) | ((temp->address + walk->data) & 0xfffff); //adding location
-									//cerr << " to 0x" << setw(8) << setfill('0') << hex << walk->data << endl;
-							break;
-						case relative:
-							walk->data |= ((unsigned)((signed)temp->address - ((signed)walk->address + 1))) & 0xfffff;
-							break;
-						case immediate:
-							walk->data |= temp->address & 0xffff;
-							break;
-						}
-					}
+				// If we have resolved this label
+				if (temp->resolved == true)
+				{
 
-					// Check for branches to unresolved addresses - not allowed
-					if (walk->reference_type == relative && temp->resolved == false)
+					// We have found the label now we resolve the address
+					// Check to see if we are looking for an absolute address or a branch
+					switch (fixup.reference_type)
 					{
-						error(input_filename, walk->line, "Branch target cannot be external : ", temp->name);
+					case absolute:
+						data = (data&0xfff00000) | ((temp->address + data) & 0xfffff); //adding location
+						break;
+					case relative:
+						data |= ((unsigned)((signed)temp->address - ((signed)fixup.address + 1))) & 0xfffff;
+						break;
+					case immediate:
+						data |= temp->address & 0xffff;
+						break;
 					}
+				}
 
-					// Count the number of internal absolute label references
-					if (walk->reference_type == absolute && temp->resolved == true && temp->segment != NONE)
-					{
-						num_local_refs++;
-					}
+				// Check for branches to unresolved addresses - not allowed
+				if (fixup.reference_type == relative && temp->resolved == false)
+				{
+					error(input_filename, fixup.line, "Branch target cannot be external : ", temp->name);
+				}
 
-					// Count the number of external absolute label references
-					if (walk->reference_type == absolute && temp->resolved == false)
-					{
-						//	cout << "Unresolved reference : " << walk->label << endl;
-						num_unresolved++;
-					}
+				// Count the number of internal absolute label references
+				if (fixup.reference_type == absolute && temp->resolved == true && temp->segment != NONE)
+				{
+					num_local_refs++;
+				}
+
+				// Count the number of external absolute label references
+				if (fixup.reference_type == absolute && temp->resolved == false)
+				{
+					//	cout << "Unresolved reference : " << fixup.label << endl;
+					num_unresolved++;
 				}
-				walk = walk->next;
 			}
 		}
 }
 
-void process_file(char* output_filename)
+// Finds where the text segment can be split into regions. A region starts
+// at a global label, as long as the code before it can't run on into it and
+// no branch crosses into or out of it, since branches aren't relocated.
+void assembler::find_text_regions(vector<unsigned int> &starts)
 {
-	int i;
+	unsigned int i;
 
-	ifstream sourcefile;
-	sourcefile.open(input_filename, ios::in);
+	for (label_entry *temp = label_list; temp != NULL; temp = temp->next)
+	{
+		if (temp->global == true && temp->resolved == true && temp->segment == TEXT &&
+			temp->address > 0 && (unsigned int)temp->address < address[TEXT])
+		{
+			// Only after a j, jr or rfe, which never carry on to the next word
+			unsigned int before = segment[TEXT][temp->address - 1];
+			if ((before >> 28) == 0x4 || (before >> 28) == 0x5 || ((before >> 28) == 0x2 && ((before >> 16) & 0xf) == 0xe))
+				starts.push_back(temp->address);
+		}
+	}
 
-	if (!sourcefile)
+	sort(starts.begin(), starts.end());
+	starts.erase(unique(starts.begin(), starts.end()), starts.end());
+
+	// Count the branches crossing each start, each branch covers the starts
+	// after the lower of its address and target, up to the higher
+	vector<int> crossings(starts.size() + 1, 0);
+	for (i = 0; i < fixups[TEXT].size(); i++)
 	{
-		error(NULL, 0, "Could not open input file : ", input_filename);
+		fixup_entry &fixup = fixups[TEXT][i];
+		if (fixup.reference_type != relative)
+			continue;
+
+		unsigned int target = get_label(fixup.label)->address;
+		unsigned int low = min(fixup.address, target);
+		unsigned int high = max(fixup.address, target);
+
+		crossings[upper_bound(starts.begin(), starts.end(), low) - starts.begin()]++;
+		crossings[upper_bound(starts.begin(), starts.end(), high) - starts.begin()]--;
 	}
 
-	init();
+	unsigned int num_starts = 0;
+	int crossing = 0;
+	for (i = 0; i < starts.size(); i++)
+	{
+		crossing += crossings[i];
+		if (crossing == 0)
+			starts[num_starts++] = starts[i];
+	}
+	starts.resize(num_starts);
+}
+
+// Reads everything left in a file that couldn't be mapped
+void assembler::read_source(int fd, vector<char> &buffer)
+{
+	const size_t chunk = 65536;
+	size_t length = 0;
+	ssize_t count;
+
+	do
+	{
+		buffer.resize(length + chunk);
+		count = read(fd, &buffer[length], chunk);
+		if (count < 0)
+		{
+			error(NULL, 0, "Could not read input file : ", input_filename);
+		}
+		length += count;
+	} while (count > 0);
+
+	buffer.resize(length);
+}
 
-	char buffer[max_line];
+// Splits the source text into lines and parses each of them. This is a
+// single pass which terminates each line in place, turns tabs into spaces,
+// drops anything from a carriage return on, and notes where the first
+// colon, comment marker and quote are so they needn't be searched for.
+void assembler::parse_source(char *text, size_t length)
+{
+	char *end = text + length;
+	char *line = text;
+	vector<char> last_line;
 
-	while (!sourcefile.eof())
+	while (line < end)
 	{
-		// Read a line from the sourcefile
-		sourcefile.getline(buffer, max_line);
-		if (sourcefile.bad())
+		line_info info = {NULL, NULL, NULL};
+		bool truncated = false;
+		char *ptr;
+
+		for (ptr = line; ptr < end && *ptr != '\n'; ptr++)
 		{
-			error(NULL, 0, "Source file is directory : ", input_filename);
+			if (truncated)
+				continue;
+
+			switch (*ptr)
+			{
+			case '\t':
+				*ptr = ' ';
+				break;
+			case '\r':
+			case '\0':
+				*ptr = '\0';
+				truncated = true;
+				break;
+			case ':':
+				if (info.colon == NULL)
+					info.colon = ptr;
+				break;
+			case '#':
+				if (info.comment == NULL)
+					info.comment = ptr;
+				break;
+			case '"':
+				if (info.quote == NULL)
+					info.quote = ptr;
+				break;
+			}
 		}
-		parse_line(buffer);
+
+		if (ptr < end)
+		{
+			*ptr = '\0';
+			parse_line(line, info);
+		}
+		else
+		{
+			// There is no newline at the end of the file to terminate the
+			// last line on, so that line gets copied
+			last_line.assign(line, ptr);
+			last_line.push_back('\0');
+
+			char *copy = &last_line[0];
+			if (info.colon != NULL)
+				info.colon = copy + (info.colon - line);
+			if (info.comment != NULL)
+				info.comment = copy + (info.comment - line);
+			if (info.quote != NULL)
+				info.quote = copy + (info.quote - line);
+
+			parse_line(copy, info);
+		}
+
 		current_line++;
+		line = ptr + 1;
 	}
+}
 
-	sourcefile.close();
+// Assembles a source file, writing the object file out
+void assembler::process_file(const char *output_filename)
+{
+	int fd = open(input_filename, O_RDONLY);
 
-	// Resolve internal references
-	resolve_labels();
+	if (fd < 0)
+	{
+		error(NULL, 0, "Could not open input file : ", input_filename);
+	}
+
+	struct stat info;
+	if (fstat(fd, &info) < 0)
+	{
+		close(fd);
+		error(NULL, 0, "Could not open input file : ", input_filename);
+	}
+	if (S_ISDIR(info.st_mode))
+	{
+		close(fd);
+		error(NULL, 0, "Source file is directory : ", input_filename);
+	}
+
+	// Regular files are mapped privately so that lines can be terminated in
+	// place, anything else (like a pipe) is read into memory
+	char *source = NULL;
+	size_t source_length = 0;
+	vector<char> read_buffer;
+
+	if (S_ISREG(info.st_mode) && info.st_size > 0)
+	{
+		source_length = info.st_size;
+		source = (char *)mmap(NULL, source_length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+		if (source == MAP_FAILED)
+			source = NULL;
+		else
+			madvise(source, source_length, MADV_SEQUENTIAL);
+	}
+
+	if (source == NULL)
+	{
+		try
+		{
+			read_source(fd, read_buffer);
+		}
+		catch (assembly_error &)
+		{
+			close(fd);
+			throw;
+		}
+		source_length = read_buffer.size();
+		if (source_length > 0)
+			source = &read_buffer[0];
+	}
+
+	close(fd);
+
+	bool mapped = (source != NULL && read_buffer.empty());
+	try
+	{
+		assemble_source(source, source_length);
+	}
+	catch (assembly_error &)
+	{
+		if (mapped)
+			munmap(source, source_length);
+		throw;
+	}
+
+	if (mapped)
+		munmap(source, source_length);
+
+	vector<char> object;
+	build_object(object);
 
 	ofstream outputfile;
 
@@ -1270,9 +1511,32 @@ void process_file(char* output_filename)
 		error(NULL, 0, "Could not open output file : ", output_filename);
 	}
 
-	object_header obj_header;
+	outputfile.write(&object[0], object.size());
+	outputfile.close();
+
+	// Clean up our data structures
+	cleanup();
+}
+
+// Parses the source text, which is modified in place, and resolves all the
+// labels that can be
+void assembler::assemble_source(char *text, size_t length)
+{
+	init();
 
-	obj_header.magic_number = OBJ_MAGIC_NUM;
+	parse_source(text, length);
+
+	// Resolve internal references
+	resolve_labels();
+}
+
+// Lays out the object file for everything that has been assembled
+void assembler::build_object(vector<char> &object)
+{
+	int i;
+
+	// Only the sizes are kept here, the file itself is laid out by object_builder
+	object_header obj_header;
 
 	obj_header.text_seg_size = address[TEXT];
 	//  cout << ".text size : " << obj_header.text_seg_size << " words\n";
@@ -1280,7 +1544,11 @@ void process_file(char* output_filename)
 	//  cout << ".data size : " << obj_header.data_seg_size << " words\n";
 	obj_header.bss_seg_size = address[BSS];
 
-	obj_header.num_references = num_globals + num_local_refs + num_unresolved;
+	vector<unsigned int> region_starts;
+	if (text_regions == true)
+		find_text_regions(region_starts);
+
+	obj_header.num_references = num_globals + num_local_refs + num_unresolved + region_starts.size();
 	//  cout << "num globals : " << num_globals << endl;
 	//  cout << "num unresolved absolute : " << num_unresolved << endl;
 	//  cout << "num resolved absolute : " << num_local_refs << endl;
@@ -1294,55 +1562,38 @@ void process_file(char* output_filename)
 		{
 			obj_header.symbol_name_table_size += strlen(temp->name) + 1;
 		}
+
+		// Complain about declared globals which aren't in this file
+		if (temp->global == true && temp->resolved == false)
+		{
+			error(input_filename, temp->line, "Unresolved global : ", temp->name);
+		}
 		temp = temp->next;
 	}
 
 	//  cout << "length of symbols : " << obj_header.symbol_name_table_size << endl;
 
-	// Write the header to the object file
-	outputfile.write((char *)&obj_header, sizeof(obj_header));
-
-	//  cout << endl;
-
-	// Write the text segment
-	memory_entry *walk = segment[TEXT];
-	//  cout << ".text segment\n";
-	for (i = 0; i < (int)obj_header.text_seg_size; i++)
-	{
-		//    cout << "0x" << setw(5) << hex << setfill('0') << i << "  "
-		//	 << setw(8) << hex << setfill('0') << walk->data << endl;
-		// Write one word of data
-		outputfile.write((char *)&(walk->data), sizeof(walk->data));
-		walk = walk->next;
-	}
-
-	if (walk != NULL)
+	// Sanity check that the segments hold what the address counters say
+	if (segment[TEXT].size() != obj_header.text_seg_size)
 	{
 		error(NULL, 0, "Assembler error : .text segment larger than thought", NULL);
 	}
-
-	//  cout << endl;
-
-	// Write the data segment
-	walk = segment[DATA];
-	//  cout << ".data segment\n";
-	for (i = 0; i < (int)obj_header.data_seg_size; i++)
-	{
-		//    cout << "0x" << setw(5) << hex << setfill('0') << i << "  "
-		//	 << setw(8) << hex << setfill('0') << walk->data << endl;
-		// Write one word of data
-		outputfile.write((char *)&(walk->data), sizeof(walk->data));
-		walk = walk->next;
-	}
-
-	if (walk != NULL)
+	if (segment[DATA].size() != obj_header.data_seg_size)
 	{
 		error(NULL, 0, "Assembler error : .data segment larger than thought", NULL);
 	}
 
+	object_builder builder(obj_header.text_seg_size, obj_header.data_seg_size, obj_header.bss_seg_size);
+
+	// Write the text and data segments, each is stored contiguously so
+	// can be written out in one go
+	builder.add_words(SECTION_TEXT, segment[TEXT].empty() ? NULL : &segment[TEXT][0], segment[TEXT].size(), segment[TEXT].size());
+	builder.add_words(SECTION_DATA, segment[DATA].empty() ? NULL : &segment[DATA][0], segment[DATA].size(), segment[DATA].size());
+
 	char *symbol_names = new char[obj_header.symbol_name_table_size];
 	char *ptr = symbol_names;
 	reloc_entry *relocation_array = new reloc_entry[obj_header.num_references];
+	memset(relocation_array, 0, sizeof(reloc_entry) * obj_header.num_references);
 	int reloc_num = 0;
 
 	temp = label_list;
@@ -1362,12 +1613,6 @@ void process_file(char* output_filename)
 		if (temp->global == true)
 		{
 
-			// Warn about declared globals which aren't in this file
-			if (temp->resolved == false)
-			{
-				error(input_filename, temp->line, "Unresolved global : ", temp->name);
-			}
-
 			// Fill in the address details
 			relocation_array[reloc_num].address = temp->address;
 			relocation_array[reloc_num].symbol_ptr = temp->name_ptr;
@@ -1390,25 +1635,24 @@ void process_file(char* output_filename)
 	for (i = 0; i < NUM_SEGMENTS; i++)
 		if (i == TEXT || i == DATA)
 		{
-			walk = segment[i];
-
-			while (walk != NULL)
+			for (unsigned int j = 0; j < fixups[i].size(); j++)
 			{
-				if (walk->label[0] != '\0' && walk->reference_type == absolute)
+				fixup_entry &fixup = fixups[i][j];
+
+				if (fixup.reference_type == absolute)
 				{
-					temp = get_label(walk->label);
+					temp = get_label(fixup.label);
 
 					// If this is a local symbol reference like an .equ then we don't include
-					// it in the object file
-					if (temp->segment != NONE)
+					// it in the object file, external references are always included
+					if (temp->resolved == false || temp->segment != NONE)
 					{
-						relocation_array[reloc_num].address = walk->address;
+						relocation_array[reloc_num].address = fixup.address;
 						relocation_array[reloc_num].source_seg = (seg_type)i;
 
 						if (temp->resolved == true)
 						{
 							// This is a local resolved reference
-							//	    cerr << " local resolved reference! '" << walk->label << "'\n";
 							if (temp->segment == TEXT)
 								relocation_array[reloc_num].type = TEXT_LABEL_REF;
 							else if (temp->segment == DATA)
@@ -1426,99 +1670,31 @@ void process_file(char* output_filename)
 						reloc_num++;
 					}
 				}
-				walk = walk->next;
-			}
-		}
-	// Write the relocation array
-	outputfile.write((char *)relocation_array, (sizeof(reloc_entry) * obj_header.num_references));
-	// Write the symbol names
-	outputfile.write(symbol_names, obj_header.symbol_name_table_size);
-
-	outputfile.close();
-
-	// Clean up our data structures
-	cleanup();
-
-	delete[] relocation_array;
-	delete[] symbol_names;
-}
-
-void usage(char *progname)
-{
-	cerr << "USAGE: " << progname << " [-o output] file[s]\n";
-	cerr << "Multiple files can be specified if -o is omitted\n";
-	exit(1);
-}
-
-int main(int argc, char *argv[])
-{
-	int i;
-	int num_filenames = 0;
-	char* input_filenames[300];
-	char output_filename[300] = {0};
-
-	if (argc < 2)
-		usage(argv[0]);
-
-	// Here we must parse the arguments
-	for (i = 1; i < argc; i++)
-	{
-		// Is this an option
-		if (argv[i][0] == '-')
-		{
-			// This is the only valid option
-			if (strcmp(argv[i], "-o") == 0)
-			{
-				if ((i + 1) == argc)
-					usage(argv[0]);
-
-				// Redefinition of the output file
-				if (output_filename[0] != '\0')
-					usage(argv[0]);
-
-				i++;
-				strcpy(output_filename, argv[i]);
 			}
-			else
-				usage(argv[0]);
 		}
-		else
-		{
-			if (argv[i] == NULL)
-			{
-				usage(argv[0]);
-			}
-			// Otherwise it is a filename
-			input_filenames[num_filenames++] = argv[i];
-		}
-	}
 
-	// -o along with multiple filenames is disallowed
-	if (num_filenames == 0 || (num_filenames > 1 && output_filename[0] != '\0'))
+	// And where each region of the text segment starts
+	for (unsigned int j = 0; j < region_starts.size(); j++)
 	{
-		usage(argv[0]);
+		relocation_array[reloc_num].address = region_starts[j];
+		relocation_array[reloc_num].source_seg = TEXT;
+		relocation_array[reloc_num].type = TEXT_REGION;
+		reloc_num++;
 	}
 
-	for (i = 0; i < num_filenames; i++)
-	{
-		input_filename = input_filenames[i];
-
-		if (output_filename[0] == '\0' || num_filenames > 1)
-		{
-			// Try to strip .S or .s and add .o
-			// Failing that, just add .o
-			strcpy(output_filename, input_filename);
-
-			int len = strlen(output_filename);
-
-			if (len > 1 && output_filename[len - 2] == '.' && toupper(output_filename[len - 1]) == 'S')
-				output_filename[len - 1] = 'o';
-			else
-				strcat(output_filename, ".o");
-		}
+	// Write the relocation array, packed
+	if (!builder.add_packed_relocs(relocation_array, obj_header.num_references, symbol_names, obj_header.symbol_name_table_size))
+		builder.add_relocs(relocation_array, obj_header.num_references);
+	// Write the symbol names
+	builder.add_bytes(SECTION_NAMES, symbol_names, obj_header.symbol_name_table_size, 0);
+	// And an index of them, so a file can be searched for a name without reading the relocations
+	builder.add_symbol_index(relocation_array, obj_header.num_references, symbol_names, obj_header.symbol_name_table_size);
+	// And the source line of each word, for the tools that trace addresses back to the source
+	if (line_table == true)
+		builder.add_line_table(input_filename, line_runs);
 
-		process_file(output_filename);
-	}
+	builder.finish(object);
 
-	return 0;
+	delete[] relocation_array;
+	delete[] symbol_names;
 }
@@ -0,0 +1,199 @@
+/*
+########################################################################
+# This file is part of the toolchain for WRAMP assembly
+#
+# Copyright (C) 2019 The University of Waikato, Hamilton, New Zealand.
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <https://www.gnu.org/licenses/>.
+########################################################################
+*/
+
+#ifndef ASSEMBLER_H
+#define ASSEMBLER_H
+
+#include <stddef.h>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "object_file.h"
+#include "symbol_table.h"
+
+const int max_string = 10000;
+const int max_label_length = 30;
+
+struct label_entry
+{
+	char name[max_label_length];
+	int address;
+	seg_type segment;
+	bool resolved;
+	bool global;
+	label_entry *next;
+	int name_ptr;
+	int line;
+};
+
+enum label_descriptor
+{
+	absolute,
+	relative,
+	immediate
+};
+
+// A word in a segment that refers to a label, and so must be filled in once
+// the label is known. Most words don't, so these are kept apart from the words.
+struct fixup_entry
+{
+	int line;			  // The line in the program file that caused this entry
+	unsigned int address; // The address of the word to fill in
+
+	char label[max_label_length];	// The name of a label this entry needs resolved
+	label_descriptor reference_type; // The value we want from this label when resolved
+};
+
+// Where the characters that matter when looking for a label first appear on
+// a line. These are found while the line is split out of the source.
+struct line_info
+{
+	char *colon;
+	char *comment;
+	char *quote;
+};
+
+// Thrown by error() to abandon the file being assembled
+struct assembly_error
+{
+};
+
+class assembler;
+
+// Assembler directives. Each handler is given the (possibly NULL) text
+// following the directive on the line.
+typedef void (assembler::*directive_handler)(char *&operands);
+
+struct directive_type
+{
+	char *name;
+	directive_handler handler;
+};
+
+// All the state needed to assemble one source file. Each file being
+// assembled has its own, so that several files can be assembled at once.
+class assembler
+{
+public:
+	assembler();
+	~assembler();
+
+	// Assembles one source file into an object file, returning false if there
+	// was an error. Errors and warnings for just this file are collected in
+	// messages, so the same assembler can be used for one file after another.
+	bool assemble(const char *input, const char *output);
+	// The same, but for source text held in memory, giving the object file
+	// back in memory. The name is only used in messages.
+	bool assemble(const char *source, size_t length, const char *name, std::vector<char> &object);
+
+	std::ostringstream messages;
+
+	// Split the text segment into a region for each global label where it
+	// is safe to, so that wlink can drop the ones that are never used
+	bool text_regions;
+	// Record the source line each word of the text and data segments came
+	// from, in a line table in the object file
+	bool line_table;
+
+private:
+	int num_globals, num_local_refs, num_unresolved;
+
+	const char *input_filename;
+	int current_line;
+
+	unsigned int address[NUM_SEGMENTS];
+	seg_type current_segment;
+	char string_buffer[max_string];
+
+	label_entry *label_list;
+	// Hash index over label_list, keyed on the name held in each label_entry
+	symbol_table label_table;
+	// The words of each segment, stored contiguously, and the fixups for each
+	// segment in address order
+	std::vector<unsigned int> segment[NUM_SEGMENTS];
+	std::vector<fixup_entry> fixups[NUM_SEGMENTS];
+	// The runs of words from each line, in the text and data segments
+	std::vector<line_run> line_runs[2];
+
+	char symbol_buffer[max_label_length];
+
+	static directive_type directive_table[];
+	static directive_handler *directive_handlers;
+	static directive_handler *build_directive_handlers();
+
+	void init();
+	void cleanup();
+	void bailout();
+	void error(const char *filename, int line_no, const char *msg, const char *param);
+	void warning(const char *filename, int line_no, const char *msg, const char *param);
+
+	bool parse_symbol(char *&ptr, char *buffer);
+	label_entry *get_label(char *name);
+	void check_labels(char *&buf, const line_info &info);
+	unsigned int *add_entry(seg_type seg_no);
+	void add_fixup(seg_type seg_no, label_descriptor reference_type, char *label, int current_line);
+	void reserve_space(seg_type seg_no, unsigned int num_words, int current_line);
+
+	void decode_char(char *&buf, unsigned char &chr);
+	int decode_GPR(char *&ptr);
+	int decode_SPR(char *&ptr);
+	unsigned int parse_address(char *&ptr);
+	unsigned int parse_word(char *&ptr);
+	unsigned int parse_half(char *&ptr);
+	int parse_string(char *&ptr, char *buffer);
+
+	void directive_word(char *&operands);
+	void directive_space(char *&operands);
+	void add_string(char *&operands, bool zero_terminate);
+	void directive_ascii(char *&operands);
+	void directive_asciiz(char *&operands);
+	void directive_equ(char *&operands);
+	void directive_data(char *&operands);
+	void directive_text(char *&operands);
+	void directive_bss(char *&operands);
+	void directive_global(char *&operands);
+	void directive_ignore(char *&operands);
+
+	void parse_line(char *buf, const line_info &info);
+	void resolve_labels();
+	void find_text_regions(std::vector<unsigned int> &starts);
+	void read_source(int fd, std::vector<char> &buffer);
+	void parse_source(char *text, size_t length);
+	void assemble_source(char *text, size_t length);
+	void build_object(std::vector<char> &object);
+	void process_file(const char *output_filename);
+
+	// Not copyable, the labels would end up shared
+	assembler(const assembler &);
+	assembler &operator=(const assembler &);
+};
+
+// Assembles source text held in memory into an object file, without
+// touching the filesystem. Returns false if there were errors. Any errors
+// and warnings are returned in messages.
+bool assemble(const char *source, size_t length, const char *name, std::vector<char> &object, std::string &messages);
+
+// Identifies the assembler in the keys of wasm's object cache. This must be
+// changed whenever the same source could assemble to a different object file.
+extern const char assembler_version[];
+
+#endif
@@ -154,170 +154,237 @@ char *SPR_name[] = {
 	"$evec", "$ear", "$esp", "$ers",
 	"$ptable", "$rbase", "$spr14", "$spr15"};
 
-void disassemble(unsigned int insn_address, unsigned int instruction)
+// A perfect hash of the mnemonics in insn_table. The seed is searched for at
+// startup until every mnemonic lands in its own slot, so a lookup is a single
+// hash and a single strcmp.
+const unsigned int mnemonic_hash_size = 1024;
+static short mnemonic_slot[mnemonic_hash_size]; // insn_table index + 1, or 0 if empty
+static unsigned int mnemonic_seed;
+
+static unsigned int hash_mnemonic(const char *mnemonic, unsigned int seed)
 {
-	// First we scan through to find the mnemonic
-	unsigned int OPCode = (instruction >> 28) & 0xf;
-	unsigned int func = (instruction >> 16) & 0xf;
-	unsigned int Rd = (instruction >> 24) & 0xf;
-	unsigned int Rs = (instruction >> 20) & 0xf;
-	unsigned int Rt = (instruction & 0xf);
-	unsigned int immediate = instruction & 0xffff;
-	//  int signed_immediate = ((immediate & 0x8000) ? (0xffff0000 | immediate) : immediate);
-	unsigned int address = instruction & 0xfffff;
-	int signed_address = ((address & 0x80000) ? (0xfff00000 | address) : address);
+	unsigned int hash = 2166136261u ^ seed;
 
-	int insn_num = 0;
+	while (*mnemonic != '\0')
+	{
+		hash ^= (unsigned char)*mnemonic++;
+		hash *= 16777619u;
+	}
+	// Mix the high bits down into the slot index
+	hash ^= hash >> 15;
+	hash *= 0x2c1b3c6du;
+	hash ^= hash >> 12;
+	return hash & (mnemonic_hash_size - 1);
+}
 
-	// Here we look up the mnemonic in our table.
-	while (insn_table[insn_num].mnemonic != NULL)
+static bool build_mnemonic_hash()
+{
+	for (mnemonic_seed = 0; mnemonic_seed < 100000; mnemonic_seed++)
 	{
-		if (insn_table[insn_num].OPCode == OPCode && (insn_table[insn_num].type == J_TYPE || insn_table[insn_num].func == func))
-			break; // We have a match
-		insn_num++;
+		bool collision = false;
+		memset(mnemonic_slot, 0, sizeof(mnemonic_slot));
+
+		for (int insn_num = 0; insn_table[insn_num].mnemonic != NULL && !collision; insn_num++)
+		{
+			unsigned int slot = hash_mnemonic(insn_table[insn_num].mnemonic, mnemonic_seed);
+			if (mnemonic_slot[slot] == 0)
+				mnemonic_slot[slot] = insn_num + 1;
+			else if (strcmp(insn_table[mnemonic_slot[slot] - 1].mnemonic, insn_table[insn_num].mnemonic) != 0)
+				collision = true;
+		}
+
+		if (!collision)
+			return true;
 	}
 
-	// If we couldn't match an instruction
-	if (insn_table[insn_num].mnemonic == NULL)
+	// Should insn_table ever grow too large for a seed to be found, lookups
+	// fall back to scanning the table
+	return false;
+}
+
+// Static initialisation, before main() can look anything up
+static bool mnemonic_hash_perfect = build_mnemonic_hash();
+
+insn_type *lookup_mnemonic(const char *mnemonic)
+{
+	if (!mnemonic_hash_perfect)
 	{
-		cout << "???";
-		return;
+		for (int insn_num = 0; insn_table[insn_num].mnemonic != NULL; insn_num++)
+			if (strcmp(insn_table[insn_num].mnemonic, mnemonic) == 0)
+				return &insn_table[insn_num];
+		return NULL;
 	}
 
-	// Output the mnemonic
-	cout << insn_table[insn_num].mnemonic << "\t";
+	short slot = mnemonic_slot[hash_mnemonic(mnemonic, mnemonic_seed)];
+	if (slot == 0 || strcmp(insn_table[slot - 1].mnemonic, mnemonic) != 0)
+		return NULL;
+	return &insn_table[slot - 1];
+}
 
-	// Now the parameters
+// Decode table, indexed by (OPCode << 4) | func. J type instructions ignore
+// the func field so they fill all sixteen of their slots.
+insn_type *decode_table[256];
 
-	// Scan through the operand format string
-	for (int i = 0; (unsigned int)i < strlen(insn_table[insn_num].operands); i++)
+static bool build_decode_table()
+{
+	for (int insn_num = 0; insn_table[insn_num].mnemonic != NULL; insn_num++)
 	{
-		switch (insn_table[insn_num].operands[i])
+		insn_type *insn = &insn_table[insn_num];
+
+		// Directives have no encoding
+		if (insn->type == DIRECTIVE)
+			continue;
+
+		for (unsigned int func = 0; func < 16; func++)
 		{
-		case 'd':
-			cout << GPR_name[Rd];
-			break;
-		case 's':
-			cout << GPR_name[Rs];
-			break;
-		case 'D':
-			cout << SPR_name[Rd];
-			break;
-		case 'S':
-			cout << SPR_name[Rs];
-			break;
-		case 't':
-			cout << GPR_name[Rt];
-			break;
-		case 'o': // Twenty bit offset
-			if (address == 0)
-				cout << '0';
-			else if (Rs != 0)
-			{
-				cout << signed_address;
-			}
-			else
-				cout << "0x" << setw(5) << setfill('0') << hex << address;
-			break;
-		case 'b':
-			cout << "0x" << setw(5) << setfill('0') << hex << (((unsigned)((signed int)insn_address + signed_address) & 0xfffff) + 1);
-			break;
-		case 'i': // 16 bit immediate value
-			// We should check if the instruction sign extends or not, and if it does then
-			// We should print a signed integer
-			cout << "0x" << setw(4) << setfill('0') << hex << immediate;
-			break;
-		case 'j':
-			cout << "0x" << setw(5) << setfill('0') << hex << address;
-			break;
-		default:
-			cout << insn_table[insn_num].operands[i];
+			if (insn->type != J_TYPE && insn->func != func)
+				continue;
+
+			// The first matching entry in insn_table wins, as it always has
+			unsigned int index = (insn->OPCode << 4) | func;
+			if (decode_table[index] == NULL)
+				decode_table[index] = insn;
 		}
 	}
+	return true;
 }
 
-void disassemble_view(unsigned int insn_address, unsigned int instruction, char *label_name)
+// Built during static initialisation, before main() can disassemble anything
+static bool decode_table_built = build_decode_table();
+
+insn_type *decode_insn(unsigned int instruction)
+{
+	return decode_table[((instruction >> 24) & 0xf0) | ((instruction >> 16) & 0xf)];
+}
+
+const char *insn_class_name[NUM_INSN_CLASSES] = {"arith", "mult", "div", "memory", "branch", "special"};
+
+// div and rem take one cycle a bit of the result, the rest of the
+// arithmetic a few, and memory waits on the bus
+const unsigned int insn_class_cycles[NUM_INSN_CLASSES] = {4, 8, 36, 6, 4, 4};
+
+insn_class classify_insn(const insn_type *insn)
+{
+	switch (insn->OPCode)
+	{
+	case 0x0:
+	case 0x1:
+		// mult and multu, then div, divu, rem and remu
+		if (insn->func == 0x4 || insn->func == 0x5)
+			return CLASS_MULT;
+		if (insn->func >= 0x6 && insn->func <= 0x9)
+			return CLASS_DIV;
+		return CLASS_ARITHMETIC;
+	case 0x2:
+		// break, syscall and rfe
+		return (insn->func >= 0xc) ? CLASS_SPECIAL : CLASS_ARITHMETIC;
+	case 0x3:
+		// movgs and movsg, lhi is arithmetic
+		return (insn->func == 0xc || insn->func == 0xd) ? CLASS_SPECIAL : CLASS_ARITHMETIC;
+	case 0x8:
+	case 0x9:
+		return CLASS_MEMORY;
+	case 0xc:
+		// la
+		return CLASS_ARITHMETIC;
+	default:
+		return CLASS_BRANCH;
+	}
+}
+
+// Shared by disassemble() and disassemble_view(). When view is set, address
+// operands are shown as label_name (if there is one) rather than worked out.
+static void print_insn(ostream &out, unsigned int insn_address, unsigned int instruction, char *label_name, bool view)
 {
-	// First we scan through to find the mnemonic
-	unsigned int OPCode = (instruction >> 28) & 0xf;
-	unsigned int func = (instruction >> 16) & 0xf;
 	unsigned int Rd = (instruction >> 24) & 0xf;
 	unsigned int Rs = (instruction >> 20) & 0xf;
 	unsigned int Rt = (instruction & 0xf);
 	unsigned int immediate = instruction & 0xffff;
 	//  int signed_immediate = ((immediate & 0x8000) ? (0xffff0000 | immediate) : immediate);
 	unsigned int address = instruction & 0xfffff;
-
-	int insn_num = 0;
+	int signed_address = ((address & 0x80000) ? (0xfff00000 | address) : address);
 
 	// Here we look up the mnemonic in our table.
-	while (insn_table[insn_num].mnemonic != NULL)
-	{
-		if (insn_table[insn_num].OPCode == OPCode && (insn_table[insn_num].type == J_TYPE || insn_table[insn_num].func == func))
-			break; // We have a match
-		insn_num++;
-	}
+	insn_type *insn = decode_insn(instruction);
 
 	// If we couldn't match an instruction
-	if (insn_table[insn_num].mnemonic == NULL)
+	if (insn == NULL)
 	{
-		cout << "???";
+		out << "???";
 		return;
 	}
 
 	// Output the mnemonic
-	cout << insn_table[insn_num].mnemonic << "\t";
+	out << insn->mnemonic << "\t";
 
 	// Now the parameters
 
 	// Scan through the operand format string
-	for (int i = 0; (unsigned int)i < strlen(insn_table[insn_num].operands); i++)
+	for (const char *operand = insn->operands; *operand != '\0'; operand++)
 	{
-		switch (insn_table[insn_num].operands[i])
+		switch (*operand)
 		{
 		case 'd':
-			cout << GPR_name[Rd];
+			out << GPR_name[Rd];
 			break;
 		case 's':
-			cout << GPR_name[Rs];
+			out << GPR_name[Rs];
 			break;
 		case 'D':
-			cout << SPR_name[Rd];
+			out << SPR_name[Rd];
 			break;
 		case 'S':
-			cout << SPR_name[Rs];
+			out << SPR_name[Rs];
 			break;
 		case 't':
-			cout << GPR_name[Rt];
+			out << GPR_name[Rt];
 			break;
 		case 'o': // Twenty bit offset
-			if (label_name == NULL){
-				cout << "0x" << setw(5) << setfill('0') << hex << address;
-			}
-			else
-				cout << " " << label_name;
-			break;
 		case 'b':
-			if (label_name == NULL){
-				cout << "0x" << setw(5) << setfill('0') << hex << address;
+		case 'j':
+			if (view)
+			{
+				if (label_name == NULL)
+					out << "0x" << setw(5) << setfill('0') << hex << address;
+				else
+					out << " " << label_name;
+			}
+			else if (*operand == 'o')
+			{
+				if (address == 0)
+					out << '0';
+				else if (Rs != 0)
+					out << signed_address;
+				else
+					out << "0x" << setw(5) << setfill('0') << hex << address;
 			}
+			else if (*operand == 'b')
+				out << "0x" << setw(5) << setfill('0') << hex << (((unsigned)((signed int)insn_address + signed_address) & 0xfffff) + 1);
 			else
-				cout << " " << label_name;
+				out << "0x" << setw(5) << setfill('0') << hex << address;
 			break;
 		case 'i': // 16 bit immediate value
 			// We should check if the instruction sign extends or not, and if it does then
 			// We should print a signed integer
-			cout << "0x" << setw(4) << setfill('0') << hex << immediate;
-			break;
-		case 'j':
-			if (label_name == NULL){
-				cout << "0x" << setw(5) << setfill('0') << hex << address;
-			}
-			else
-				cout << " " << label_name;
+			out << "0x" << setw(4) << setfill('0') << hex << immediate;
 			break;
 		default:
-			cout << insn_table[insn_num].operands[i];
+			out << *operand;
 		}
 	}
-}
\ No newline at end of file
+}
+
+void disassemble(unsigned int insn_address, unsigned int instruction)
+{
+	print_insn(cout, insn_address, instruction, NULL, false);
+}
+
+void disassemble(ostream &out, unsigned int insn_address, unsigned int instruction)
+{
+	print_insn(out, insn_address, instruction, NULL, false);
+}
+
+void disassemble_view(unsigned int insn_address, unsigned int instruction, char *label_name)
+{
+	print_insn(cout, insn_address, instruction, label_name, true);
+}
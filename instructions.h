@@ -22,6 +22,8 @@
 #ifndef INSTRUCTIONS_H
 #define INSTRUCTIONS_H
 
+#include <iosfwd>
+
 enum insn_descriptor { INSN, I_TYPE, R_TYPE, J_TYPE, DIRECTIVE, OTHER };
 
 struct insn_type {
@@ -38,7 +40,25 @@ struct reg_type {
 
 extern insn_type insn_table[];
 
+// Returns the insn_table entry for a (lower case) mnemonic, or NULL if there is none
+extern insn_type *lookup_mnemonic(const char *);
+
+// Returns the insn_table entry for an encoded instruction, or NULL if the
+// OPCode/func pair is not a valid instruction
+extern insn_type *decode_insn(unsigned int);
+
+// The classes of instruction, for estimating what code costs
+enum insn_class { CLASS_ARITHMETIC, CLASS_MULT, CLASS_DIV, CLASS_MEMORY, CLASS_BRANCH, CLASS_SPECIAL, NUM_INSN_CLASSES };
+
+extern const char *insn_class_name[];
+// Estimates of the cycles an instruction of each class takes
+extern const unsigned int insn_class_cycles[];
+
+// Returns the class of an insn_table entry that has an encoding
+extern insn_class classify_insn(const insn_type *);
+
 extern void disassemble(unsigned int, unsigned int);
+extern void disassemble(std::ostream &, unsigned int, unsigned int);
 extern void disassemble_view(unsigned int, unsigned int, char *);
 
 #endif
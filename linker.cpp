@@ -21,24 +21,23 @@
 
 #include <iostream>
 #include <iomanip>
-#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <ctype.h>
 #include <assert.h>
+#include <pthread.h>
 
 #include "object_file.h"
 #include "instructions.h"
+#include "symbol_table.h"
+#include "linker.h"
+#include "archive.h"
 
 using namespace std;
 
-bool error_flag = false, verbose_flag = false;
-
-unsigned int starting_text_address = 0x00000, text_address, text_size = 0;
-unsigned int data_address = 0xfffff, data_size = 0;
-unsigned int bss_address = 0xfffff, bss_size = 0;
-bool bss_end_justify = false;
-
 const int max_label_length = 30;
 
 struct label_entry
@@ -49,12 +48,421 @@ struct label_entry
 	bool resolved;
 	label_entry *next;
 	int file_no;
+	// Where it is in a saved link state
+	int state_symbol;
+};
+
+struct reference
+{
+	// The label this refers to
+	label_entry *label;
+	// The name of the label, until it is looked up
+	const char *name;
+	seg_type source_seg;
+	seg_type target_seg;
+	int address;
+	// Added to the address, when the text it refers to has been moved
+	int adjust;
+	reference *next;
+};
+
+// A global declared in an object file
+struct global_symbol
+{
+	const char *name;
+	unsigned int address;
+	seg_type segment;
+};
+
+typedef struct
+{
+	const char *filename;
+	object_header file_header;
+	// The words of each segment, pointing straight into the object file
+	// unless it had to be copied to line the words up
+	const unsigned int *segment[NUM_SEGMENTS];
+	unsigned int *copied_words;
+	// These hold the starting address of each segment
+	unsigned int segment_address[NUM_SEGMENTS];
+	// Where each segment starts in the linked image
+	unsigned int image_offset[NUM_SEGMENTS];
+
+	reference *references;
+	// The globals this file declares, in the order they appear
+	vector<global_symbol> globals;
+	// Where the regions of the text segment start, after the one at zero,
+	// and the text left once the unused regions are dropped
+	vector<unsigned int> region_starts;
+	vector<unsigned int> gc_text;
+
+	// Set if loading or relocating this file failed, with the messages
+	// to report in file order once all the files are done
+	bool failed;
+	string messages;
+
+	// Only worked out when the link state is being saved
+	unsigned long long hash;
+
+	// The source each word of the text and data segments came from, only
+	// read when a line table is being written
+	const char *line_source;
+	vector<line_run> line_runs[2];
+} file_type;
+
+// A run of words in the linked program from one source line
+struct line_entry
+{
+	unsigned int start;
+	unsigned int end;
+	const char *source;
+	unsigned int line;
+
+	bool operator<(const line_entry &other) const { return start < other.start; }
+};
+
+// A run of consecutive words in the linked image
+struct image_run
+{
+	unsigned int address;
+	const unsigned int *words;
+	unsigned int num_words;
+};
+
+// Thrown to abandon the link once an error has been reported
+struct link_error
+{
+};
+
+// The state saved for incremental links is a header, the files, the symbols,
+// the words that refer to the symbols and the names, followed by the linked
+// text and data segments
+#define LINK_STATE_MAGIC_NUM 0xdaa3
+#define LINK_STATE_VERSION 1
+
+struct state_header
+{
+	unsigned int magic_number;
+	unsigned int version;
+	// The options the segments were laid out with
+	unsigned int text_address;
+	unsigned int data_address;
+	unsigned int bss_address;
+	unsigned int bss_end_justify;
+
+	unsigned int num_files;
+	unsigned int num_symbols;
+	unsigned int num_sites;
+	unsigned int text_words;
+	unsigned int data_words;
+	unsigned int entry_point;
+	unsigned int name_table_size;
+};
+
+struct state_file
+{
+	unsigned long long hash;
+	unsigned int name_ptr;
+	unsigned int segment_size[NUM_SEGMENTS];
+	unsigned int segment_address[NUM_SEGMENTS];
+	unsigned int image_offset[NUM_SEGMENTS];
+};
+
+struct state_symbol
+{
+	unsigned int name_ptr;
+	unsigned int address; // Already relocated
+	int file_no;		  // The file declaring it, or -1 for the linker's own
+};
+
+// A word referring to a symbol, to be updated if the symbol moves
+struct state_site
+{
+	unsigned int symbol;
+	unsigned int file_no;
+	unsigned int segment;
+	unsigned int offset; // From the start of the linked segment
+};
+
+struct link_state
+{
+	state_header header;
+	vector<state_file> files;
+	vector<state_symbol> symbols;
+	vector<state_site> sites;
+	string names;
 };
 
-label_entry *label_list = NULL;
+// A fast 64 bit hash of a file's contents, mixing in four words at a time
+// in the style of xxHash. It only needs to tell whether a file has changed.
+static unsigned long long hash_contents(const char *data, size_t length)
+{
+	const unsigned long long prime1 = 11400714785074694791ULL;
+	const unsigned long long prime2 = 14029467366897019727ULL;
+	const unsigned long long prime3 = 1609587929392839161ULL;
+	unsigned long long lane[4] = {prime1 + prime2, prime2, 0, 0 - prime1};
+	unsigned long long word;
+	size_t i = 0;
+	int j;
+
+	for (; i + 32 <= length; i += 32)
+	{
+		for (j = 0; j < 4; j++)
+		{
+			memcpy(&word, data + i + 8 * j, sizeof(word));
+			lane[j] += word * prime2;
+			lane[j] = (lane[j] << 31) | (lane[j] >> 33);
+			lane[j] *= prime1;
+		}
+	}
+
+	unsigned long long hash = length * prime3;
+	for (j = 0; j < 4; j++)
+		hash = ((hash ^ lane[j]) << 27 | (hash ^ lane[j]) >> 37) * prime1 + prime3;
+
+	for (; i < length; i++)
+		hash = ((hash ^ (unsigned char)data[i]) << 11 | (hash ^ (unsigned char)data[i]) >> 53) * prime1;
+
+	hash ^= hash >> 33;
+	hash *= prime2;
+	hash ^= hash >> 29;
+	hash *= prime3;
+	hash ^= hash >> 32;
+	return hash;
+}
+
+// Appends a table of entries to a saved link state
+template <class T>
+static void append_table(string &data, const vector<T> &table)
+{
+	if (!table.empty())
+		data.append((const char *)&table[0], table.size() * sizeof(T));
+}
+
+// Reads a table of entries out of a saved link state, returning false if
+// the state is too short
+template <class T>
+static bool read_table(const string &data, size_t &offset, vector<T> &table, unsigned int count)
+{
+	if (count > (data.size() - offset) / sizeof(T))
+		return false;
+
+	table.resize(count);
+	if (count > 0)
+		memcpy(&table[0], data.data() + offset, count * sizeof(T));
+	offset += count * sizeof(T);
+	return true;
+}
+
+static void write_state(const link_state &state, const vector<unsigned int> image_words[], string &data)
+{
+	data.clear();
+	data.append((const char *)&state.header, sizeof(state_header));
+	append_table(data, state.files);
+	append_table(data, state.symbols);
+	append_table(data, state.sites);
+	data.append(state.names);
+	append_table(data, image_words[TEXT]);
+	append_table(data, image_words[DATA]);
+}
+
+// Reads a saved link state back in, checking it all fits together
+static bool read_state(const string &data, link_state &state, vector<unsigned int> image_words[])
+{
+	unsigned int i;
+	size_t offset = sizeof(state_header);
+
+	if (data.size() < sizeof(state_header))
+		return false;
+	memcpy(&state.header, data.data(), sizeof(state_header));
+
+	state_header &header = state.header;
+	if (header.magic_number != LINK_STATE_MAGIC_NUM || header.version != LINK_STATE_VERSION)
+		return false;
+
+	if (!read_table(data, offset, state.files, header.num_files) ||
+		!read_table(data, offset, state.symbols, header.num_symbols) ||
+		!read_table(data, offset, state.sites, header.num_sites))
+		return false;
+
+	if (header.name_table_size == 0 || header.name_table_size > data.size() - offset)
+		return false;
+	state.names.assign(data, offset, header.name_table_size);
+	offset += header.name_table_size;
+	if (state.names[header.name_table_size - 1] != '\0')
+		return false;
+
+	if (!read_table(data, offset, image_words[TEXT], header.text_words) ||
+		!read_table(data, offset, image_words[DATA], header.data_words) ||
+		offset != data.size())
+		return false;
+
+	for (i = 0; i < header.num_files; i++)
+	{
+		state_file &f = state.files[i];
+		if (f.name_ptr >= header.name_table_size ||
+			f.image_offset[TEXT] > header.text_words || f.segment_size[TEXT] > header.text_words - f.image_offset[TEXT] ||
+			f.image_offset[DATA] > header.data_words || f.segment_size[DATA] > header.data_words - f.image_offset[DATA])
+			return false;
+	}
+	for (i = 0; i < header.num_symbols; i++)
+	{
+		if (state.symbols[i].name_ptr >= header.name_table_size || state.symbols[i].file_no >= (int)header.num_files)
+			return false;
+	}
+	for (i = 0; i < header.num_sites; i++)
+	{
+		state_site &site = state.sites[i];
+		if (site.symbol >= header.num_symbols || site.file_no >= header.num_files ||
+			(site.segment != TEXT && site.segment != DATA) || site.offset >= image_words[site.segment].size())
+			return false;
+	}
+	return true;
+}
+
+link_options::link_options()
+{
+	text_address = 0x00000;
+	data_address = 0xfffff;
+	bss_address = 0xfffff;
+	bss_end_justify = false;
+	verbose = false;
+	srecord_bytes = 40;
+	srecord_s2 = false;
+	output_format = SRECORD;
+	num_threads = 1;
+	gc_sections = false;
+}
+
+// All the state needed for one link
+class linker
+{
+public:
+	linker(const link_options &options, ostream &listing, ostream &messages);
+	~linker();
+
+	void link(const vector<object_buffer> &objects, string &image, string *state, string *lines);
+	bool relink(const vector<object_buffer> &objects, const string &previous_state, string &state, string &image,
+				string *lines);
+
+private:
+	bool error_flag, verbose_flag;
+
+	unsigned int starting_text_address, text_address, text_size;
+	unsigned int data_address, data_size;
+	unsigned int bss_address, bss_size;
+	bool bss_end_justify;
+
+	unsigned int srecord_bytes;
+	bool srecord_s2;
+	output_format_type output_format;
+
+	bool gc_sections;
+	unsigned int gc_removed_words;
+
+	// The options as given, and whether the link state and line table are
+	// being saved
+	link_options requested;
+	bool keep_state;
+	bool keep_lines;
+
+	label_entry *label_list;
+	// Hash index over label_list, keyed on the name held in each label_entry
+	symbol_table label_table;
+
+	// The object files being linked, and the archives members can be
+	// pulled in from. file and inputs both have num_files entries.
+	vector<file_type> file;
+	vector<object_buffer> inputs;
+	int num_files;
+	vector<archive_reader *> archives;
+	vector<vector<bool> > member_pulled;
+	int num_threads;
+
+	// The linked text and data segments
+	vector<unsigned int> image_words[NUM_SEGMENTS];
+
+	ostream &listing;
+	ostream &messages;
+
+	void cleanup();
+	void bailout();
+	label_entry *get_label(const char *name);
+	void init_file(int file_no);
+	void read_object(const object_buffer &object, int current_file, ostream &errors);
+	void read_lines(int file_no, const object_view &view, ostream &errors);
+	void hash_file(int file_no);
+	void load_file(int file_no);
+	void merge_symbols(int file_no);
+	void relocate_file(int file_no);
+	void load_files(int first_file);
+	void pull_member(const char *name);
+
+	unsigned int region_of(int file_no, unsigned int offset, const vector<unsigned int> &first_region);
+	int text_target(int file_no, reference *ref, const vector<unsigned int> &first_region);
+	void collect_garbage();
+
+	void save_state(string &state, unsigned int entry_point);
+	void write_line_table(string &lines);
+	void write_output(const vector<image_run> &runs, unsigned int entry_point, string &image);
+
+	// Work done on every file, shared between the worker threads
+	typedef void (linker::*file_task)(int);
+	struct task_queue
+	{
+		linker *owner;
+		file_task task;
+		int next_file;
+		pthread_mutex_t lock;
+	};
+	static void *file_worker(void *arg);
+	void for_each_file(file_task task, int first_file);
+
+	// The linked words of one file's text or data segment
+	unsigned int *linked_words(int file_no, int seg)
+	{
+		return &image_words[seg][file[file_no].image_offset[seg]];
+	}
+
+	// Not copyable, the labels would end up shared
+	linker(const linker &);
+	linker &operator=(const linker &);
+};
+
+linker::linker(const link_options &options, ostream &listing, ostream &messages)
+	: requested(options), listing(listing), messages(messages)
+{
+	error_flag = false;
+	verbose_flag = options.verbose;
+
+	starting_text_address = options.text_address;
+	text_address = options.text_address;
+	text_size = 0;
+	data_address = options.data_address;
+	data_size = 0;
+	bss_address = options.bss_address;
+	bss_size = 0;
+	bss_end_justify = options.bss_end_justify;
+
+	srecord_bytes = options.srecord_bytes;
+	srecord_s2 = options.srecord_s2;
+	output_format = options.output_format;
+
+	label_list = NULL;
+	num_files = 0;
+	num_threads = options.num_threads;
+	gc_sections = options.gc_sections;
+	gc_removed_words = 0;
+	keep_state = false;
+	keep_lines = false;
+}
+
+linker::~linker()
+{
+	cleanup();
+}
 
 // Remove all dynamically allocated data structures
-void cleanup()
+void linker::cleanup()
 {
 	while (label_list != NULL)
 	{
@@ -62,55 +470,341 @@ void cleanup()
 		delete label_list;
 		label_list = temp;
 	}
+	label_table.clear();
+
+	for (int i = 0; i < num_files; i++)
+	{
+		delete[] file[i].copied_words;
+		while (file[i].references != NULL)
+		{
+			reference *temp = file[i].references->next;
+			delete file[i].references;
+			file[i].references = temp;
+		}
+	}
+	file.clear();
+	inputs.clear();
+	num_files = 0;
+
+	for (unsigned int i = 0; i < archives.size(); i++)
+		delete archives[i];
+	archives.clear();
+	member_pulled.clear();
 }
 
-void output_srecord(ofstream &ofile, int record_type, unsigned int address, int *data, int num_words)
+// Give up on the link, the error has already been reported
+void linker::bailout()
+{
+	throw link_error();
+}
+
+// The two upper case hex digits for each byte value
+char hex_pairs[256][2];
+
+static bool build_hex_pairs()
 {
+	const char *digits = "0123456789ABCDEF";
+
+	for (int i = 0; i < 256; i++)
+	{
+		hex_pairs[i][0] = digits[i >> 4];
+		hex_pairs[i][1] = digits[i & 0xf];
+	}
+	return true;
+}
+
+static bool hex_pairs_built = build_hex_pairs();
+
+// The longest S-record line: type, length, address, data, checksum and newline
+const int max_srecord_chars = 2 + 2 + (2 * 255) + 1;
+// The most words that fit in one S-record, the length byte counts at most
+// 255 bytes of address, data and checksum
+const int max_srecord_words = 62;
+
+// Writes a byte as two hex digits, adding it to the checksum
+static inline char *put_byte(char *out, unsigned char byte, unsigned char &checksum)
+{
+	out[0] = hex_pairs[byte][0];
+	out[1] = hex_pairs[byte][1];
+	checksum += byte;
+	return out + 2;
+}
+
+// Appends one S-record to the image. The record is formatted into a local
+// buffer, checksumming it in the same pass, and then appended in one go.
+void output_srecord(string &image, int record_type, unsigned int address, int *data, int num_words)
+{
+	char record[max_srecord_chars];
+	char *out = record;
 	unsigned char checksum = 0;
 	unsigned char length = 0;
 
-	assert((record_type == 3 && num_words > 0) || (record_type == 7 && num_words == 0));
-
-	ofile << "S" << record_type;
+	assert(((record_type == 2 || record_type == 3) && num_words > 0) ||
+		   ((record_type == 7 || record_type == 8) && num_words == 0));
+	assert(num_words <= max_srecord_words);
 
-	length = 4 + (4 * num_words) + 1;
+	// S2 and S8 records have 24 bit addresses, S3 and S7 have 32 bit ones
+	int address_bytes = (record_type == 2 || record_type == 8) ? 3 : 4;
 
-	checksum += length;
+	*out++ = 'S';
+	*out++ = '0' + record_type;
 
-	ofile << hex << setiosflags(ios::uppercase) << setw(2) << setfill('0') << ((unsigned int)length);
+	length = address_bytes + (4 * num_words) + 1;
 
-	checksum += (address >> 24) & 0xff;
-	checksum += (address >> 16) & 0xff;
-	checksum += (address >> 8) & 0xff;
-	checksum += address & 0xff;
+	out = put_byte(out, length, checksum);
 
-	ofile << hex << setiosflags(ios::uppercase) << setw(8) << setfill('0') << address;
+	if (address_bytes == 4)
+		out = put_byte(out, (address >> 24) & 0xff, checksum);
+	out = put_byte(out, (address >> 16) & 0xff, checksum);
+	out = put_byte(out, (address >> 8) & 0xff, checksum);
+	out = put_byte(out, address & 0xff, checksum);
 
 	for (int i = 0; i < num_words; i++)
 	{
-		checksum += (data[i] >> 24) & 0xff;
-		checksum += (data[i] >> 16) & 0xff;
-		checksum += (data[i] >> 8) & 0xff;
-		checksum += data[i] & 0xff;
+		out = put_byte(out, (data[i] >> 24) & 0xff, checksum);
+		out = put_byte(out, (data[i] >> 16) & 0xff, checksum);
+		out = put_byte(out, (data[i] >> 8) & 0xff, checksum);
+		out = put_byte(out, data[i] & 0xff, checksum);
+	}
+
+	out = put_byte(out, (~checksum) & 0xff, checksum);
+	*out++ = '\n';
+
+	image.append(record, out - record);
+}
+
+// Writes the image as S-records: S3 data records and an S7 end record, or
+// S2 and S8 if asked for and every address fits in 24 bits. Words are
+// packed into records in order, but a record never spans a gap in the
+// addresses, such as between the text and data segments.
+void write_srecords(string &image, const vector<image_run> &runs, unsigned int entry_point, unsigned int srecord_bytes, bool use_s2)
+{
+	int data_record = 3, end_record = 7;
+	if (use_s2 == true)
+	{
+		unsigned int highest_address = entry_point;
+		for (unsigned int i = 0; i < runs.size(); i++)
+			highest_address = max(highest_address, runs[i].address + runs[i].num_words - 1);
+
+		if (highest_address <= 0xffffff)
+		{
+			data_record = 2;
+			end_record = 8;
+		}
+	}
+
+	// Here we output an SRecord
+	// Starting record (optional)
+	//  outputfile << "S0030000FC\n"; // length = 3, address = 0, checksum = 0xfc
+
+	int max_srecord_line = srecord_bytes / 4; // Maximum number of words in an srecord line
+	int buffer[max_srecord_words];
+
+	// Make room for the whole image up front, nearly every record is full
+	unsigned int num_words = 0;
+	for (unsigned int i = 0; i < runs.size(); i++)
+		num_words += runs[i].num_words;
+	int num_records = num_words / max_srecord_line + runs.size() + 1;
+	image.reserve(num_records * (4 + 2 * (4 + 4 * max_srecord_line + 1) + 1));
+
+	unsigned int starting_address = 0;
+	int buf_ptr = 0;
+
+	for (unsigned int i = 0; i < runs.size(); i++)
+	{
+		for (unsigned int k = 0; k < runs[i].num_words; k++)
+		{
+			unsigned int current_address = runs[i].address + k;
+
+			// Finish the record at a gap in the addresses
+			if (buf_ptr > 0 && current_address != starting_address + buf_ptr)
+			{
+				output_srecord(image, data_record, starting_address, buffer, buf_ptr);
+				buf_ptr = 0;
+			}
+
+			// Get the starting address of this record's data
+			if (buf_ptr == 0)
+				starting_address = current_address;
+
+			buffer[buf_ptr] = runs[i].words[k];
+			buf_ptr++;
+
+			if (buf_ptr == max_srecord_line)
+			{
+				output_srecord(image, data_record, starting_address, buffer, buf_ptr);
+				buf_ptr = 0;
+			}
+		}
+	}
+
+	if (buf_ptr > 0)
+		output_srecord(image, data_record, starting_address, buffer, buf_ptr);
+
+	output_srecord(image, end_record, entry_point, NULL, 0);
+}
+
+// Writes the image as raw words, from the lowest address to the highest,
+// with any gaps filled with zeroes
+void write_binary(string &image, const vector<image_run> &runs, bool big_endian)
+{
+	if (runs.empty())
+		return;
+
+	unsigned int lowest_address = runs[0].address, end_address = runs[0].address;
+	for (unsigned int i = 0; i < runs.size(); i++)
+	{
+		lowest_address = min(lowest_address, runs[i].address);
+		end_address = max(end_address, runs[i].address + runs[i].num_words);
+	}
+
+	image.assign((size_t)(end_address - lowest_address) * 4, '\0');
+
+	for (unsigned int i = 0; i < runs.size(); i++)
+	{
+		char *out = &image[(size_t)(runs[i].address - lowest_address) * 4];
+		for (unsigned int k = 0; k < runs[i].num_words; k++)
+		{
+			unsigned int word = runs[i].words[k];
+			for (int b = 0; b < 4; b++)
+			{
+				int shift = big_endian ? 24 - 8 * b : 8 * b;
+				*out++ = (word >> shift) & 0xff;
+			}
+		}
+	}
+}
+
+// Writes the image as a Vivado .mem file, one word per line. Each run of
+// consecutive words starts with an @address line.
+void write_mem(string &image, const vector<image_run> &runs)
+{
+	// Every line is a word or an address, and 8 hex digits and a newline
+	unsigned int num_words = 0;
+	for (unsigned int i = 0; i < runs.size(); i++)
+		num_words += runs[i].num_words;
+	image.reserve((num_words + runs.size()) * 10);
+
+	unsigned int next_address = 0;
+	unsigned char checksum = 0; // Not used by this format
+
+	for (unsigned int i = 0; i < runs.size(); i++)
+	{
+		char line[10];
+		char *out;
+
+		if (i == 0 || runs[i].address != next_address)
+		{
+			out = line;
+			*out++ = '@';
+			for (int shift = 24; shift >= 0; shift -= 8)
+				out = put_byte(out, (runs[i].address >> shift) & 0xff, checksum);
+			*out++ = '\n';
+			image.append(line, out - line);
+		}
+
+		for (unsigned int k = 0; k < runs[i].num_words; k++)
+		{
+			out = line;
+			for (int shift = 24; shift >= 0; shift -= 8)
+				out = put_byte(out, (runs[i].words[k] >> shift) & 0xff, checksum);
+			*out++ = '\n';
+			image.append(line, out - line);
+		}
+
+		next_address = runs[i].address + runs[i].num_words;
+	}
+}
+
+// Appends one Intel HEX record to the image
+void output_ihex_record(string &image, int record_type, unsigned int offset, const unsigned char *data, int num_bytes)
+{
+	char record[1 + 2 * (4 + 255 + 1) + 1];
+	char *out = record;
+	unsigned char checksum = 0;
+
+	*out++ = ':';
+	out = put_byte(out, num_bytes, checksum);
+	out = put_byte(out, (offset >> 8) & 0xff, checksum);
+	out = put_byte(out, offset & 0xff, checksum);
+	out = put_byte(out, record_type, checksum);
+
+	for (int i = 0; i < num_bytes; i++)
+		out = put_byte(out, data[i], checksum);
+
+	// The checksum makes all the bytes sum to zero
+	out = put_byte(out, (0x100 - checksum) & 0xff, checksum);
+	*out++ = '\n';
+
+	image.append(record, out - record);
+}
+
+// Writes the image as Intel HEX. Each word is 4 bytes, most significant
+// first, so byte addresses are 4 times word addresses. Extended linear
+// address records give the upper 16 bits of the byte addresses, and the
+// start linear address record gives the entry point.
+void write_ihex(string &image, const vector<image_run> &runs, unsigned int entry_point)
+{
+	const unsigned int ihex_record_words = 4;
+	unsigned int upper_address = 0;
+	unsigned char data[4 * ihex_record_words];
+
+	for (unsigned int i = 0; i < runs.size(); i++)
+	{
+		unsigned int k = 0;
+		while (k < runs[i].num_words)
+		{
+			unsigned int byte_address = (runs[i].address + k) * 4;
+
+			if ((byte_address >> 16) != upper_address)
+			{
+				upper_address = byte_address >> 16;
+				data[0] = (upper_address >> 8) & 0xff;
+				data[1] = upper_address & 0xff;
+				output_ihex_record(image, 4, 0, data, 2);
+			}
+
+			// A record mustn't run past the end of this 64K
+			unsigned int num_words = min(runs[i].num_words - k, ihex_record_words);
+			num_words = min(num_words, (0x10000 - (byte_address & 0xffff)) / 4);
 
-		ofile << hex << setiosflags(ios::uppercase) << setw(8) << setfill('0') << data[i];
+			for (unsigned int w = 0; w < num_words; w++)
+			{
+				unsigned int word = runs[i].words[k + w];
+				data[4 * w] = (word >> 24) & 0xff;
+				data[4 * w + 1] = (word >> 16) & 0xff;
+				data[4 * w + 2] = (word >> 8) & 0xff;
+				data[4 * w + 3] = word & 0xff;
+			}
+			output_ihex_record(image, 0, byte_address & 0xffff, data, 4 * num_words);
+
+			k += num_words;
+		}
 	}
 
-	ofile << hex << setiosflags(ios::uppercase) << setw(2) << setfill('0') << ((~checksum) & 0xff) << endl;
+	unsigned int start_address = entry_point * 4;
+	data[0] = (start_address >> 24) & 0xff;
+	data[1] = (start_address >> 16) & 0xff;
+	data[2] = (start_address >> 8) & 0xff;
+	data[3] = start_address & 0xff;
+	output_ihex_record(image, 5, 0, data, 4);
+
+	output_ihex_record(image, 1, 0, NULL, 0);
 }
 
 // This searches for a reference to a label, creating a new entry
 // if none is found
-label_entry *get_label(char *name)
+label_entry *linker::get_label(const char *name)
 {
-	label_entry *temp = label_list;
-
 	// Check for the label already existing
-	while (temp != NULL)
+	label_entry *temp = (label_entry *)label_table.find(name);
+	if (temp != NULL)
+		return temp;
+
+	if (strlen(name) >= (unsigned int)max_label_length)
 	{
-		if (strcmp(temp->name, name) == 0)
-			return temp;
-		temp = temp->next;
+		messages << "ERROR: Label too long '" << name << "'" << endl;
+		bailout();
 	}
 
 	temp = new label_entry;
@@ -118,139 +812,627 @@ label_entry *get_label(char *name)
 	temp->next = label_list;
 	temp->resolved = false;
 	temp->file_no = 0;
+	temp->state_symbol = -1;
+	// Undefined labels resolve to zero, we are bailing out anyway
+	temp->address = 0;
+	temp->segment = TEXT;
 
 	strcpy(temp->name, name);
 
 	label_list = temp;
+	label_table.insert(temp->name, temp);
 
 	return label_list;
 }
 
-struct reference
+// Reads the segments, globals and references out of an object file. This
+// only touches the file's own entry, so files can be read at the same time.
+void linker::read_object(const object_buffer &object, int current_file, ostream &errors)
 {
-	// The label this refers to
-	label_entry *label;
-	seg_type source_seg;
-	seg_type target_seg;
-	int address;
-	reference *next;
-};
+	int i;
 
-typedef struct
+	// Copy the filename into the structure
+	file[current_file].filename = object.filename;
+
+	// Check the whole of the object file is there, whichever version it is
+	object_view view;
+	const char *problem = open_object(object.data, object.length, view);
+	if (problem != NULL)
+	{
+		errors << "ERROR: " << problem << file[current_file].filename << endl;
+		bailout();
+	}
+
+	file[current_file].file_header = view.header;
+	object_header &header = file[current_file].file_header;
+
+	// The segments are used where they are, unless they aren't word aligned
+	// or are in the wrong byte order for this host
+	for (i = TEXT; i <= DATA; i++)
+	{
+		unsigned int size = (i == TEXT) ? header.text_seg_size : header.data_seg_size;
+		const char *ptr = view.segment[i];
+
+		if (size == 0 || (((size_t)ptr % sizeof(unsigned int)) == 0 && native_words(view)))
+		{
+			file[current_file].segment[i] = (const unsigned int *)ptr;
+			continue;
+		}
+
+		if (file[current_file].copied_words == NULL)
+			file[current_file].copied_words = new unsigned int[header.text_seg_size + header.data_seg_size];
+		unsigned int *words = file[current_file].copied_words + ((i == TEXT) ? 0 : header.text_seg_size);
+		for (unsigned int j = 0; j < size; j++)
+		{
+			if (native_words(view))
+				memcpy(&words[j], ptr + j * sizeof(unsigned int), sizeof(unsigned int));
+			else
+				words[j] = get_le32(ptr + j * sizeof(unsigned int));
+		}
+		file[current_file].segment[i] = words;
+	}
+
+	// Now we should read in all the labels for this segment
+	int num_relocs = header.num_references;
+
+	// And the symbol labels
+	const char *symbol_names = view.names;
+	unsigned int symbol_name_table_size = header.symbol_name_table_size;
+
+	// Scan through the segment labels
+	reloc_reader relocs(view);
+	for (i = 0; i < num_relocs; i++)
+	{
+		reloc_entry reloc;
+		if (!relocs.next(reloc))
+		{
+			errors << "ERROR: Bad relocation in object file : " << file[current_file].filename << endl;
+			bailout();
+		}
+
+		// The symbol name, for the relocations that have one
+		if ((reloc.type == GLOBAL_TEXT || reloc.type == GLOBAL_DATA || reloc.type == GLOBAL_BSS || reloc.type == EXTERNAL_REF) &&
+			reloc.symbol_ptr >= symbol_name_table_size)
+		{
+			errors << "ERROR: Bad symbol in object file : " << file[current_file].filename << endl;
+			bailout();
+		}
+
+		// References must be to a word in the text or data segment
+		if (reloc.type > TEXT_REGION ||
+			(reloc.type != GLOBAL_TEXT && reloc.type != GLOBAL_DATA && reloc.type != GLOBAL_BSS &&
+			 !((reloc.source_seg == TEXT && reloc.address < header.text_seg_size) ||
+			   (reloc.source_seg == DATA && reloc.address < header.data_seg_size))))
+		{
+			errors << "ERROR: Bad relocation in object file : " << file[current_file].filename << endl;
+			bailout();
+		}
+
+		// Make a note of all the globals
+		if (reloc.type == GLOBAL_TEXT || reloc.type == GLOBAL_DATA || reloc.type == GLOBAL_BSS)
+		{
+			global_symbol global;
+			global.name = &(symbol_names[reloc.symbol_ptr]);
+			global.address = reloc.address;
+
+			// Fill in the segment field
+			if (reloc.type == GLOBAL_TEXT)
+				global.segment = TEXT;
+			else if (reloc.type == GLOBAL_DATA)
+				global.segment = DATA;
+			else
+				global.segment = BSS;
+
+			file[current_file].globals.push_back(global);
+		}
+		else if (reloc.type == EXTERNAL_REF)
+		{
+			// Only allowed external references from the text segment for now
+			assert(reloc.source_seg == TEXT || reloc.source_seg == DATA);
+
+			// Add a new reference to the list from this file
+			reference *new_ref = new reference;
+			// The label is looked up once all the files are read
+			new_ref->label = NULL;
+			new_ref->name = &(symbol_names[reloc.symbol_ptr]);
+			new_ref->address = reloc.address;
+			new_ref->adjust = 0;
+			new_ref->next = file[current_file].references;
+			new_ref->source_seg = reloc.source_seg;
+			file[current_file].references = new_ref;
+		}
+		else if (reloc.type == TEXT_REGION)
+		{
+			file[current_file].region_starts.push_back(reloc.address);
+		}
+		else
+		{
+			// Must be an internal reference that requires relocating
+			// This won't have a label, and could refer to either the data, or text segment
+			reference *new_ref = new reference;
+			new_ref->source_seg = reloc.source_seg;
+			new_ref->address = reloc.address;
+			new_ref->label = NULL;
+			new_ref->name = NULL;
+			new_ref->adjust = 0;
+			new_ref->next = file[current_file].references;
+
+			if (reloc.type == TEXT_LABEL_REF)
+				new_ref->target_seg = TEXT;
+			else if (reloc.type == DATA_LABEL_REF)
+				new_ref->target_seg = DATA;
+			else
+				new_ref->target_seg = BSS;
+
+			file[current_file].references = new_ref;
+		}
+	}
+
+	if (keep_lines == true)
+		read_lines(current_file, view, errors);
+}
+
+// Reads the line table of an object file, if it has one
+void linker::read_lines(int file_no, const object_view &view, ostream &errors)
 {
-	char filename[300];
-	object_header file_header;
-	unsigned int *segment[NUM_SEGMENTS];
-	// These hold the starting address of each segment
-	unsigned int segment_address[NUM_SEGMENTS];
+	if (view.lines != NULL && !read_line_table(view, file[file_no].line_source, file[file_no].line_runs))
+	{
+		errors << "ERROR: Bad line table in object file : " << file[file_no].filename << endl;
+		bailout();
+	}
+}
 
-	reference *references;
-} file_type;
+// Reads one object file, keeping its messages to report in file order
+void linker::load_file(int file_no)
+{
+	ostringstream errors;
+
+	try
+	{
+		read_object(inputs[file_no], file_no, errors);
+	}
+	catch (link_error &)
+	{
+		file[file_no].failed = true;
+	}
+	file[file_no].messages = errors.str();
+
+	if (keep_state == true)
+		hash_file(file_no);
+}
+
+// Hashes an object file, so a later link can tell if it has changed
+void linker::hash_file(int file_no)
+{
+	file[file_no].hash = hash_contents(inputs[file_no].data, inputs[file_no].length);
+}
+
+// Adds a loaded file's globals to the symbol table, and looks up the labels
+// of its external references. Files are merged one at a time in the order
+// they were given, so duplicates are reported the same way every time.
+void linker::merge_symbols(int file_no)
+{
+	file_type &f = file[file_no];
+
+	// Increment the size counters
+	text_size += f.file_header.text_seg_size;
+	data_size += f.file_header.data_seg_size;
+	bss_size += f.file_header.bss_seg_size;
+
+	for (unsigned int i = 0; i < f.globals.size(); i++)
+	{
+		// Create a new label entry for this global
+		label_entry *temp = get_label(f.globals[i].name);
+
+		// Check for duplicate labels
+		if (temp->resolved == true)
+		{
+			messages << "ERROR: Duplicate label in file " << f.filename << ". '"
+					 << f.globals[i].name
+					 << "' already declared in file " << file[temp->file_no].filename << endl;
+			// We should really keep going to see if other errors arise, and bail out later
+			error_flag = true;
+			bailout();
+		}
+		// Mark this as being resolved
+		temp->resolved = true;
+		temp->address = f.globals[i].address;
+		temp->segment = f.globals[i].segment;
+		temp->file_no = file_no;
+	}
+
+	for (reference *walk = f.references; walk != NULL; walk = walk->next)
+	{
+		if (walk->name != NULL)
+			walk->label = get_label(walk->name);
+	}
+}
+
+// Copies one file's text and data into the linked image, and updates all
+// its references there. Each file has its own part of the image, so files
+// can be relocated at the same time once the symbols are all known.
+void linker::relocate_file(int file_no)
+{
+	ostringstream errors;
+	int i;
 
-void usage(char *progname)
+	for (i = TEXT; i <= DATA; i++)
+	{
+		unsigned int size = (i == TEXT) ? file[file_no].file_header.text_seg_size : file[file_no].file_header.data_seg_size;
+
+		if (size > 0)
+			memcpy(linked_words(file_no, i), file[file_no].segment[i], size * sizeof(unsigned int));
+	}
+
+	// Now all the segment addresses have been set, we update all the references
+	reference *walk = file[file_no].references;
+
+	while (walk != NULL)
+	{
+		unsigned int resolved_address;
+
+		if (walk->label == NULL)
+		{
+			// Local reference : we must know which segment it targets
+			resolved_address = file[file_no].segment_address[walk->target_seg];
+		}
+		else
+		{
+			// Check that we have a match for the external reference
+			if (walk->label->resolved == false)
+			{
+				errors << "ERROR: Undefined label '" << walk->label->name << "', referenced from file "
+					 << file[file_no].filename << endl;
+				// Keep going, bail out later
+				file[file_no].failed = true;
+				//	  exit(1);
+			}
+
+			// Resolve it
+			resolved_address = walk->label->address;
+			// Add the segment offset if this isn't a global symbol
+			if (walk->label->file_no != -1)
+				resolved_address += file[walk->label->file_no].segment_address[walk->label->segment];
+		}
+
+		//      cerr << "resolving reference at address : 0x" << setw(5) << setfill('0') << hex << (file[file_no].segment_address[walk->source_seg] + walk->address) << endl;
+
+		// Now we have a resolved address, we can add it to the address part of the instruction
+		unsigned int *word = linked_words(file_no, walk->source_seg) + walk->address;
+		unsigned int insn = *word;
+
+		//      cerr << "old val = 0x" << setw(8) << setfill('0') << hex << insn << endl;
+
+		// Add our address
+		resolved_address = (resolved_address + (insn & 0xfffff) + walk->adjust) & 0xfffff;
+		// Or it back into the instruction
+		*word = (insn & 0xfff00000) | resolved_address;
+
+		//      cerr << "new val = 0x" << setw(8) << setfill('0') << hex << *word << endl;
+
+		// Next reference
+		walk = walk->next;
+	}
+
+	file[file_no].messages = errors.str();
+}
+
+void *linker::file_worker(void *arg)
+{
+	task_queue *queue = (task_queue *)arg;
+
+	pthread_mutex_lock(&queue->lock);
+	while (queue->next_file < queue->owner->num_files)
+	{
+		int file_no = queue->next_file++;
+		pthread_mutex_unlock(&queue->lock);
+
+		(queue->owner->*(queue->task))(file_no);
+
+		pthread_mutex_lock(&queue->lock);
+	}
+	pthread_mutex_unlock(&queue->lock);
+
+	return NULL;
+}
+
+// Runs a task on every file from first_file on, using num_threads threads
+// if there is more than one. The calling thread takes files as well.
+void linker::for_each_file(file_task task, int first_file)
+{
+	int i;
+
+	int threads_wanted = min(num_threads, num_files - first_file) - 1;
+	if (threads_wanted <= 0)
+	{
+		for (i = first_file; i < num_files; i++)
+			(this->*task)(i);
+		return;
+	}
+
+	task_queue queue;
+	queue.owner = this;
+	queue.task = task;
+	queue.next_file = first_file;
+	pthread_mutex_init(&queue.lock, NULL);
+
+	vector<pthread_t> threads(threads_wanted);
+	int num_started = 0;
+	for (i = 0; i < threads_wanted; i++)
+	{
+		if (pthread_create(&threads[num_started], NULL, file_worker, &queue) == 0)
+			num_started++;
+	}
+
+	file_worker(&queue);
+
+	for (i = 0; i < num_started; i++)
+		pthread_join(threads[i], NULL);
+
+	pthread_mutex_destroy(&queue.lock);
+}
+
+// Sets up an entry for a file that hasn't been read yet
+void linker::init_file(int file_no)
 {
-	cerr << "USAGE: " << progname << " [-Ttext address] [-Tdata address] [-[T|E]bss address] [-v] [-o output] file1 file2 ...\n";
-	exit(1);
+	// The segments all start at zero
+	file[file_no].filename = inputs[file_no].filename;
+	file[file_no].segment[TEXT] = NULL;
+	file[file_no].segment[DATA] = NULL;
+	file[file_no].copied_words = NULL;
+	file[file_no].segment_address[TEXT] = 0;
+	file[file_no].segment_address[DATA] = 0;
+	file[file_no].segment_address[BSS] = 0;
+	file[file_no].references = NULL;
+	file[file_no].failed = false;
+	file[file_no].line_source = NULL;
 }
 
-int main(int argc, char *argv[])
+// Reads in the files from first_file to the end of inputs, then adds their
+// symbols in order, stopping at the first file with errors as if they were
+// read one by one
+void linker::load_files(int first_file)
+{
+	int current_file;
+
+	num_files = inputs.size();
+	file.resize(num_files);
+	for (current_file = first_file; current_file < num_files; current_file++)
+		init_file(current_file);
+
+	for_each_file(&linker::load_file, first_file);
+	for (current_file = first_file; current_file < num_files; current_file++)
+	{
+		messages << file[current_file].messages;
+		if (file[current_file].failed == true)
+			bailout();
+
+		merge_symbols(current_file);
+	}
+}
+
+// Queues the first archive member that declares this label to be linked,
+// unless it already has been
+void linker::pull_member(const char *name)
+{
+	for (unsigned int i = 0; i < archives.size(); i++)
+	{
+		int member = archives[i]->find(name);
+		if (member >= 0)
+		{
+			if (member_pulled[i][member] == false)
+			{
+				member_pulled[i][member] = true;
+				inputs.push_back(archives[i]->member(member));
+			}
+			return;
+		}
+	}
+}
+
+// Returns the number of the text region holding an offset in a file's text
+// segment, the regions of each file being numbered from first_region
+unsigned int linker::region_of(int file_no, unsigned int offset, const vector<unsigned int> &first_region)
+{
+	const vector<unsigned int> &starts = file[file_no].region_starts;
+
+	return first_region[file_no] + (upper_bound(starts.begin(), starts.end(), offset) - starts.begin()) - 1;
+}
+
+// Returns the text region a reference refers to, or -1 if it refers to data
+int linker::text_target(int file_no, reference *ref, const vector<unsigned int> &first_region)
+{
+	if (ref->label == NULL)
+	{
+		if (ref->target_seg != TEXT)
+			return -1;
+
+		// The offset within the file's text segment is already in the word
+		unsigned int offset = file[file_no].segment[ref->source_seg][ref->address] & 0xfffff;
+		return region_of(file_no, offset, first_region);
+	}
+
+	label_entry *label = ref->label;
+	if (label->resolved == false || label->file_no == -1 || label->segment != TEXT)
+		return -1;
+
+	return region_of(label->file_no, label->address, first_region);
+}
+
+// Drops the regions of the text segments that can't be reached from main or
+// from the data segments, before the segment addresses are set. Each file is
+// one region, unless wasm split its text segment into more.
+void linker::collect_garbage()
 {
 	int i;
-	char *endptr = NULL;
-	char output_filename[300] = {0};
+	unsigned int r;
+	reference *walk;
+
+	// Number the regions of all the files
+	vector<unsigned int> first_region(num_files);
+	unsigned int num_regions = 0;
+	for (i = 0; i < num_files; i++)
+	{
+		vector<unsigned int> &starts = file[i].region_starts;
+
+		starts.push_back(0);
+		sort(starts.begin(), starts.end());
+		starts.erase(unique(starts.begin(), starts.end()), starts.end());
+
+		first_region[i] = num_regions;
+		num_regions += starts.size();
+	}
+
+	// Find the regions each region refers to, and the ones the data refers to
+	vector<vector<unsigned int> > targets(num_regions);
+	vector<unsigned int> reachable;
+	vector<bool> used(num_regions, false);
+
+	label_entry *main = get_label("main");
+	if (main->resolved == true && main->segment == TEXT && main->file_no != -1)
+		reachable.push_back(region_of(main->file_no, main->address, first_region));
+
+	for (i = 0; i < num_files; i++)
+	{
+		for (walk = file[i].references; walk != NULL; walk = walk->next)
+		{
+			int target = text_target(i, walk, first_region);
+			if (target < 0)
+				continue;
+
+			if (walk->source_seg == TEXT)
+				targets[region_of(i, walk->address, first_region)].push_back(target);
+			else
+				reachable.push_back(target);
+		}
+	}
+
+	// Mark everything that can be reached
+	while (!reachable.empty())
+	{
+		r = reachable.back();
+		reachable.pop_back();
+
+		if (used[r] == true)
+			continue;
+		used[r] = true;
 
-	if (argc < 2)
-		usage(argv[0]);
+		for (unsigned int j = 0; j < targets[r].size(); j++)
+			reachable.push_back(targets[r][j]);
+	}
 
-	// Here we must parse the arguments
-	typedef char *char_p;
-	char **input_filename = new char_p[argc];
-	int num_files = 0;
-	for (i = 1; i < argc; i++)
+	// Work out how far each region moves down, from the words dropped before it
+	vector<unsigned int> moved(num_regions);
+	for (i = 0; i < num_files; i++)
 	{
-		// Is this an option
-		if (argv[i][0] == '-')
+		const vector<unsigned int> &starts = file[i].region_starts;
+		unsigned int dropped = 0;
+
+		for (r = 0; r < starts.size(); r++)
 		{
-			// This is the only valid option for now
-			if (strcmp(argv[i], "-o") == 0)
-			{
-				if ((i + 1) == argc)
-					usage(argv[0]);
+			unsigned int end = (r + 1 < starts.size()) ? starts[r + 1] : file[i].file_header.text_seg_size;
 
-				// Redefinition of the output file
-				if (output_filename[0] != '\0')
-					usage(argv[0]);
+			moved[first_region[i] + r] = dropped;
+			if (used[first_region[i] + r] == false)
+				dropped += end - starts[r];
+		}
+	}
 
-				i++;
-				strcpy(output_filename, argv[i]);
-			}
-			else if (strcmp(argv[i], "-Ttext") == 0)
+	// Forget the references from dropped regions, and move the rest along
+	// with the text they are in, and the text they refer to
+	for (i = 0; i < num_files; i++)
+	{
+		reference **link = &file[i].references;
+		while ((walk = *link) != NULL)
+		{
+			if (walk->label == NULL && walk->target_seg == TEXT)
 			{
-				if ((i + 1) == argc)
-					usage(argv[0]);
-				i++;
-
-				text_address = (starting_text_address = strtol(argv[i], &endptr, 0));
-
-				if (*endptr != 0)
-					usage(argv[0]);
+				unsigned int offset = file[i].segment[walk->source_seg][walk->address] & 0xfffff;
+				walk->adjust = -(int)moved[region_of(i, offset, first_region)];
 			}
-			else if (strcmp(argv[i], "-Tdata") == 0)
+
+			if (walk->source_seg == TEXT)
 			{
-				if ((i + 1) == argc)
-					usage(argv[0]);
-				i++;
+				r = region_of(i, walk->address, first_region);
+				if (used[r] == false)
+				{
+					*link = walk->next;
+					delete walk;
+					continue;
+				}
+				walk->address -= moved[r];
+			}
 
-				data_address = strtol(argv[i], &endptr, 0);
+			link = &walk->next;
+		}
+	}
 
-				if (*endptr != 0)
-					usage(argv[0]);
-			}
-			else if (strcmp(argv[i], "-Tbss") == 0)
-			{
-				if ((i + 1) == argc)
-					usage(argv[0]);
-				i++;
+	// Move the text globals too
+	for (label_entry *label = label_list; label != NULL; label = label->next)
+	{
+		if (label->resolved == true && label->file_no != -1 && label->segment == TEXT)
+			label->address -= moved[region_of(label->file_no, label->address, first_region)];
+	}
+
+	// Finally keep just the text that is used
+	for (i = 0; i < num_files; i++)
+	{
+		const vector<unsigned int> &starts = file[i].region_starts;
+		unsigned int text_length = file[i].file_header.text_seg_size;
 
-				bss_address = strtol(argv[i], &endptr, 0);
+		for (r = 0; r < starts.size(); r++)
+		{
+			unsigned int end = (r + 1 < starts.size()) ? starts[r + 1] : text_length;
 
-				if (*endptr != 0)
-					usage(argv[0]);
-			}
-			else if (strcmp(argv[i], "-Ebss") == 0)
-			{
-				if ((i + 1) == argc)
-					usage(argv[0]);
-				i++;
+			if (used[first_region[i] + r] == true)
+				file[i].gc_text.insert(file[i].gc_text.end(), file[i].segment[TEXT] + starts[r], file[i].segment[TEXT] + end);
+		}
 
-				bss_address = strtol(argv[i], &endptr, 0);
-				bss_end_justify = true;
+		// The line runs move with the text, split where the regions start
+		if (keep_lines == true)
+		{
+			const vector<line_run> &old_runs = file[i].line_runs[TEXT];
+			vector<line_run> runs;
+			unsigned int k = 0;
 
-				if (*endptr != 0)
-					usage(argv[0]);
-			}
-			else if (strcmp(argv[i], "-v") == 0)
+			for (r = 0; r < starts.size(); r++)
 			{
-				verbose_flag = true;
+				unsigned int end = (r + 1 < starts.size()) ? starts[r + 1] : text_length;
+				if (used[first_region[i] + r] == false)
+					continue;
+
+				while (k + 1 < old_runs.size() && old_runs[k + 1].address <= starts[r])
+					k++;
+				for (unsigned int j = k; j < old_runs.size() && old_runs[j].address < end; j++)
+				{
+					line_run run = {max(old_runs[j].address, starts[r]) - moved[first_region[i] + r], old_runs[j].line};
+					if (runs.empty() || runs.back().line != run.line)
+						runs.push_back(run);
+				}
 			}
-			else
-				usage(argv[0]);
-		}
-		else
-		{
-			// Otherwise it is a filename
-			input_filename[num_files] = argv[i];
-			num_files++;
+			file[i].line_runs[TEXT].swap(runs);
 		}
+
+		gc_removed_words += text_length - file[i].gc_text.size();
+		file[i].file_header.text_seg_size = file[i].gc_text.size();
+		file[i].segment[TEXT] = file[i].gc_text.empty() ? NULL : &file[i].gc_text[0];
 	}
 
-	if (num_files == 0)
-		usage(argv[0]);
+	text_size -= gc_removed_words;
+}
+
+void linker::link(const vector<object_buffer> &objects, string &image, string *state, string *lines)
+{
+	int i;
+
+	keep_state = (state != NULL);
+	keep_lines = (lines != NULL);
 
-	if (output_filename[0] == '\0')
+	// Each S-record holds whole words, and must fit in the 255 byte limit
+	if (srecord_bytes % 4 != 0 || srecord_bytes < 4 || srecord_bytes > 4 * max_srecord_words)
 	{
-		// default to link.out
-		strcpy(output_filename, "link.out");
+		messages << "ERROR: S-record size must be a multiple of 4 from 4 to " << dec << 4 * max_srecord_words << " bytes" << endl;
+		bailout();
 	}
 
 	// Setup the linker special symbols
@@ -264,138 +1446,54 @@ int main(int argc, char *argv[])
 	data_size_symbol->resolved = true;
 	data_size_symbol->file_no = -1;
 
-	int current_file = 0;
-
-	file_type *file = new file_type[num_files];
-
-	// Read in the data from all the files
-	for (current_file = 0; current_file < num_files; current_file++)
+	// Object files are always linked, archive members only when needed
+	for (i = 0; i < (int)objects.size(); i++)
 	{
-		// Open the current file
-		ifstream sourcefile;
-		sourcefile.open(input_filename[current_file], ios::in | ios::binary);
-
-		if (!sourcefile)
+		if (is_archive(objects[i]))
 		{
-			cerr << "ERROR: Could not open file for input : " << input_filename[current_file] << endl;
-			exit(1);
-		}
+			archive_reader *reader = new archive_reader;
+			archives.push_back(reader);
+			if (!reader->open(objects[i], messages))
+				bailout();
 
-		// Copy the filename into the structure
-		strcpy(file[current_file].filename, input_filename[current_file]);
-
-		// Read the header in
-		sourcefile.read((char *)&(file[current_file].file_header), sizeof(object_header));
-
-		// Verify the magic number
-		if (file[current_file].file_header.magic_number != OBJ_MAGIC_NUM)
-		{
-			cerr << "ERROR: File is not an object file : " << file[current_file].filename << endl;
-			exit(1);
+			member_pulled.push_back(vector<bool>(reader->num_members(), false));
 		}
+		else
+			inputs.push_back(objects[i]);
+	}
 
-		// The segments all start at zero
-		file[current_file].segment_address[TEXT] = 0;
-		file[current_file].segment_address[DATA] = 0;
-		file[current_file].segment_address[BSS] = 0;
-		file[current_file].references = NULL;
-
-		// Now we allocate space for, and read the segments in
-		file[current_file].segment[TEXT] = new unsigned int[file[current_file].file_header.text_seg_size];
-		// Read in the text segment
-		sourcefile.read((char *)file[current_file].segment[TEXT], (file[current_file].file_header.text_seg_size * sizeof(unsigned int)));
-		file[current_file].segment[DATA] = new unsigned int[file[current_file].file_header.data_seg_size];
-		// Read in the data segment
-		sourcefile.read((char *)file[current_file].segment[DATA], (file[current_file].file_header.data_seg_size * sizeof(unsigned int)));
-
-		// Increment the size counters
-		text_size += file[current_file].file_header.text_seg_size;
-		data_size += file[current_file].file_header.data_seg_size;
-		bss_size += file[current_file].file_header.bss_seg_size;
-
-		// Now we should read in all the labels for this segment
-		int num_relocs = file[current_file].file_header.num_references;
-		reloc_entry *relocation_array = new reloc_entry[num_relocs];
-		sourcefile.read((char *)relocation_array, sizeof(reloc_entry) * num_relocs);
+	load_files(0);
 
-		// And the symbol labels
-		char *symbol_names = new char[file[current_file].file_header.symbol_name_table_size];
-		sourcefile.read(symbol_names, file[current_file].file_header.symbol_name_table_size);
+	// Pull in the members that declare the labels still undefined, then the
+	// members that those need, until no more are needed
+	int first_file = 0;
+	if (get_label("main")->resolved == false)
+		pull_member("main");
 
-		// Scan through the segment labels
-		for (i = 0; i < num_relocs; i++)
+	for (;;)
+	{
+		for (int j = first_file; j < num_files; j++)
 		{
-			// Make a note of all the globals
-			if (relocation_array[i].type == GLOBAL_TEXT || relocation_array[i].type == GLOBAL_DATA || relocation_array[i].type == GLOBAL_BSS)
-			{
-				// Create a new label entry for this global
-				label_entry *temp = get_label(&(symbol_names[relocation_array[i].symbol_ptr]));
-
-				// Check for duplicate labels
-				if (temp->resolved == true)
-				{
-					cerr << "ERROR: Duplicate label in file " << file[current_file].filename << ". '"
-						 << &(symbol_names[relocation_array[i].symbol_ptr])
-						 << "' already declared in file " << file[temp->file_no].filename << endl;
-					// We should really keep going to see if other errors arise, and bail out later
-					error_flag = true;
-					exit(1);
-				}
-				// Mark this as being resolved
-				temp->resolved = true;
-				// Fill in the address field
-				temp->address = relocation_array[i].address;
-
-				// Fill in the segment field
-				if (relocation_array[i].type == GLOBAL_TEXT)
-					temp->segment = TEXT;
-				else if (relocation_array[i].type == GLOBAL_DATA)
-					temp->segment = DATA;
-				else
-					temp->segment = BSS;
-
-				temp->file_no = current_file;
-			}
-			else if (relocation_array[i].type == EXTERNAL_REF)
+			for (reference *walk = file[j].references; walk != NULL; walk = walk->next)
 			{
-				// Create a label entry for this reference
-				label_entry *temp = get_label(&(symbol_names[relocation_array[i].symbol_ptr]));
-				// Only allowed external references from the text segment for now
-				assert(relocation_array[i].source_seg == TEXT || relocation_array[i].source_seg == DATA);
-
-				// Add a new reference to the list from this file
-				reference *new_ref = new reference;
-				new_ref->label = temp;
-				new_ref->address = relocation_array[i].address;
-				new_ref->next = file[current_file].references;
-				new_ref->source_seg = relocation_array[i].source_seg;
-				file[current_file].references = new_ref;
-			}
-			else
-			{
-				// Must be an internal reference that requires relocating
-				// This won't have a label, and could refer to either the data, or text segment
-				reference *new_ref = new reference;
-				new_ref->source_seg = relocation_array[i].source_seg;
-				new_ref->address = relocation_array[i].address;
-				new_ref->label = NULL;
-				new_ref->next = file[current_file].references;
-
-				if (relocation_array[i].type == TEXT_LABEL_REF)
-					new_ref->target_seg = TEXT;
-				else if (relocation_array[i].type == DATA_LABEL_REF)
-					new_ref->target_seg = DATA;
-				else
-					new_ref->target_seg = BSS;
-
-				file[current_file].references = new_ref;
+				if (walk->label != NULL && walk->label->resolved == false)
+					pull_member(walk->label->name);
 			}
 		}
+
+		if ((int)inputs.size() == num_files)
+			break;
+
+		first_file = num_files;
+		load_files(first_file);
 	}
 
 	// Bail out if we had an error
 	if (error_flag == true)
-		exit(1);
+		bailout();
+
+	if (gc_sections == true)
+		collect_garbage();
 
 	// check for end justify on the bss
 	if (bss_end_justify == true)
@@ -459,68 +1557,39 @@ int main(int argc, char *argv[])
 
 
 
-	// Now all the segment addresses have been set, we update all the references
-	for (i = 0; i < num_files; i++)
+	// Work out where each file's text and data go in the linked image
+	for (i = TEXT; i <= DATA; i++)
 	{
-		reference *walk = file[i].references;
+		image_words[i].resize(i == TEXT ? text_size : data_size);
 
-		while (walk != NULL)
+		unsigned int offset = 0;
+		for (int j = 0; j < num_files; j++)
 		{
-			unsigned int resolved_address;
-
-			if (walk->label == NULL)
-			{
-				// Local reference : we must know which segment it targets
-				resolved_address = file[i].segment_address[walk->target_seg];
-			}
-			else
-			{
-				// Check that we have a match for the external reference
-				if (walk->label->resolved == false)
-				{
-					cerr << "ERROR: Undefined label '" << walk->label->name << "', referenced from file "
-						 << file[i].filename << endl;
-					// Keep going, bail out later
-					error_flag = true;
-					//	  exit(1);
-				}
-
-				// Resolve it
-				resolved_address = walk->label->address;
-				// Add the segment offset if this isn't a global symbol
-				if (walk->label->file_no != -1)
-					resolved_address += file[walk->label->file_no].segment_address[walk->label->segment];
-			}
-
-			//      cerr << "resolving reference at address : 0x" << setw(5) << setfill('0') << hex << (file[i].segment_address[walk->source_seg] + walk->address) << endl;
-
-			// Now we have a resolved address, we can add it to the address part of the instruction
-			unsigned int insn = file[i].segment[walk->source_seg][walk->address];
-
-			//      cerr << "old val = 0x" << setw(8) << setfill('0') << hex << insn << endl;
-
-			// Add our address
-			resolved_address = (resolved_address + (insn & 0xfffff)) & 0xfffff;
-			// Or it back into the instruction
-			file[i].segment[walk->source_seg][walk->address] = (insn & 0xfff00000) | resolved_address;
-
-			//      cerr << "new val = 0x" << setw(8) << setfill('0') << hex << file[i].segment[walk->source_seg][walk->address] << endl;
-
-			// Next reference
-			walk = walk->next;
+			file[j].image_offset[i] = offset;
+			offset += (i == TEXT) ? file[j].file_header.text_seg_size : file[j].file_header.data_seg_size;
 		}
 	}
 
+	// Copy the files into the image and update all their references, then
+	// report any undefined labels in file order
+	for_each_file(&linker::relocate_file, 0);
+	for (i = 0; i < num_files; i++)
+	{
+		messages << file[i].messages;
+		if (file[i].failed == true)
+			error_flag = true;
+	}
+
 	unsigned int  bss_start = -1, bss_end = -1;
 	unsigned int data_start = -1, data_end = -1;
 	unsigned int text_end = -1;
 
 
 	if (error_flag == true)
-		exit(1);
+		bailout();
 
 	// Righto, now we are all done, dump the output for now
-	unsigned int current_address;
+	unsigned int current_address = starting_text_address;
 
 	if (verbose_flag == true)
 	{
@@ -533,7 +1602,7 @@ int main(int argc, char *argv[])
 				// Set the starting address
 				current_address = file[j].segment_address[i];
 
-				cout << "file '" << file[j].filename << "', starting : 0x" << setw(5) << hex << setfill('0')
+				listing << "file '" << file[j].filename << "', starting : 0x" << setw(5) << hex << setfill('0')
 					 << current_address << ", ";
 
 				if (bss_start == (unsigned int)-1 && i == BSS) bss_start = current_address;
@@ -543,30 +1612,30 @@ int main(int argc, char *argv[])
 				if (i == TEXT)
 				{
 					size = file[j].file_header.text_seg_size;
-					cout << ".text\n";
+					listing << ".text\n";
 				}
 				else if (i == DATA)
 				{
 					size = file[j].file_header.data_seg_size;
-					cout << ".data\n";
+					listing << ".data\n";
 				}
 				else
 				{
 					size = 0;
-					cout << ".bss : " << file[j].file_header.bss_seg_size << " words.\n";
+					listing << ".bss : " << file[j].file_header.bss_seg_size << " words.\n";
 				}
 
 				for (int k = 0; k < size; k++)
 				{
-					cout << "0x" << setw(5) << hex << setfill('0') << current_address << " : "
-						 << setw(8) << hex << setfill('0') << file[j].segment[i][k] << "    ";
+					listing << "0x" << setw(5) << hex << setfill('0') << current_address << " : "
+						 << setw(8) << hex << setfill('0') << linked_words(j, i)[k] << "    ";
 					if (i == TEXT)
-						disassemble(current_address, file[j].segment[i][k]);
-					cout << endl;
+						disassemble(listing, current_address, linked_words(j, i)[k]);
+					listing << endl;
 					current_address++;
 				}
 
-				cout << endl;
+				listing << endl;
 			}
 		}
 	}
@@ -578,43 +1647,26 @@ int main(int argc, char *argv[])
 	if (main->resolved == false)
 	{
 		entry_point = starting_text_address;
-		cerr << "ERROR: Can not find program entry point 'main', does a '.global main' directive exist?\n";
-		exit(1);
+		messages << "ERROR: Can not find program entry point 'main', does a '.global main' directive exist?\n";
+		bailout();
 	}
 	else
 		entry_point = main->address + file[main->file_no].segment_address[main->segment];
 
 	if (verbose_flag == true)
 	{
-		cout << "entry point : 0x" << setw(5) << hex << setfill('0') << entry_point << endl;
-		cout << ".text segment size = 0x" << setw(8) << setfill('0') << hex << text_size << endl;
-		cout << ".data segment size = 0x" << setw(8) << setfill('0') << hex << data_size << endl;
-		cout << ".bss  segment size = 0x" << setw(8) << setfill('0') << hex << bss_size << endl;
+		listing << "entry point : 0x" << setw(5) << hex << setfill('0') << entry_point << endl;
+		listing << ".text segment size = 0x" << setw(8) << setfill('0') << hex << text_size << endl;
+		listing << ".data segment size = 0x" << setw(8) << setfill('0') << hex << data_size << endl;
+		listing << ".bss  segment size = 0x" << setw(8) << setfill('0') << hex << bss_size << endl;
+		if (gc_sections == true)
+			listing << "unused code removed = " << dec << gc_removed_words * sizeof(unsigned int) << " bytes" << endl;
 	}
 
 	// What we probably want to do here, is output an S-Record
 	// Now we have all the info, we just need to put it all together
 	// first the text segments and then the data segments
-	ofstream outputfile;
-	outputfile.open(output_filename, ios::out);
-	if (!outputfile)
-	{
-		cerr << "ERROR: Could not open output file " << output_filename << endl;
-		exit(1);
-	}
-
-	// Here we output an SRecord
-	// Starting record (optional)
-	//  outputfile << "S0030000FC\n"; // length = 3, address = 0, checksum = 0xfc
-
-	// S3 data records
-
-	const int max_srecord_line = 10; // Maximum number of words in an srecord line
-	int buffer[max_srecord_line];
-	int starting_address = 0;
-	int buf_ptr = 0;
-
-
+	vector<image_run> runs;
 
 	for (i = 0; i < NUM_SEGMENTS; i++)
 	{
@@ -645,22 +1697,12 @@ int main(int argc, char *argv[])
 				else
 					size = file[j].file_header.data_seg_size;
 
-				for (int k = 0; k < size; k++)
+				if (size > 0)
 				{
-					// Get the starting address of this record's data
-					if (buf_ptr == 0)
-						starting_address = current_address;
-
-					buffer[buf_ptr] = file[j].segment[i][k];
-					buf_ptr++;
-
-					if (buf_ptr == max_srecord_line)
-					{
-						output_srecord(outputfile, 3, starting_address, buffer, buf_ptr);
-						buf_ptr = 0;
-					}
-					current_address++;
+					image_run run = {current_address, linked_words(j, i), (unsigned int)size};
+					runs.push_back(run);
 				}
+				current_address += size;
 			}
 		}
 		switch (i){
@@ -679,28 +1721,465 @@ int main(int argc, char *argv[])
 
 	if (verbose_flag == true){
 		//cout << "\nsegment locations: {start, end}" << endl;
-		cout << ".text segment start = 0x" << setw(6) << hex << setfill('0') << starting_text_address << ", segment end = 0x" << setw(6) << hex << setfill('0') << text_end << endl;
-		cout << ".data segment start = 0x" << setw(6) << hex << setfill('0') <<            data_start << ", segment end = 0x" << setw(6) << hex << setfill('0') << data_end << endl;
-		cout << ".bss  segment start = 0x" << setw(6) << hex << setfill('0') <<             bss_start << ", segment end = 0x" << setw(6) << hex << setfill('0') <<  bss_end << endl;
+		listing << ".text segment start = 0x" << setw(6) << hex << setfill('0') << starting_text_address << ", segment end = 0x" << setw(6) << hex << setfill('0') << text_end << endl;
+		listing << ".data segment start = 0x" << setw(6) << hex << setfill('0') <<            data_start << ", segment end = 0x" << setw(6) << hex << setfill('0') << data_end << endl;
+		listing << ".bss  segment start = 0x" << setw(6) << hex << setfill('0') <<             bss_start << ", segment end = 0x" << setw(6) << hex << setfill('0') <<  bss_end << endl;
 	}
 
 	if (bss_end	> starting_text_address && text_end > bss_start){
-		cerr << "ERROR: .bss and .text segments overlap " << endl;
-		exit(1);
+		messages << "ERROR: .bss and .text segments overlap " << endl;
+		bailout();
 	}
 	if (text_end > data_start && data_end > starting_text_address){
-		cerr << "ERROR: .text and .data segments overlap " << endl;
-		exit(1);
+		messages << "ERROR: .text and .data segments overlap " << endl;
+		bailout();
 	}
 	if (data_end > bss_start && bss_end > data_start){
-		cerr << "ERROR: .data and .bss segments overlap " << endl;
-		exit(1);
+		messages << "ERROR: .data and .bss segments overlap " << endl;
+		bailout();
 	}
 
-	if (buf_ptr > 0)
-		output_srecord(outputfile, 3, starting_address, buffer, buf_ptr);
+	if (state != NULL)
+	{
+		// Layouts that depend on which code is used can't be patched later
+		if (gc_sections == false && archives.empty())
+			save_state(*state, entry_point);
+		else
+			state->clear();
+	}
+
+	if (lines != NULL)
+		write_line_table(*lines);
+
+	write_output(runs, entry_point, image);
+}
+
+// Writes the image in the format asked for
+void linker::write_output(const vector<image_run> &runs, unsigned int entry_point, string &image)
+{
+	image.clear();
+	switch (output_format)
+	{
+	case SRECORD:
+		write_srecords(image, runs, entry_point, srecord_bytes, srecord_s2);
+		break;
+	case BINARY_LE:
+		write_binary(image, runs, false);
+		break;
+	case BINARY_BE:
+		write_binary(image, runs, true);
+		break;
+	case VIVADO_MEM:
+		write_mem(image, runs);
+		break;
+	case INTEL_HEX:
+		write_ihex(image, runs, entry_point);
+		break;
+	}
+}
+
+// Writes an address as at least 5 hex digits, returning the end
+static char *put_hex(char *out, unsigned int value)
+{
+	int digits = 5;
+	while (digits < 8 && (value >> (4 * digits)) != 0)
+		digits++;
+
+	for (int i = digits - 1; i >= 0; i--)
+		*out++ = "0123456789abcdef"[(value >> (4 * i)) & 0xf];
+	return out;
+}
+
+static char *put_decimal(char *out, unsigned int value)
+{
+	char digits[10];
+	int num_digits = 0;
+
+	do
+	{
+		digits[num_digits++] = '0' + value % 10;
+		value /= 10;
+	} while (value != 0);
+
+	while (num_digits > 0)
+		*out++ = digits[--num_digits];
+	return out;
+}
+
+// Lists the source line of each run of words in the linked program, in
+// address order, from the line tables of the files that have them
+void linker::write_line_table(string &lines)
+{
+	vector<line_entry> entries;
+	char text[40];
+
+	for (int i = 0; i < num_files; i++)
+	{
+		for (int seg = TEXT; seg <= DATA; seg++)
+		{
+			const vector<line_run> &runs = file[i].line_runs[seg];
+			unsigned int size = (seg == TEXT) ? file[i].file_header.text_seg_size : file[i].file_header.data_seg_size;
+
+			for (unsigned int j = 0; j < runs.size(); j++)
+			{
+				unsigned int end = (j + 1 < runs.size()) ? runs[j + 1].address : size;
+				line_entry entry = {file[i].segment_address[seg] + runs[j].address, file[i].segment_address[seg] + end,
+									file[i].line_source, runs[j].line};
+				entries.push_back(entry);
+			}
+		}
+	}
+	// The files are laid out in order, so this is only needed when the data
+	// segments come before the text
+	for (unsigned int j = 1; j < entries.size(); j++)
+	{
+		if (entries[j].start < entries[j - 1].start)
+		{
+			stable_sort(entries.begin(), entries.end());
+			break;
+		}
+	}
+
+	lines.clear();
+	for (unsigned int j = 0; j < entries.size(); j++)
+	{
+		char *end = put_hex(text, entries[j].start);
+		*end++ = ' ';
+		end = put_hex(end, entries[j].end);
+		*end++ = ' ';
+		lines.append(text, end - text);
+		lines += entries[j].source;
+		end = text;
+		*end++ = ':';
+		end = put_decimal(end, entries[j].line);
+		*end++ = '\n';
+		lines.append(text, end - text);
+	}
+}
+
+bool link_objects(const vector<object_buffer> &objects, const link_options &options,
+				  string &image, ostream &listing, ostream &messages, string *lines)
+{
+	linker l(options, listing, messages);
+
+	try
+	{
+		l.link(objects, image, NULL, lines);
+	}
+	catch (link_error &)
+	{
+		image.clear();
+		if (lines != NULL)
+			lines->clear();
+		return false;
+	}
+	return true;
+}
+
+// Saves the layout, the symbols, the words referring to them and the linked
+// segments, so that a later link of the same files can re-patch just the
+// files that have changed
+void linker::save_state(string &state, unsigned int entry_point)
+{
+	link_state saved;
+	int i;
+
+	for (i = 0; i < num_files; i++)
+	{
+		state_file f;
+
+		f.name_ptr = saved.names.size();
+		saved.names.append(file[i].filename, strlen(file[i].filename) + 1);
+		f.hash = file[i].hash;
+		f.segment_size[TEXT] = file[i].file_header.text_seg_size;
+		f.segment_size[DATA] = file[i].file_header.data_seg_size;
+		f.segment_size[BSS] = file[i].file_header.bss_seg_size;
+		for (int seg = 0; seg < NUM_SEGMENTS; seg++)
+			f.segment_address[seg] = file[i].segment_address[seg];
+		f.image_offset[TEXT] = file[i].image_offset[TEXT];
+		f.image_offset[DATA] = file[i].image_offset[DATA];
+		f.image_offset[BSS] = 0;
+
+		saved.files.push_back(f);
+	}
+
+	for (label_entry *label = label_list; label != NULL; label = label->next)
+	{
+		if (label->resolved == false)
+			continue;
+
+		state_symbol symbol;
+		symbol.name_ptr = saved.names.size();
+		saved.names.append(label->name, strlen(label->name) + 1);
+		symbol.address = label->address;
+		if (label->file_no != -1)
+			symbol.address += file[label->file_no].segment_address[label->segment];
+		symbol.file_no = label->file_no;
+
+		label->state_symbol = saved.symbols.size();
+		saved.symbols.push_back(symbol);
+	}
+
+	for (i = 0; i < num_files; i++)
+	{
+		for (reference *walk = file[i].references; walk != NULL; walk = walk->next)
+		{
+			if (walk->label == NULL)
+				continue;
+
+			state_site site = {(unsigned int)walk->label->state_symbol, (unsigned int)i, (unsigned int)walk->source_seg,
+							   file[i].image_offset[walk->source_seg] + walk->address};
+			saved.sites.push_back(site);
+		}
+	}
+
+	state_header &header = saved.header;
+	header.magic_number = LINK_STATE_MAGIC_NUM;
+	header.version = LINK_STATE_VERSION;
+	header.text_address = requested.text_address;
+	header.data_address = requested.data_address;
+	header.bss_address = requested.bss_address;
+	header.bss_end_justify = requested.bss_end_justify;
+	header.num_files = saved.files.size();
+	header.num_symbols = saved.symbols.size();
+	header.num_sites = saved.sites.size();
+	header.text_words = image_words[TEXT].size();
+	header.data_words = image_words[DATA].size();
+	header.entry_point = entry_point;
+	header.name_table_size = saved.names.size();
+
+	write_state(saved, image_words, state);
+}
+
+// Links the same files as the link saved in previous_state, reading and
+// relocating only the files that have changed, then updating the words in
+// the other files that refer to symbols which have moved. Returns false if
+// a full link is needed instead: when the options or the list of files
+// differ, or a changed file's segments or globals are not the same as before.
+bool linker::relink(const vector<object_buffer> &objects, const string &previous_state, string &state, string &image,
+					string *lines)
+{
+	link_state saved;
+	int i;
+
+	keep_lines = (lines != NULL);
+
+	if (gc_sections == true || verbose_flag == true || !read_state(previous_state, saved, image_words))
+		return false;
+
+	state_header &header = saved.header;
+	if (header.text_address != requested.text_address || header.data_address != requested.data_address ||
+		header.bss_address != requested.bss_address || header.bss_end_justify != (unsigned int)requested.bss_end_justify ||
+		header.num_files != objects.size())
+		return false;
+
+	// Set the files up as they were laid out, and find the ones that changed
+	inputs = objects;
+	num_files = inputs.size();
+	file.resize(num_files);
+
+	vector<bool> changed(num_files, false);
+	for (i = 0; i < num_files; i++)
+	{
+		state_file &f = saved.files[i];
+
+		if (is_archive(inputs[i]) || strcmp(saved.names.c_str() + f.name_ptr, inputs[i].filename) != 0)
+			return false;
+
+		init_file(i);
+		for (int seg = 0; seg < NUM_SEGMENTS; seg++)
+			file[i].segment_address[seg] = f.segment_address[seg];
+		file[i].image_offset[TEXT] = f.image_offset[TEXT];
+		file[i].image_offset[DATA] = f.image_offset[DATA];
+		file[i].file_header.text_seg_size = f.segment_size[TEXT];
+		file[i].file_header.data_seg_size = f.segment_size[DATA];
+		file[i].file_header.bss_seg_size = f.segment_size[BSS];
+
+		hash_file(i);
+		changed[i] = (file[i].hash != f.hash);
+	}
+
+	// The symbols are already relocated, so they all belong to the linker
+	vector<unsigned int> num_owned(num_files, 0);
+	for (i = 0; i < (int)header.num_symbols; i++)
+	{
+		label_entry *label = get_label(saved.names.c_str() + saved.symbols[i].name_ptr);
+		label->resolved = true;
+		label->address = saved.symbols[i].address;
+		label->segment = TEXT;
+		label->file_no = -1;
+		label->state_symbol = i;
+
+		if (saved.symbols[i].file_no != -1)
+			num_owned[saved.symbols[i].file_no]++;
+	}
+
+	// Read the changed files, which must declare the same globals as before
+	vector<int> moved(header.num_symbols, 0);
+	for (i = 0; i < num_files; i++)
+	{
+		if (changed[i] == false)
+			continue;
+
+		load_file(i);
+		object_header &object = file[i].file_header;
+		state_file &f = saved.files[i];
+		if (file[i].failed == true || object.text_seg_size != f.segment_size[TEXT] ||
+			object.data_seg_size != f.segment_size[DATA] || object.bss_seg_size != f.segment_size[BSS] ||
+			file[i].globals.size() != num_owned[i])
+			return false;
+
+		for (unsigned int j = 0; j < file[i].globals.size(); j++)
+		{
+			global_symbol &global = file[i].globals[j];
+			label_entry *label = (label_entry *)label_table.find(global.name);
+			if (label == NULL || saved.symbols[label->state_symbol].file_no != i)
+				return false;
+
+			unsigned int address = global.address + file[i].segment_address[global.segment];
+			moved[label->state_symbol] = address - label->address;
+			label->address = address;
+			saved.symbols[label->state_symbol].address = address;
+		}
+
+		for (reference *walk = file[i].references; walk != NULL; walk = walk->next)
+		{
+			if (walk->name == NULL)
+				continue;
+
+			walk->label = (label_entry *)label_table.find(walk->name);
+			if (walk->label == NULL)
+				return false;
+		}
+
+		f.hash = file[i].hash;
+	}
+
+	// Patch the changed files into the image
+	for (i = 0; i < num_files; i++)
+	{
+		if (changed[i] == false)
+			continue;
+
+		relocate_file(i);
+		if (file[i].failed == true)
+			return false;
+	}
+
+	// Move the references to symbols that moved in the files that didn't
+	// change, and take the references from the files that did afresh
+	vector<state_site> sites;
+	for (unsigned int j = 0; j < saved.sites.size(); j++)
+	{
+		state_site &site = saved.sites[j];
+		if (changed[site.file_no] == true)
+			continue;
+
+		if (moved[site.symbol] != 0)
+		{
+			unsigned int &word = image_words[site.segment][site.offset];
+			word = (word & 0xfff00000) | ((word + moved[site.symbol]) & 0xfffff);
+		}
+		sites.push_back(site);
+	}
+	for (i = 0; i < num_files; i++)
+	{
+		if (changed[i] == false)
+			continue;
+
+		for (reference *walk = file[i].references; walk != NULL; walk = walk->next)
+		{
+			if (walk->label == NULL)
+				continue;
+
+			state_site site = {(unsigned int)walk->label->state_symbol, (unsigned int)i, (unsigned int)walk->source_seg,
+							   file[i].image_offset[walk->source_seg] + walk->address};
+			sites.push_back(site);
+		}
+	}
+	saved.sites.swap(sites);
+	header.num_sites = saved.sites.size();
 
-	output_srecord(outputfile, 7, entry_point, NULL, 0);
+	label_entry *main = (label_entry *)label_table.find("main");
+	if (main == NULL)
+		return false;
+	header.entry_point = main->address;
 
-	return 0;
+	write_state(saved, image_words, state);
+
+	// The files that didn't change are only read for their line tables
+	if (lines != NULL)
+	{
+		for (i = 0; i < num_files; i++)
+		{
+			if (changed[i] == true)
+				continue;
+
+			object_view view;
+			if (open_object(inputs[i].data, inputs[i].length, view) != NULL)
+				return false;
+			read_lines(i, view, messages);
+		}
+		write_line_table(*lines);
+	}
+
+	// The image is written from the same runs a full link would use
+	vector<image_run> runs;
+	for (int seg = TEXT; seg <= DATA; seg++)
+	{
+		for (i = 0; i < num_files; i++)
+		{
+			unsigned int size = (seg == TEXT) ? file[i].file_header.text_seg_size : file[i].file_header.data_seg_size;
+			if (size > 0)
+			{
+				image_run run = {file[i].segment_address[seg], linked_words(i, seg), size};
+				runs.push_back(run);
+			}
+		}
+	}
+
+	write_output(runs, header.entry_point, image);
+	return true;
+}
+
+bool link_incremental(const vector<object_buffer> &objects, const link_options &options,
+					  const string &previous_state, string &state,
+					  string &image, ostream &listing, ostream &messages, string *lines)
+{
+	// Try patching in just the files that changed first. Its output is only
+	// kept if that works, as otherwise the full link reports it all again.
+	if (!previous_state.empty())
+	{
+		ostringstream relink_listing, relink_messages;
+		linker l(options, relink_listing, relink_messages);
+
+		try
+		{
+			if (l.relink(objects, previous_state, state, image, lines))
+			{
+				listing << relink_listing.str();
+				messages << relink_messages.str();
+				return true;
+			}
+		}
+		catch (link_error &)
+		{
+		}
+	}
+
+	linker l(options, listing, messages);
+
+	try
+	{
+		l.link(objects, image, &state, lines);
+	}
+	catch (link_error &)
+	{
+		image.clear();
+		state.clear();
+		if (lines != NULL)
+			lines->clear();
+		return false;
+	}
+	return true;
 }
@@ -0,0 +1,88 @@
+/*
+########################################################################
+# This file is part of the toolchain for WRAMP assembly
+#
+# Copyright (C) 2019 The University of Waikato, Hamilton, New Zealand.
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <https://www.gnu.org/licenses/>.
+########################################################################
+*/
+
+#ifndef LINKER_H
+#define LINKER_H
+
+#include <stddef.h>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// The forms the linked image can be written in
+enum output_format_type
+{
+	SRECORD,	// Motorola S-records
+	BINARY_LE,  // Raw words, least significant byte first
+	BINARY_BE,  // Raw words, most significant byte first
+	VIVADO_MEM, // A Vivado .mem file
+	INTEL_HEX   // Intel HEX, with byte addresses
+};
+
+// Where the linked segments are placed, and how the image is written
+struct link_options
+{
+	link_options();
+
+	unsigned int text_address; // Where the text segment starts
+	unsigned int data_address; // Where the data segment starts, 0xfffff to follow the text segment
+	unsigned int bss_address;  // Where the bss segment starts, 0xfffff to follow the data segment
+	bool bss_end_justify;	  // If set, bss_address is where the bss segment ends instead
+	bool verbose;			   // List the linked program and its layout
+
+	unsigned int srecord_bytes; // Data bytes in each S-record, a multiple of 4 up to 248
+	bool srecord_s2;			// Use S2/S8 records when every address fits in 24 bits
+	output_format_type output_format;
+
+	int num_threads; // Threads used to read and relocate the object files
+	bool gc_sections; // Drop the text regions that main and the data never use
+};
+
+// An object file held in memory
+struct object_buffer
+{
+	const char *filename; // Only used in messages
+	const char *data;
+	size_t length;
+};
+
+// Links object files held in memory into an image, without touching
+// the filesystem. Returns false if there were errors, which are written to
+// messages. When options.verbose is set the listing is written to listing.
+// If lines is given it is set to a table of the source line each run of
+// words in the image came from, taken from the line tables of the files that
+// have them (see wasm -g), one "start end source:line" run to a line.
+bool link_objects(const std::vector<object_buffer> &objects, const link_options &options,
+				  std::string &image, std::ostream &listing, std::ostream &messages,
+				  std::string *lines = NULL);
+
+// Links as link_objects() does, and saves the link in state. Given the state
+// saved by an earlier link of the same files, only the files that have
+// changed are read and relocated again, as long as their segments are the
+// same sizes and they declare the same globals. Otherwise all the files are
+// linked again. The state is left empty for links that can't be patched
+// later, those using archives or gc_sections.
+bool link_incremental(const std::vector<object_buffer> &objects, const link_options &options,
+					  const std::string &previous_state, std::string &state,
+					  std::string &image, std::ostream &listing, std::ostream &messages,
+					  std::string *lines = NULL);
+
+#endif
@@ -22,10 +22,17 @@
 #include <iostream>
 #include <iomanip>
 #include <fstream>
+#include <iterator>
+#include <vector>
+#include <algorithm>
 #include <string.h>
 #include <stdlib.h>
 #include <ctype.h>
 #include <assert.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include "object_file.h"
 #include "instructions.h"
@@ -54,7 +61,20 @@ struct label_entry
 };
 
 label_entry *label_list = NULL;
+// The most recently placed label at each address of each segment, which is
+// the first one a walk of label_list would find
+label_entry **address_index[NUM_SEGMENTS];
+unsigned int address_index_size[NUM_SEGMENTS];
 
+// Record where a label has been placed in address_index
+void index_label(label_entry *label)
+{
+	if (label->segment < TEXT || label->segment >= NUM_SEGMENTS)
+		return;
+	if (label->address < 0 || (unsigned int)label->address >= address_index_size[label->segment])
+		return;
+	address_index[label->segment][label->address] = label;
+}
 
 // Remove all dynamically allocated data structures
 void cleanup()
@@ -69,7 +89,7 @@ void cleanup()
 
 // This searches for a reference to a label, creating a new entry
 // if none is found
-label_entry *get_label(char *name)
+label_entry *get_label(const char *name)
 {
 	//cerr << "looking for " << name << ": ";
 
@@ -91,7 +111,10 @@ label_entry *get_label(char *name)
 
 	temp->next = label_list;
 	temp->resolved = false;
+	temp->isGlobal = false;
 	temp->file_no = 0;
+	temp->address = -1;
+	temp->segment = NONE;
 
 	strcpy(temp->name, name);
 
@@ -122,14 +145,23 @@ label_entry *get_label_address(int address, reference_type type)
 	
 
 	// Check for the label already existing
-	while (temp != NULL)
+	if (address >= 0 && (unsigned int)address < address_index_size[temp_seg])
 	{
-		//cerr << temp->address << ", "; 
-		if (temp->address == address && temp_seg == temp->segment ){
-			//cout << " FOUND" << endl;
-			return temp;
+		if (address_index[temp_seg][address] != NULL)
+			return address_index[temp_seg][address];
+	}
+	else
+	{
+		// Out of range addresses are not indexed, so walk the list for them
+		while (temp != NULL)
+		{
+			//cerr << temp->address << ", "; 
+			if (temp->address == address && temp_seg == temp->segment ){
+				//cout << " FOUND" << endl;
+				return temp;
+			}
+			temp = temp->next;
 		}
-		temp = temp->next;
 	}
 	//cerr << " CREATING ";
 	
@@ -137,8 +169,10 @@ label_entry *get_label_address(int address, reference_type type)
 
 	temp->next = label_list;
 	temp->resolved = true;
+	temp->isGlobal = false;
 	temp->file_no = 0;
 	temp->address = address;
+	temp->segment = temp_seg;
 			
 	
 
@@ -146,12 +180,13 @@ label_entry *get_label_address(int address, reference_type type)
 	char segNames[] = "TDB";
 	base_string[0] = segNames[temp_seg];
 
-	char buff [5]; 
+	char buff [max_label_length]; 
 	sprintf(buff, "%s%d", base_string, local_label_counter[temp_seg]++);
 
 	strcpy(temp->name, buff);
 
 	label_list = temp;
+	index_label(temp);
 
 	// cerr << "created label {" << buff << "} @ 0x" << setw(5) << setfill('0') << hex << address << endl;
 
@@ -182,16 +217,227 @@ typedef struct
 void usage(char *progname)
 {
 	cerr << "USAGE: " << progname << "  file [options]\n";
-	cerr << "\t '-d' display dissasembly" << endl;
+	cerr << "       " << progname << "  -q symbol file...\n";
+	cerr << "\t '-d' display dissasembly, with the source lines if the file has a line table" << endl;
+	cerr << "\t '-q' list the files that declare or refer to symbol" << endl;
+	cerr << "\t '-s' display the instruction mix and estimated cycles of each global in the text segment" << endl;
+	cerr << "\t '-l class=cycles' set the cycles estimated for a class of instruction (";
+	for (int c = 0; c < NUM_INSN_CLASSES; c++)
+		cerr << ((c == 0) ? "" : ", ") << insn_class_name[c] << " " << insn_class_cycles[c];
+	cerr << ")" << endl;
 
 	exit(1);
 }
 
+// Reads the lines of a source file named in a line table. Files that can't
+// be read just have no lines.
+void read_source_lines(const char *filename, vector<string> &lines)
+{
+	ifstream source(filename);
+	string line;
+
+	while (getline(source, line))
+	{
+		if (!line.empty() && line[line.size() - 1] == '\r')
+			line.erase(line.size() - 1);
+		lines.push_back(line);
+	}
+}
+
+// Prints the source line a run of words came from, as a comment
+void print_source_line(const char *source_name, const vector<string> &lines, unsigned int line)
+{
+	cout << "# " << source_name << ":" << dec << line;
+	if (line >= 1 && line <= lines.size())
+	{
+		const string &text = lines[line - 1];
+		size_t start = text.find_first_not_of(" \t");
+		if (start != string::npos)
+			cout << ": " << text.substr(start);
+	}
+	cout << endl;
+}
+
+// Orders labels by address, to split the text segment between its globals
+bool label_before(const label_entry *a, const label_entry *b)
+{
+	return a->address < b->address;
+}
+
+// Adds up the instructions of each class in part of the text segment
+void count_classes(const unsigned int *text, unsigned int start, unsigned int end, unsigned int counts[])
+{
+	for (unsigned int i = start; i < end; i++)
+	{
+		insn_type *insn = decode_insn(text[i]);
+		if (insn != NULL)
+			counts[classify_insn(insn)]++;
+	}
+}
+
+// Prints the instruction count, the share of each class and the estimated
+// cycles for one part of the text segment
+void print_cost_line(const char *name, const unsigned int counts[], const unsigned int cycles[])
+{
+	unsigned int total = 0;
+	unsigned long long cost = 0;
+	for (int c = 0; c < NUM_INSN_CLASSES; c++)
+	{
+		total += counts[c];
+		cost += (unsigned long long)counts[c] * cycles[c];
+	}
+
+	cout << "#" << setw(15) << setfill(' ') << name << ", " << setw(6) << dec << total;
+	for (int c = 0; c < NUM_INSN_CLASSES; c++)
+		cout << ", " << setw(6) << fixed << setprecision(1) << (total ? 100.0 * counts[c] / total : 0.0) << "%";
+	cout << ", " << setw(8) << cost << endl;
+}
+
+// Lists the instruction mix and estimated cycles from each global in the
+// text segment up to the next, as if each instruction ran once
+void print_cost_report(const unsigned int *text, unsigned int text_size, const unsigned int cycles[])
+{
+	vector<label_entry *> globals;
+	for (label_entry *label = label_list; label != NULL; label = label->next)
+		if (label->isGlobal && label->segment == TEXT)
+			globals.push_back(label);
+	stable_sort(globals.begin(), globals.end(), label_before);
+
+	cout << "#" << endl << "# INSTRUCTION_MIX (cycles:";
+	for (int c = 0; c < NUM_INSN_CLASSES; c++)
+		cout << " " << insn_class_name[c] << " " << dec << cycles[c];
+	cout << ")" << endl;
+	cout << "#" << setw(15) << setfill(' ') << "Label Name" << ", " << setw(6) << "Insns";
+	for (int c = 0; c < NUM_INSN_CLASSES; c++)
+		cout << ", " << setw(7) << insn_class_name[c];
+	cout << ", " << setw(8) << "Cycles" << endl;
+
+	// A global can sit at the end of the text segment, or in a bad file past
+	// it, so its range is cut off there
+	vector<unsigned int> starts(globals.size() + 1, text_size);
+	for (unsigned int i = 0; i < globals.size(); i++)
+		starts[i] = min((unsigned int)globals[i]->address, text_size);
+
+	unsigned int total_counts[NUM_INSN_CLASSES] = {0};
+	// Anything before the first global is listed on its own
+	unsigned int first = starts[0];
+	if (first > 0)
+	{
+		unsigned int counts[NUM_INSN_CLASSES] = {0};
+		count_classes(text, 0, first, counts);
+		print_cost_line("(no global)", counts, cycles);
+		count_classes(text, 0, first, total_counts);
+	}
+	for (unsigned int i = 0; i < globals.size(); i++)
+	{
+		unsigned int start = starts[i];
+		unsigned int end = starts[i + 1];
+		unsigned int counts[NUM_INSN_CLASSES] = {0};
+		count_classes(text, start, end, counts);
+		print_cost_line(globals[i]->name, counts, cycles);
+		count_classes(text, start, end, total_counts);
+	}
+	print_cost_line("(total)", total_counts, cycles);
+
+	unsigned int total = 0;
+	for (int c = 0; c < NUM_INSN_CLASSES; c++)
+		total += total_counts[c];
+	if (total < text_size)
+		cout << "# Words that aren't instructions: " << dec << text_size - total << endl;
+}
+
+// Lists whether an object file held in memory declares or refers to a
+// symbol. Files with a symbol index only need one lookup, others have their
+// relocations read. Returns true if the symbol is there.
+bool query_object(const char *data, size_t length, const char *filename, const char *symbol_name)
+{
+	object_view view;
+	const char *problem = open_object(data, length, view);
+	if (problem != NULL)
+	{
+		cerr << "ERROR: " << problem << filename << endl;
+		return false;
+	}
+
+	object_symbol symbol;
+	bool found = false;
+
+	if (view.symbols != NULL)
+		found = find_symbol(view, symbol_name, symbol);
+	else
+	{
+		reloc_reader relocs(view);
+		reloc_entry reloc;
+
+		symbol.address = 0;
+		while (relocs.next(reloc))
+		{
+			if (reloc.type != GLOBAL_TEXT && reloc.type != GLOBAL_DATA && reloc.type != GLOBAL_BSS && reloc.type != EXTERNAL_REF)
+				continue;
+			if (reloc.symbol_ptr >= view.header.symbol_name_table_size ||
+				strcmp(view.names + reloc.symbol_ptr, symbol_name) != 0)
+				continue;
+
+			found = true;
+			symbol.type = reloc.type;
+			if (reloc.type == EXTERNAL_REF)
+				symbol.address++;
+			else
+				symbol.address = reloc.address;
+		}
+	}
+
+	if (!found)
+		return false;
+
+	if (symbol.type == EXTERNAL_REF)
+		cout << filename << ": " << reference_type_name[EXTERNAL_REF] << " " << dec << symbol.address << " references" << endl;
+	else if (symbol.type <= GLOBAL_BSS)
+		cout << filename << ": " << reference_type_name[symbol.type] << " 0x" << setw(5) << setfill('0') << hex << symbol.address << endl;
+	return true;
+}
+
+// The same for an object file on disk
+bool query_file(const char *filename, const char *symbol_name)
+{
+	struct stat info;
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0 || fstat(fd, &info) < 0 || !S_ISREG(info.st_mode))
+	{
+		cerr << "ERROR: Could not open file for input : " << filename << endl;
+		if (fd >= 0)
+			close(fd);
+		return false;
+	}
+
+	// The file is mapped, so only the pages that are looked at get read
+	size_t length = info.st_size;
+	void *mapping = (length > 0) ? mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+	close(fd);
+	if (mapping == MAP_FAILED)
+	{
+		cerr << "ERROR: Could not open file for input : " << filename << endl;
+		return false;
+	}
+
+	bool found = query_object((const char *)mapping, length, filename, symbol_name);
+
+	if (mapping != NULL)
+		munmap(mapping, length);
+	return found;
+}
+
 int main(int argc, char *argv[])
 {
 	int i;
 	bool display_object = true;
 	bool display_dissasemble = false;
+	bool display_cost = false;
+	char *query_symbol = NULL;
+	unsigned int class_cycles[NUM_INSN_CLASSES];
+	for (i = 0; i < NUM_INSN_CLASSES; i++)
+		class_cycles[i] = insn_class_cycles[i];
+	vector<char *> query_files;
 
 	if (argc < 2)
 		usage(argv[0]);
@@ -210,6 +456,33 @@ int main(int argc, char *argv[])
 			{
 				display_dissasemble = true;
 			}
+			else if (strcmp(argv[i], "-q") == 0 && (i + 1) < argc)
+			{
+				query_symbol = argv[++i];
+			}
+			else if (strcmp(argv[i], "-s") == 0)
+			{
+				display_cost = true;
+			}
+			else if (strcmp(argv[i], "-l") == 0 && (i + 1) < argc)
+			{
+				// A class and its cycles, such as div=20
+				char *setting = argv[++i];
+				char *equals = strchr(setting, '=');
+				char *endptr = NULL;
+				if (equals == NULL)
+					usage(argv[0]);
+				string class_name(setting, equals - setting);
+				int c = 0;
+				while (c < NUM_INSN_CLASSES && class_name != insn_class_name[c])
+					c++;
+				if (c == NUM_INSN_CLASSES)
+					usage(argv[0]);
+				class_cycles[c] = strtoul(equals + 1, &endptr, 0);
+				if (equals[1] == '\0' || *endptr != '\0')
+					usage(argv[0]);
+				display_cost = true;
+			}
 			else
 				usage(argv[0]);
 		}
@@ -221,9 +494,25 @@ int main(int argc, char *argv[])
 				usage(argv[0]);
 			}
 			input_filename = argv[i];
+			query_files.push_back(argv[i]);
 		}
 	}
 
+	// Just look for the symbol in each file, like grep this succeeds if any has it
+	if (query_symbol != NULL)
+	{
+		if (query_files.empty() || display_dissasemble || display_cost)
+			usage(argv[0]);
+
+		bool found = false;
+		for (unsigned int j = 0; j < query_files.size(); j++)
+			found = query_file(query_files[j], query_symbol) || found;
+		return found ? 0 : 1;
+	}
+
+	if (input_filename == NULL)
+		usage(argv[0]);
+
 	file_type file;
 
 	// Read in the data from all the files
@@ -240,15 +529,33 @@ int main(int argc, char *argv[])
 	// Copy the filename into the structure
 	strcpy(file.filename, input_filename);
 
-	// Read the header in
-	sourcefile.read((char *)&(file.file_header), sizeof(object_header));
+	// Read the whole file in, and check it is an object file of either version
+	vector<char> contents((istreambuf_iterator<char>(sourcefile)), istreambuf_iterator<char>());
+	sourcefile.close();
 
-	// Verify the magic number
-	if (file.file_header.magic_number != OBJ_MAGIC_NUM)
+	object_view view;
+	const char *problem = open_object(contents.empty() ? NULL : &contents[0], contents.size(), view);
+	if (problem != NULL)
 	{
-		cerr << "ERROR: File is not an object file : " << file.filename << endl;
+		cerr << "ERROR: " << problem << file.filename << endl;
 		exit(1);
 	}
+	file.file_header = view.header;
+
+	// The source lines the words came from, if the file has a line table
+	const char *line_source = NULL;
+	vector<line_run> line_runs[2];
+	vector<string> source_lines;
+	if (view.lines != NULL)
+	{
+		if (!read_line_table(view, line_source, line_runs))
+		{
+			cerr << "ERROR: Bad line table in object file : " << file.filename << endl;
+			exit(1);
+		}
+		if (display_dissasemble)
+			read_source_lines(line_source, source_lines);
+	}
 
 	// The segments all start at zero
 	file.segment_address[TEXT] = 0;
@@ -256,13 +563,29 @@ int main(int argc, char *argv[])
 	file.segment_address[BSS] = 0;
 	file.references = NULL;
 
-	// Now we allocate space for, and read the segments in
-	file.segment[TEXT] = new unsigned int[file.file_header.text_seg_size];
-	// Read in the text segment
-	sourcefile.read((char *)file.segment[TEXT], (file.file_header.text_seg_size * sizeof(unsigned int)));
-	file.segment[DATA] = new unsigned int[file.file_header.data_seg_size];
-	// Read in the data segment
-	sourcefile.read((char *)file.segment[DATA], (file.file_header.data_seg_size * sizeof(unsigned int)));
+	// Now we allocate space for, and copy the segments in
+	for (i = TEXT; i <= DATA; i++)
+	{
+		unsigned int size = (i == TEXT) ? file.file_header.text_seg_size : file.file_header.data_seg_size;
+		file.segment[i] = new unsigned int[size];
+		for (unsigned int j = 0; j < size; j++)
+		{
+			if (native_words(view))
+				memcpy(&file.segment[i][j], view.segment[i] + j * sizeof(unsigned int), sizeof(unsigned int));
+			else
+				file.segment[i][j] = get_le32(view.segment[i] + j * sizeof(unsigned int));
+		}
+	}
+
+	// Labels can sit anywhere in a segment, including just past its end
+	address_index_size[TEXT] = file.file_header.text_seg_size + 1;
+	address_index_size[DATA] = file.file_header.data_seg_size + 1;
+	address_index_size[BSS] = file.file_header.bss_seg_size + 1;
+	for (i = 0; i < NUM_SEGMENTS; i++)
+	{
+		address_index[i] = new label_entry *[address_index_size[i]];
+		memset(address_index[i], 0, sizeof(label_entry *) * address_index_size[i]);
+	}
 
 	// Increment the size counters
 	text_size += file.file_header.text_seg_size;
@@ -272,11 +595,37 @@ int main(int argc, char *argv[])
 	// Now we should read in all the labels for this segment
 	int num_relocs = file.file_header.num_references;
 	reloc_entry *relocation_array = new reloc_entry[num_relocs];
-	sourcefile.read((char *)relocation_array, sizeof(reloc_entry) * num_relocs);
+	reloc_reader relocs(view);
+	for (i = 0; i < num_relocs; i++)
+	{
+		reloc_entry &reloc = relocation_array[i];
+		if (!relocs.next(reloc))
+		{
+			cerr << "ERROR: Bad relocation in object file : " << file.filename << endl;
+			exit(1);
+		}
+
+		// The symbol name, for the relocations that have one
+		if ((reloc.type == GLOBAL_TEXT || reloc.type == GLOBAL_DATA || reloc.type == GLOBAL_BSS || reloc.type == EXTERNAL_REF) &&
+			reloc.symbol_ptr >= file.file_header.symbol_name_table_size)
+		{
+			cerr << "ERROR: Bad symbol in object file : " << file.filename << endl;
+			exit(1);
+		}
+
+		// References must be to a word in the text or data segment, as wlink checks
+		if (reloc.type > TEXT_REGION ||
+			(reloc.type != GLOBAL_TEXT && reloc.type != GLOBAL_DATA && reloc.type != GLOBAL_BSS &&
+			 !((reloc.source_seg == TEXT && reloc.address < file.file_header.text_seg_size) ||
+			   (reloc.source_seg == DATA && reloc.address < file.file_header.data_seg_size))))
+		{
+			cerr << "ERROR: Bad relocation in object file : " << file.filename << endl;
+			exit(1);
+		}
+	}
 
 	// And the symbol labels
-	char *symbol_names = new char[file.file_header.symbol_name_table_size];
-	sourcefile.read(symbol_names, file.file_header.symbol_name_table_size);
+	const char *symbol_names = view.names;
 
 
 	for(unsigned int i = 0; i < file.file_header.text_seg_size; i++){ //find br labels	
@@ -298,8 +647,16 @@ int main(int argc, char *argv[])
 
 
 	// Scan through the segment labels
+	int num_regions = 0;
 	for (i = 0; i < num_relocs; i++)
 	{
+		// Regions only matter to the linker, so they are just counted
+		if (relocation_array[i].type == TEXT_REGION)
+		{
+			num_regions++;
+			continue;
+		}
+
 		// Make a note of all the globals
 		if (relocation_array[i].type == GLOBAL_TEXT || relocation_array[i].type == GLOBAL_DATA || relocation_array[i].type == GLOBAL_BSS)
 		{
@@ -335,6 +692,7 @@ int main(int argc, char *argv[])
 			else
 				temp->segment = BSS;
 
+			index_label(temp);
 		}
 		else if (relocation_array[i].type == EXTERNAL_REF)
 		{
@@ -372,7 +730,7 @@ int main(int argc, char *argv[])
 			new_ref->address = relocation_array[i].address;
 			new_ref->next = file.references;
 
-			label_entry *temp = get_label_address(file.segment[TEXT][relocation_array[i].address]&0xfffff,relocation_array[i].type);
+			label_entry *temp = get_label_address(file.segment[relocation_array[i].source_seg][relocation_array[i].address]&0xfffff,relocation_array[i].type);
 
 			new_ref->label = temp;
 			
@@ -399,9 +757,14 @@ int main(int argc, char *argv[])
 		cout << setw(45) << setfill('#') << "#" << endl;
 		//basic object file information
 		cout << "# File name:      " << file.filename << endl;
+		cout << "# Format version: " << setw(5) << setfill(' ') << dec << view.version                         << endl;
 		cout << "# Text size:      " << setw(5) << setfill(' ') << hex << file.file_header.text_seg_size          << endl;
 		cout << "# Data Size:      " << setw(5) << setfill(' ') << hex << file.file_header.data_seg_size          << endl;
 		cout << "# Bss Size:       " << setw(5) << setfill(' ') << hex << file.file_header.bss_seg_size           << endl;
+		if (num_regions > 0)
+			cout << "# Text regions:   " << setw(5) << setfill(' ') << dec << num_regions + 1                  << endl;
+		if (line_source != NULL)
+			cout << "# Line table:     " << line_source << endl;
 
 		//global and external references
 		
@@ -432,37 +795,51 @@ int main(int argc, char *argv[])
 			}
 			currLabel = currLabel->next;	
 		}
+		if (display_cost)
+			print_cost_report(file.segment[TEXT], file.file_header.text_seg_size, class_cycles);
 		cout << setw(45) << setfill('#') << "#" << endl;
 	}
 
 	if(display_dissasemble){
+		// Index the label markers and label references by address, so each
+		// word below costs a lookup rather than a walk of the lists. The first
+		// match in list order is kept, as the list walks used to find.
+		label_entry **text_label = new label_entry *[file.file_header.text_seg_size + 1];
+		label_entry **data_label = new label_entry *[file.file_header.data_seg_size + 1];
+		char **text_ref_name = new char *[file.file_header.text_seg_size + 1];
+		memset(text_label, 0, sizeof(label_entry *) * (file.file_header.text_seg_size + 1));
+		memset(data_label, 0, sizeof(label_entry *) * (file.file_header.data_seg_size + 1));
+		memset(text_ref_name, 0, sizeof(char *) * (file.file_header.text_seg_size + 1));
+
+		for (currLabel = label_list; currLabel != NULL; currLabel = currLabel->next){
+			unsigned int address = currLabel->address;
+			if (currLabel->segment == TEXT && address < file.file_header.text_seg_size && text_label[address] == NULL)
+				text_label[address] = currLabel;
+			else if (currLabel->segment == DATA && address < file.file_header.data_seg_size && data_label[address] == NULL)
+				data_label[address] = currLabel;
+		}
+		for (currRef = file.references; currRef != NULL; currRef = currRef->next){
+			unsigned int address = currRef->address;
+			if (currRef->label != NULL && currRef->source_seg == TEXT && address < file.file_header.text_seg_size && text_ref_name[address] == NULL)
+				text_ref_name[address] = currRef->label->name;
+		}
+
 		cout << endl << ".text # size: 0x" << setw(5) << setfill('0') << hex << file.file_header.text_seg_size << endl;
+		unsigned int next_run = 0;
 		for(unsigned int i = 0; i < file.file_header.text_seg_size; i++){ //print TEXT		
 
-			currLabel = label_list;
-			while(currLabel != NULL){	//handle label markers
-				//cout << " testsing: " << currLabel->name;
-				if ((unsigned int)currLabel->address == i && currLabel->segment == TEXT){
-					if (currLabel->isGlobal) cout << ".global " << currLabel->name << endl;
-					cout << currLabel->name << ":" << endl;
-					break;
-				}		
-				currLabel = currLabel->next;	
+			currLabel = text_label[i];
+			if (currLabel != NULL){	//handle label markers
+				if (currLabel->isGlobal) cout << ".global " << currLabel->name << endl;
+				cout << currLabel->name << ":" << endl;
 			}
 
+			// The source line, where a new one starts
+			if (next_run < line_runs[TEXT].size() && line_runs[TEXT][next_run].address == i)
+				print_source_line(line_source, source_lines, line_runs[TEXT][next_run++].line);
+
 			//replace references to labels
-			currRef = file.references;
-			char * temp_name = NULL; //seg_type_name[currRef->target_seg+1];
-			while(currRef != NULL){		
-				label_entry * currLabel = currRef->label;	
-				if(currLabel != NULL){
-					if ((unsigned int)currRef->address == i){				
-						temp_name = currLabel->name;
-						break;
-					}
-				}		
-				currRef = currRef->next;	
-			}
+			char * temp_name = text_ref_name[i];
 			cout << "\t";
 			disassemble_view(i,file.segment[TEXT][i], temp_name);
 			
@@ -470,17 +847,15 @@ int main(int argc, char *argv[])
 		}
 
 		cout << endl << ".data # size: 0x" << setw(5) << setfill('0') << hex << file.file_header.data_seg_size << endl;
+		next_run = 0;
 		for(unsigned int i = 0; i < file.file_header.data_seg_size; i++){ //print DATA
 
-			currLabel = label_list;
-			while(currLabel != NULL){	//handle label markers	
-				//cout << " testsing: " << currLabel->name;
-				if ((unsigned int)currLabel->address == i && currLabel->segment == DATA){
-					cout << currLabel->name << ":" << endl;
-					break;
-				}		
-				currLabel = currLabel->next;	
-			}
+			currLabel = data_label[i];
+			if (currLabel != NULL)	//handle label markers
+				cout << currLabel->name << ":" << endl;
+
+			if (next_run < line_runs[DATA].size() && line_runs[DATA][next_run].address == i)
+				print_source_line(line_source, source_lines, line_runs[DATA][next_run++].line);
 
 			// If the .word contains a value in the printable character range,
 			// add a comment that shows the character.
@@ -543,8 +918,14 @@ int main(int argc, char *argv[])
 
 			last_entry = bss_entry;
 		}
+
+		delete[] text_label;
+		delete[] data_label;
+		delete[] text_ref_name;
 	}
 	
+	for (i = 0; i < NUM_SEGMENTS; i++)
+		delete[] address_index[i];
 	cleanup();
 	return 0;
 }
@@ -0,0 +1,446 @@
+/*
+########################################################################
+# This file is part of the toolchain for WRAMP assembly
+#
+# Copyright (C) 2019 The University of Waikato, Hamilton, New Zealand.
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <https://www.gnu.org/licenses/>.
+########################################################################
+*/
+
+#include <algorithm>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "object_cache.h"
+#include "assembler.h"
+#include "sha256.h"
+
+using namespace std;
+
+// Each entry is this header, followed by the object file and then the
+// messages assembling it gave
+struct cache_entry_header
+{
+	unsigned int magic_number;
+	unsigned int object_size;
+	unsigned int messages_size;
+};
+
+#define CACHE_MAGIC_NUM 0xdaa4
+
+// The totals kept in the cache's stats file
+struct cache_stats
+{
+	unsigned long long hits;
+	unsigned long long misses;
+	unsigned long long evictions;
+};
+
+// An entry found while looking for ones to remove
+struct cache_file
+{
+	time_t last_used;
+	unsigned long long size;
+	string name;
+
+	bool operator<(const cache_file &other) const { return last_used < other.last_used; }
+};
+
+// Temporary files older than this were left by a wasm that didn't finish
+const time_t stale_temp_age = 24 * 60 * 60;
+
+// Entries are named with the key, the hash written out in hex
+static bool is_entry_name(const char *name)
+{
+	int i;
+
+	for (i = 0; name[i] != '\0'; i++)
+		if (!isxdigit((unsigned char)name[i]))
+			return false;
+
+	return i == 2 * sha256::digest_size;
+}
+
+static bool read_file(int fd, vector<char> &contents)
+{
+	char buffer[65536];
+	ssize_t count;
+
+	while ((count = read(fd, buffer, sizeof(buffer))) > 0)
+		contents.insert(contents.end(), buffer, buffer + count);
+
+	return count == 0;
+}
+
+static bool write_file(int fd, const char *data, size_t length)
+{
+	while (length > 0)
+	{
+		ssize_t count = write(fd, data, length);
+		if (count < 0 && errno == EINTR)
+			continue;
+		if (count <= 0)
+			return false;
+		data += count;
+		length -= count;
+	}
+	return true;
+}
+
+// Messages begin with the source file's name, which is left out of the
+// entry so that the same source under another name can still use it
+static string strip_name(const string &messages, const char *name)
+{
+	string prefix = string(name) + ":";
+	string stripped;
+	size_t start = 0;
+
+	while (start < messages.size())
+	{
+		size_t end = messages.find('\n', start);
+		end = (end == string::npos) ? messages.size() : end + 1;
+
+		if (messages.compare(start, prefix.size(), prefix) == 0)
+			stripped.append(messages, start + prefix.size() - 1, end - start - prefix.size() + 1);
+		else
+			stripped.append(messages, start, end - start);
+		start = end;
+	}
+	return stripped;
+}
+
+static string restore_name(const string &stripped, const char *name)
+{
+	string messages;
+	size_t start = 0;
+
+	while (start < stripped.size())
+	{
+		size_t end = stripped.find('\n', start);
+		end = (end == string::npos) ? stripped.size() : end + 1;
+
+		if (stripped[start] == ':')
+			messages += name;
+		messages.append(stripped, start, end - start);
+		start = end;
+	}
+	return messages;
+}
+
+static void read_stats(int fd, cache_stats &stats)
+{
+	vector<char> contents;
+
+	memset(&stats, 0, sizeof(stats));
+	lseek(fd, 0, SEEK_SET);
+	if (!read_file(fd, contents))
+		return;
+	contents.push_back('\0');
+
+	sscanf(&contents[0], "hits %llu misses %llu evictions %llu", &stats.hits, &stats.misses, &stats.evictions);
+}
+
+static void write_stats(int fd, const cache_stats &stats)
+{
+	char text[200];
+
+	int length = sprintf(text, "hits %llu\nmisses %llu\nevictions %llu\n", stats.hits, stats.misses, stats.evictions);
+	if (ftruncate(fd, 0) == 0)
+	{
+		lseek(fd, 0, SEEK_SET);
+		write_file(fd, text, length);
+	}
+}
+
+object_cache::object_cache(const char *directory, unsigned long long max_size)
+	: directory(directory), max_size(max_size), hits(0), misses(0), num_stored(0), next_temp(0), checked(false)
+{
+	pthread_mutex_init(&lock, NULL);
+}
+
+object_cache::~object_cache()
+{
+	pthread_mutex_destroy(&lock);
+}
+
+bool object_cache::open(ostream &errors)
+{
+	struct stat info;
+
+	if (mkdir(directory.c_str(), 0777) < 0 && errno != EEXIST)
+	{
+		errors << "ERROR: Could not create cache directory : `" << directory << "'" << endl;
+		return false;
+	}
+	if (stat(directory.c_str(), &info) < 0 || !S_ISDIR(info.st_mode))
+	{
+		errors << "ERROR: Cache directory is not a directory : `" << directory << "'" << endl;
+		return false;
+	}
+	return true;
+}
+
+string object_cache::key(const char *source, size_t length, const char *name, bool text_regions, bool line_table)
+{
+	static const char hex_digits[] = "0123456789abcdef";
+	unsigned char digest[sha256::digest_size];
+	sha256 hash;
+
+	// The version and options are each ended with a null, so that they
+	// can't run into each other or the source
+	hash.update(assembler_version, strlen(assembler_version) + 1);
+	hash.update(text_regions ? "-r" : "", text_regions ? 3 : 1);
+	hash.update(line_table ? "-g" : "", line_table ? 3 : 1);
+	if (line_table)
+		hash.update(name, strlen(name) + 1);
+	hash.update(source, length);
+	hash.digest(digest);
+
+	string key;
+	for (int i = 0; i < sha256::digest_size; i++)
+	{
+		key += hex_digits[digest[i] >> 4];
+		key += hex_digits[digest[i] & 0xf];
+	}
+	return key;
+}
+
+string object_cache::entry_path(const string &key)
+{
+	return directory + "/" + key;
+}
+
+bool object_cache::fetch(const string &key, const char *name, vector<char> &object, string &messages)
+{
+	string path = entry_path(key);
+	vector<char> contents;
+	cache_entry_header header;
+	bool found = false;
+
+	int fd = ::open(path.c_str(), O_RDONLY);
+	if (fd >= 0)
+	{
+		found = read_file(fd, contents);
+		close(fd);
+	}
+
+	// Anything that isn't a whole entry is treated as missing
+	if (found)
+	{
+		found = contents.size() >= sizeof(header);
+		if (found)
+		{
+			memcpy(&header, &contents[0], sizeof(header));
+			found = (header.magic_number == CACHE_MAGIC_NUM &&
+					 contents.size() - sizeof(header) == (size_t)header.object_size + header.messages_size);
+		}
+	}
+
+	if (found)
+	{
+		const char *data = &contents[0] + sizeof(header);
+		object.assign(data, data + header.object_size);
+		messages = restore_name(string(data + header.object_size, header.messages_size), name);
+
+		// The modification time is when the entry was last used
+		utimes(path.c_str(), NULL);
+	}
+
+	pthread_mutex_lock(&lock);
+	if (found)
+		hits++;
+	else
+		misses++;
+	pthread_mutex_unlock(&lock);
+
+	return found;
+}
+
+void object_cache::store(const string &key, const char *name, const vector<char> &object, const string &messages)
+{
+	string stripped = strip_name(messages, name);
+	cache_entry_header header;
+	char suffix[64];
+
+	header.magic_number = CACHE_MAGIC_NUM;
+	header.object_size = object.size();
+	header.messages_size = stripped.size();
+
+	pthread_mutex_lock(&lock);
+	sprintf(suffix, ".tmp.%d.%u", (int)getpid(), next_temp++);
+	num_stored++;
+	pthread_mutex_unlock(&lock);
+
+	// A cache that can't be written to just doesn't speed things up
+	string temp_path = entry_path(key) + suffix;
+	int fd = ::open(temp_path.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0666);
+	if (fd < 0)
+		return;
+
+	bool written = write_file(fd, (const char *)&header, sizeof(header)) &&
+				   write_file(fd, object.empty() ? NULL : &object[0], object.size()) &&
+				   write_file(fd, stripped.data(), stripped.size());
+
+	if (close(fd) < 0 || !written || rename(temp_path.c_str(), entry_path(key).c_str()) < 0)
+		unlink(temp_path.c_str());
+}
+
+// Locks the stats file, so that only one wasm at a time updates the totals
+// or removes entries. Returns the file, or -1 if it couldn't be locked.
+int object_cache::lock_stats()
+{
+	string path = directory + "/stats";
+
+	int fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0666);
+	if (fd < 0)
+		return -1;
+
+	if (flock(fd, LOCK_EX) < 0)
+	{
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+// Finds the entries and their total size, and if remove is set removes the
+// least recently used until the rest fit in the size limit. Temporary files
+// left behind by a wasm that didn't finish are removed too.
+unsigned long long object_cache::scan(bool remove, unsigned int &num_entries, unsigned int &num_removed)
+{
+	vector<cache_file> entries;
+	unsigned long long total_size = 0;
+	time_t now = time(NULL);
+	struct dirent *item;
+	struct stat info;
+
+	num_entries = 0;
+	num_removed = 0;
+
+	DIR *dir = opendir(directory.c_str());
+	if (dir == NULL)
+		return 0;
+
+	while ((item = readdir(dir)) != NULL)
+	{
+		string path = directory + "/" + item->d_name;
+
+		if (is_entry_name(item->d_name))
+		{
+			if (stat(path.c_str(), &info) < 0)
+				continue;
+
+			cache_file entry;
+			entry.last_used = info.st_mtime;
+			entry.size = info.st_size;
+			entry.name = path;
+			entries.push_back(entry);
+			total_size += entry.size;
+		}
+		else if (remove && strstr(item->d_name, ".tmp.") != NULL &&
+				 stat(path.c_str(), &info) == 0 && now - info.st_mtime > stale_temp_age)
+		{
+			unlink(path.c_str());
+		}
+	}
+	closedir(dir);
+
+	num_entries = entries.size();
+	if (!remove || total_size <= max_size)
+		return total_size;
+
+	sort(entries.begin(), entries.end());
+	for (unsigned int i = 0; i < entries.size() && total_size > max_size; i++)
+	{
+		if (unlink(entries[i].name.c_str()) == 0)
+		{
+			total_size -= entries[i].size;
+			num_entries--;
+			num_removed++;
+		}
+	}
+	return total_size;
+}
+
+void object_cache::update()
+{
+	cache_stats stats;
+	unsigned int num_entries, num_removed;
+
+	pthread_mutex_lock(&lock);
+	unsigned int new_hits = hits, new_misses = misses;
+	bool grown = (num_stored > 0);
+	hits = misses = num_stored = 0;
+	pthread_mutex_unlock(&lock);
+
+	if (new_hits == 0 && new_misses == 0)
+		return;
+
+	int fd = lock_stats();
+	if (fd < 0)
+		return;
+
+	read_stats(fd, stats);
+	stats.hits += new_hits;
+	stats.misses += new_misses;
+
+	// Once the cache has been checked against this size limit, only new
+	// entries can take it over the limit
+	if (grown || !checked)
+	{
+		scan(true, num_entries, num_removed);
+		stats.evictions += num_removed;
+		checked = true;
+	}
+
+	write_stats(fd, stats);
+	close(fd);
+}
+
+void object_cache::print_stats(ostream &out)
+{
+	cache_stats stats;
+	unsigned int num_entries, num_removed;
+
+	int fd = lock_stats();
+	if (fd < 0)
+		memset(&stats, 0, sizeof(stats));
+	else
+		read_stats(fd, stats);
+
+	unsigned long long total_size = scan(false, num_entries, num_removed);
+
+	if (fd >= 0)
+		close(fd);
+
+	unsigned long long lookups = stats.hits + stats.misses;
+
+	out << "cache directory = " << directory << endl;
+	out << "cache hits = " << stats.hits << ", misses = " << stats.misses;
+	if (lookups > 0)
+		out << " (" << (stats.hits * 100 + lookups / 2) / lookups << "% hits)";
+	out << endl;
+	out << "cache entries = " << num_entries << ", size = " << total_size << " bytes of " << max_size << endl;
+	out << "cache evictions = " << stats.evictions << endl;
+}
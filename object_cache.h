@@ -0,0 +1,82 @@
+/*
+########################################################################
+# This file is part of the toolchain for WRAMP assembly
+#
+# Copyright (C) 2019 The University of Waikato, Hamilton, New Zealand.
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <https://www.gnu.org/licenses/>.
+########################################################################
+*/
+
+#ifndef OBJECT_CACHE_H
+#define OBJECT_CACHE_H
+
+#include <stddef.h>
+#include <pthread.h>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// A directory of object files named after a hash of the source they were
+// assembled from, the assembler version and the options, so that source
+// that has been assembled before doesn't need assembling again. Entries are
+// written to a temporary file and renamed into place, so any number of
+// wasm processes and threads can share a cache. Once the cache grows past
+// its size limit the least recently used entries are removed.
+class object_cache
+{
+public:
+	object_cache(const char *directory, unsigned long long max_size);
+	~object_cache();
+
+	// Creates the directory if need be, returning false if it can't be used
+	bool open(std::ostream &errors);
+
+	// The key for some source assembled with the given options. A line table
+	// holds the source file's name, so the name is part of the key with one.
+	std::string key(const char *source, size_t length, const char *name, bool text_regions, bool line_table);
+	// Looks up an entry, giving back the object file and any warnings
+	// assembling it gave, with name as the source file. Returns false if
+	// there is no entry.
+	bool fetch(const std::string &key, const char *name, std::vector<char> &object, std::string &messages);
+	void store(const std::string &key, const char *name, const std::vector<char> &object, const std::string &messages);
+
+	// Adds the hits and misses so far to the totals kept in the cache, and
+	// removes entries until the cache fits in its size limit
+	void update();
+	// Lists the totals, along with the number of entries and their size
+	void print_stats(std::ostream &out);
+
+private:
+	std::string directory;
+	unsigned long long max_size;
+
+	// Counted since the last update(), shared between the worker threads
+	unsigned int hits, misses;
+	unsigned int num_stored;
+	unsigned int next_temp;
+	pthread_mutex_t lock;
+	// Whether the entries have been checked against the size limit yet
+	bool checked;
+
+	std::string entry_path(const std::string &key);
+	int lock_stats();
+	unsigned long long scan(bool remove, unsigned int &num_entries, unsigned int &num_removed);
+
+	// Not copyable, the lock can't be shared
+	object_cache(const object_cache &);
+	object_cache &operator=(const object_cache &);
+};
+
+#endif
@@ -0,0 +1,595 @@
+/*
+########################################################################
+# This file is part of the toolchain for WRAMP assembly
+#
+# Copyright (C) 2019 The University of Waikato, Hamilton, New Zealand.
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <https://www.gnu.org/licenses/>.
+########################################################################
+*/
+
+#include <algorithm>
+#include <string.h>
+
+#include "object_file.h"
+#include "symbol_table.h"
+
+using namespace std;
+
+// Printable names for the segments and relocation types, indexed by value
+// (the segment name is indexed by value + 1 so that NONE fits)
+char * seg_type_name[] = {"NONE", "TEXT", "DATA", "BSS", "NUM_SEGMENTS"};
+
+char * reference_type_name[8] ={ 
+		"GLOBAL_DATA",    // This defines a declared global data segment label
+		"GLOBAL_TEXT",    // This defines a declared global text segment label
+		"GLOBAL_BSS",     // This defines a declared global bss segment label
+		"TEXT_LABEL_REF", // This is a reference to our own text segment
+		"DATA_LABEL_REF", // This is a reference to our own data segment
+		"BSS_LABEL_REF",  // This is a reference to our own bss segment
+		"EXTERNAL_REF",   // This is an unresolved (ie. external) reference
+		"TEXT_REGION"     // This starts a region of the text segment that can be dropped if unused
+};
+
+static bool host_little_endian()
+{
+	unsigned int word = 1;
+	return *(unsigned char *)&word == 1;
+}
+
+static const char *open_object_v1(const char *data, size_t length, object_view &view)
+{
+	memcpy(&view.header, data, sizeof(object_header));
+	view.version = 1;
+
+	const object_header &header = view.header;
+	size_t text_length = (size_t)header.text_seg_size * sizeof(unsigned int);
+	size_t data_length = (size_t)header.data_seg_size * sizeof(unsigned int);
+	size_t reloc_length = (size_t)header.num_references * sizeof(reloc_entry);
+
+	if (length < sizeof(object_header) + text_length + data_length + reloc_length + header.symbol_name_table_size)
+		return "Object file is truncated : ";
+
+	view.segment[TEXT] = data + sizeof(object_header);
+	view.segment[DATA] = view.segment[TEXT] + text_length;
+	view.relocs = view.segment[DATA] + data_length;
+	view.relocs_size = reloc_length;
+	view.packed_relocs = false;
+	view.symbols = NULL;
+	view.num_symbol_slots = 0;
+	view.names = view.relocs + reloc_length;
+	view.lines = NULL;
+	view.lines_size = 0;
+	return NULL;
+}
+
+static const char *open_object_v2(const char *data, size_t length, object_view &view)
+{
+	if (length < sizeof(object_header_v2))
+		return "Object file is truncated : ";
+
+	unsigned int version = get_le32(data + offsetof(object_header_v2, version));
+	unsigned int header_size = get_le32(data + offsetof(object_header_v2, header_size));
+	unsigned int num_sections = get_le32(data + offsetof(object_header_v2, num_sections));
+	unsigned int flags = get_le32(data + offsetof(object_header_v2, flags));
+
+	if (version < 2 || version > OBJ_VERSION || (flags & ~OBJ_KNOWN_FLAGS) != 0)
+		return "Unsupported object file version : ";
+	if (header_size < sizeof(object_header_v2) || header_size % 4 != 0 ||
+		length < header_size + (size_t)num_sections * sizeof(object_section))
+		return "Object file is truncated : ";
+
+	view.version = version;
+	view.header.magic_number = OBJ_MAGIC_NUM;
+	view.header.text_seg_size = get_le32(data + offsetof(object_header_v2, text_seg_size));
+	view.header.data_seg_size = get_le32(data + offsetof(object_header_v2, data_seg_size));
+	view.header.bss_seg_size = get_le32(data + offsetof(object_header_v2, bss_seg_size));
+	view.header.num_references = 0;
+	view.header.symbol_name_table_size = 0;
+	view.relocs_size = 0;
+	view.num_symbol_slots = 0;
+	view.lines_size = 0;
+
+	// Sections that are left out are empty
+	size_t expected_size[NUM_SECTION_TYPES] = {0};
+	expected_size[SECTION_TEXT] = (size_t)view.header.text_seg_size * 4;
+	expected_size[SECTION_DATA] = (size_t)view.header.data_seg_size * 4;
+	bool seen[NUM_SECTION_TYPES] = {false};
+	const char *start[NUM_SECTION_TYPES] = {NULL};
+	bool packed = (flags & OBJ_FLAG_PACKED_RELOCS) != 0;
+
+	for (unsigned int i = 0; i < num_sections; i++)
+	{
+		const char *entry = data + header_size + i * sizeof(object_section);
+		unsigned int type = get_le32(entry + offsetof(object_section, type));
+		unsigned int offset = get_le32(entry + offsetof(object_section, offset));
+		unsigned int size = get_le32(entry + offsetof(object_section, size));
+		unsigned int count = get_le32(entry + offsetof(object_section, count));
+
+		if (offset % OBJ_SECTION_ALIGN != 0 || offset > length || size > length - offset)
+			return "Object file is truncated : ";
+
+		// Leave sections from later versions to the readers that know them
+		if (type < SECTION_TEXT || type >= NUM_SECTION_TYPES)
+			continue;
+
+		if (seen[type])
+			return "Bad section table in object file : ";
+		seen[type] = true;
+		start[type] = data + offset;
+
+		// Only the kind of relocations the flags give may be there
+		if ((type == SECTION_RELOCS && packed) || (type == SECTION_PACKED_RELOCS && !packed))
+			return "Bad section table in object file : ";
+
+		if (type == SECTION_RELOCS)
+		{
+			expected_size[type] = (size_t)count * sizeof(reloc_entry_v2);
+			view.header.num_references = count;
+			view.relocs_size = size;
+		}
+		else if (type == SECTION_PACKED_RELOCS)
+		{
+			// Each entry takes at least two bytes
+			expected_size[type] = ((size_t)count * 2 <= size) ? size : (size_t)count * 2;
+			view.header.num_references = count;
+			view.relocs_size = size;
+		}
+		else if (type == SECTION_SYMBOL_INDEX)
+		{
+			// The slots are a power of two
+			if (count == 0 || (count & (count - 1)) != 0)
+				return "Bad section table in object file : ";
+			expected_size[type] = (size_t)count * sizeof(object_symbol_v2);
+			view.num_symbol_slots = count;
+		}
+		else if (type == SECTION_NAMES)
+		{
+			expected_size[type] = size;
+			view.header.symbol_name_table_size = size;
+		}
+		else if (type == SECTION_LINES)
+		{
+			// Checked as it is read
+			expected_size[type] = size;
+			view.lines_size = size;
+		}
+
+		if (size != expected_size[type])
+			return "Bad section table in object file : ";
+	}
+
+	if ((!seen[SECTION_TEXT] && view.header.text_seg_size > 0) || (!seen[SECTION_DATA] && view.header.data_seg_size > 0))
+		return "Bad section table in object file : ";
+
+	view.segment[TEXT] = start[SECTION_TEXT];
+	view.segment[DATA] = start[SECTION_DATA];
+	view.relocs = start[packed ? SECTION_PACKED_RELOCS : SECTION_RELOCS];
+	view.packed_relocs = packed;
+	view.symbols = start[SECTION_SYMBOL_INDEX];
+	view.names = start[SECTION_NAMES];
+	view.lines = start[SECTION_LINES];
+	return NULL;
+}
+
+const char *open_object(const char *data, size_t length, object_view &view)
+{
+	const char *error;
+	unsigned int magic_number;
+
+	if (length < sizeof(unsigned int))
+		return "File is not an object file : ";
+	memcpy(&magic_number, data, sizeof(magic_number));
+
+	if (magic_number == OBJ_MAGIC_NUM && length >= sizeof(object_header))
+		error = open_object_v1(data, length, view);
+	else if (get_le32(data) == OBJ_V2_MAGIC_NUM)
+		error = open_object_v2(data, length, view);
+	else
+		return "File is not an object file : ";
+
+	if (error != NULL)
+		return error;
+
+	// The names must end with a terminated name
+	unsigned int names_size = view.header.symbol_name_table_size;
+	if (names_size > 0 && view.names[names_size - 1] != '\0')
+		return "Object file is truncated : ";
+
+	return NULL;
+}
+
+bool get_symbol(const object_view &view, unsigned int i, object_symbol &symbol)
+{
+	const char *slot = view.symbols + i * sizeof(object_symbol_v2);
+	unsigned int symbol_ptr = get_le32(slot + offsetof(object_symbol_v2, symbol_ptr));
+
+	if (symbol_ptr >= view.header.symbol_name_table_size)
+		return false;
+
+	symbol.name = view.names + symbol_ptr;
+	symbol.hash = get_le32(slot + offsetof(object_symbol_v2, hash));
+	symbol.type = (reference_type)get_le32(slot + offsetof(object_symbol_v2, type));
+	symbol.address = get_le32(slot + offsetof(object_symbol_v2, address));
+	return true;
+}
+
+bool find_symbol(const object_view &view, const char *name, object_symbol &symbol)
+{
+	unsigned int hash = hash_name(name);
+	unsigned int mask = view.num_symbol_slots - 1;
+
+	// An index that is full, which wasm never writes, must still end
+	for (unsigned int probe = 0, i = hash & mask; probe < view.num_symbol_slots; probe++, i = (i + 1) & mask)
+	{
+		if (!get_symbol(view, i, symbol))
+			return false;
+		if (symbol.hash == hash && strcmp(symbol.name, name) == 0)
+			return true;
+	}
+	return false;
+}
+
+reloc_reader::reloc_reader(const object_view &view)
+	: view(view), index(0), ptr(view.relocs), end(view.relocs + view.relocs_size), address(0)
+{
+	if (!view.packed_relocs)
+		return;
+
+	const char *names = view.names;
+	unsigned int names_size = view.header.symbol_name_table_size;
+	for (unsigned int start = 0; start < names_size; start += strlen(names + start) + 1)
+		name_starts.push_back(start);
+}
+
+// Reads a varint from a packed section
+static bool read_number(const char *&ptr, const char *end, unsigned int &value)
+{
+	value = 0;
+	for (int shift = 0; shift < 32; shift += 7)
+	{
+		if (ptr == end)
+			return false;
+
+		unsigned char byte = *ptr++;
+		value |= (unsigned int)(byte & 0x7f) << shift;
+		if ((byte & 0x80) == 0)
+			return true;
+	}
+	return false;
+}
+
+bool reloc_reader::read_number(unsigned int &value)
+{
+	return ::read_number(ptr, end, value);
+}
+
+bool reloc_reader::next(reloc_entry &reloc)
+{
+	if (index == view.header.num_references)
+		return false;
+
+	if (view.version == 1)
+	{
+		memcpy(&reloc, ptr, sizeof(reloc_entry));
+		ptr += sizeof(reloc_entry);
+	}
+	else if (!view.packed_relocs)
+	{
+		reloc.address = get_le32(ptr + offsetof(reloc_entry_v2, address));
+		reloc.symbol_ptr = get_le32(ptr + offsetof(reloc_entry_v2, symbol_ptr));
+		reloc.type = (reference_type)get_le32(ptr + offsetof(reloc_entry_v2, type));
+		reloc.source_seg = (seg_type)(int)get_le32(ptr + offsetof(reloc_entry_v2, source_seg));
+		ptr += sizeof(reloc_entry_v2);
+	}
+	else
+	{
+		unsigned int delta;
+		if (ptr == end)
+			return false;
+		unsigned char kind = *ptr++;
+		if (!read_number(delta))
+			return false;
+
+		reloc.type = (reference_type)(kind >> 4);
+		reloc.source_seg = (seg_type)((kind & 0xf) - 1);
+		address += (delta & 1) ? ~(delta >> 1) : (delta >> 1);
+		reloc.address = address;
+		reloc.symbol_ptr = 0;
+
+		if (reloc.type == GLOBAL_TEXT || reloc.type == GLOBAL_DATA || reloc.type == GLOBAL_BSS || reloc.type == EXTERNAL_REF)
+		{
+			unsigned int name;
+			if (!read_number(name) || name >= name_starts.size())
+				return false;
+			reloc.symbol_ptr = name_starts[name];
+		}
+	}
+
+	index++;
+	return true;
+}
+
+bool read_line_table(const object_view &view, const char *&source_name, vector<line_run> runs[])
+{
+	if (view.lines == NULL)
+		return false;
+
+	const char *ptr = view.lines;
+	const char *end = view.lines + view.lines_size;
+	const char *name_end = (const char *)memchr(ptr, '\0', view.lines_size);
+	if (name_end == NULL)
+		return false;
+	source_name = ptr;
+	ptr = name_end + 1;
+
+	unsigned int line = 0;
+	for (int seg = TEXT; seg <= DATA; seg++)
+	{
+		unsigned int size = (seg == TEXT) ? view.header.text_seg_size : view.header.data_seg_size;
+		unsigned int num_runs, address = 0;
+
+		runs[seg].clear();
+		if (!read_number(ptr, end, num_runs) || num_runs > size)
+			return false;
+
+		for (unsigned int i = 0; i < num_runs; i++)
+		{
+			unsigned int delta, line_delta;
+			if (!read_number(ptr, end, delta) || !read_number(ptr, end, line_delta))
+				return false;
+
+			// Runs start in order, each after the one before
+			if (delta >= size - address || (i > 0 && delta == 0))
+				return false;
+			address += delta;
+			line += (line_delta & 1) ? ~(line_delta >> 1) : (line_delta >> 1);
+
+			line_run run = {address, line};
+			runs[seg].push_back(run);
+		}
+	}
+	return ptr == end;
+}
+
+bool native_words(const object_view &view)
+{
+	return view.version == 1 || host_little_endian();
+}
+
+object_builder::object_builder(unsigned int text_seg_size, unsigned int data_seg_size, unsigned int bss_seg_size)
+{
+	memset(&header, 0, sizeof(header));
+	header.magic_number = OBJ_V2_MAGIC_NUM;
+	header.version = OBJ_VERSION;
+	header.header_size = sizeof(object_header_v2);
+	header.text_seg_size = text_seg_size;
+	header.data_seg_size = data_seg_size;
+	header.bss_seg_size = bss_seg_size;
+}
+
+// Pads the sections so far out to a section boundary, and adds an entry for
+// the next. The offset is from the start of the sections until finish().
+void object_builder::start_section(section_type type, unsigned int size, unsigned int count)
+{
+	contents.resize((contents.size() + OBJ_SECTION_ALIGN - 1) & ~(size_t)(OBJ_SECTION_ALIGN - 1), 0);
+
+	object_section section;
+	section.type = type;
+	section.offset = contents.size();
+	section.size = size;
+	section.count = count;
+	sections.push_back(section);
+}
+
+void object_builder::add_words(section_type type, const unsigned int *words, unsigned int num_words, unsigned int count)
+{
+	start_section(type, num_words * 4, count);
+
+	size_t start = contents.size();
+	contents.resize(start + (size_t)num_words * 4);
+	if (host_little_endian())
+	{
+		if (num_words > 0)
+			memcpy(&contents[start], words, (size_t)num_words * 4);
+	}
+	else
+	{
+		for (unsigned int i = 0; i < num_words; i++)
+			put_le32(&contents[start + i * 4], words[i]);
+	}
+}
+
+void object_builder::add_bytes(section_type type, const char *bytes, unsigned int size, unsigned int count)
+{
+	start_section(type, size, count);
+	contents.insert(contents.end(), bytes, bytes + size);
+}
+
+void object_builder::add_relocs(const reloc_entry *relocs, unsigned int num_relocs)
+{
+	vector<unsigned int> words(num_relocs * 4);
+
+	for (unsigned int i = 0; i < num_relocs; i++)
+	{
+		words[i * 4] = relocs[i].address;
+		words[i * 4 + 1] = relocs[i].symbol_ptr;
+		words[i * 4 + 2] = relocs[i].type;
+		words[i * 4 + 3] = relocs[i].source_seg;
+	}
+	add_words(SECTION_RELOCS, words.empty() ? NULL : &words[0], words.size(), num_relocs);
+}
+
+// Appends a varint to a packed section
+static void put_number(vector<char> &packed, unsigned int value)
+{
+	while (value >= 0x80)
+	{
+		packed.push_back((char)((value & 0x7f) | 0x80));
+		value >>= 7;
+	}
+	packed.push_back((char)value);
+}
+
+// Orders relocations for packing. The globals stay first, in the order they
+// were declared so the linker reports duplicates in the same order, then the
+// rest by segment and address, so that most deltas are small and positive.
+static bool packs_before(const reloc_entry &a, const reloc_entry &b)
+{
+	bool a_global = (a.type == GLOBAL_TEXT || a.type == GLOBAL_DATA || a.type == GLOBAL_BSS);
+	bool b_global = (b.type == GLOBAL_TEXT || b.type == GLOBAL_DATA || b.type == GLOBAL_BSS);
+
+	if (a_global || b_global)
+		return a_global && !b_global;
+	if (a.source_seg != b.source_seg)
+		return a.source_seg < b.source_seg;
+	return a.address < b.address;
+}
+
+bool object_builder::add_packed_relocs(const reloc_entry *relocs, unsigned int num_relocs, const char *names,
+									   unsigned int names_size)
+{
+	vector<unsigned int> name_starts;
+	for (unsigned int start = 0; start < names_size; start += strlen(names + start) + 1)
+		name_starts.push_back(start);
+
+	vector<reloc_entry> sorted(relocs, relocs + num_relocs);
+	stable_sort(sorted.begin(), sorted.end(), packs_before);
+
+	vector<char> packed;
+	unsigned int address = 0;
+
+	for (unsigned int i = 0; i < num_relocs; i++)
+	{
+		const reloc_entry &reloc = sorted[i];
+		int delta = (int)(reloc.address - address);
+
+		packed.push_back((char)((reloc.type << 4) | (reloc.source_seg + 1)));
+		put_number(packed, (delta < 0) ? ((~(unsigned int)delta << 1) | 1) : ((unsigned int)delta << 1));
+		address = reloc.address;
+
+		if (reloc.type == GLOBAL_TEXT || reloc.type == GLOBAL_DATA || reloc.type == GLOBAL_BSS || reloc.type == EXTERNAL_REF)
+		{
+			vector<unsigned int>::iterator name = lower_bound(name_starts.begin(), name_starts.end(), reloc.symbol_ptr);
+			if (name == name_starts.end() || *name != reloc.symbol_ptr)
+				return false;
+			put_number(packed, name - name_starts.begin());
+		}
+	}
+
+	header.flags |= OBJ_FLAG_PACKED_RELOCS;
+	add_bytes(SECTION_PACKED_RELOCS, packed.empty() ? NULL : &packed[0], packed.size(), num_relocs);
+	return true;
+}
+
+void object_builder::add_symbol_index(const reloc_entry *relocs, unsigned int num_relocs, const char *names,
+									  unsigned int names_size)
+{
+	if (names_size == 0)
+		return;
+
+	// Every name has a slot, and the index is kept at most half full
+	unsigned int num_names = 0;
+	for (unsigned int start = 0; start < names_size; start += strlen(names + start) + 1)
+		num_names++;
+
+	unsigned int num_slots = 1;
+	while (num_slots < 2 * num_names)
+		num_slots *= 2;
+
+	vector<object_symbol_v2> slots(num_slots);
+	for (unsigned int i = 0; i < num_slots; i++)
+	{
+		slots[i].symbol_ptr = OBJ_NO_SYMBOL;
+		slots[i].hash = 0;
+		slots[i].type = 0;
+		slots[i].address = 0;
+	}
+
+	for (unsigned int i = 0; i < num_relocs; i++)
+	{
+		const reloc_entry &reloc = relocs[i];
+		if (reloc.type != GLOBAL_TEXT && reloc.type != GLOBAL_DATA && reloc.type != GLOBAL_BSS && reloc.type != EXTERNAL_REF)
+			continue;
+
+		unsigned int hash = hash_name(names + reloc.symbol_ptr);
+		unsigned int slot = hash & (num_slots - 1);
+		while (slots[slot].symbol_ptr != OBJ_NO_SYMBOL && slots[slot].symbol_ptr != reloc.symbol_ptr)
+			slot = (slot + 1) & (num_slots - 1);
+
+		object_symbol_v2 &symbol = slots[slot];
+		if (symbol.symbol_ptr == OBJ_NO_SYMBOL)
+		{
+			symbol.symbol_ptr = reloc.symbol_ptr;
+			symbol.hash = hash;
+			symbol.type = reloc.type;
+		}
+
+		// Externals count their references instead
+		if (reloc.type == EXTERNAL_REF)
+			symbol.address++;
+		else
+			symbol.address = reloc.address;
+	}
+
+	add_words(SECTION_SYMBOL_INDEX, (const unsigned int *)&slots[0], num_slots * 4, num_slots);
+}
+
+void object_builder::add_line_table(const char *source_name, const vector<line_run> runs[])
+{
+	vector<char> packed(source_name, source_name + strlen(source_name) + 1);
+	unsigned int line = 0, count = 0;
+
+	for (int seg = TEXT; seg <= DATA; seg++)
+	{
+		unsigned int address = 0;
+
+		put_number(packed, runs[seg].size());
+		for (unsigned int i = 0; i < runs[seg].size(); i++)
+		{
+			int delta = (int)(runs[seg][i].line - line);
+
+			put_number(packed, runs[seg][i].address - address);
+			put_number(packed, (delta < 0) ? ((~(unsigned int)delta << 1) | 1) : ((unsigned int)delta << 1));
+			address = runs[seg][i].address;
+			line = runs[seg][i].line;
+		}
+		count += runs[seg].size();
+	}
+
+	add_bytes(SECTION_LINES, &packed[0], packed.size(), count);
+}
+
+void object_builder::finish(vector<char> &object)
+{
+	size_t table_size = sections.size() * sizeof(object_section);
+	size_t base = (sizeof(header) + table_size + OBJ_SECTION_ALIGN - 1) & ~(size_t)(OBJ_SECTION_ALIGN - 1);
+
+	header.num_sections = sections.size();
+
+	object.assign(base, 0);
+	for (unsigned int i = 0; i < sizeof(header) / 4; i++)
+		put_le32(&object[i * 4], ((const uint32_t *)&header)[i]);
+
+	for (unsigned int i = 0; i < sections.size(); i++)
+	{
+		char *entry = &object[sizeof(header) + i * sizeof(object_section)];
+		put_le32(entry + offsetof(object_section, type), sections[i].type);
+		put_le32(entry + offsetof(object_section, offset), sections[i].offset + base);
+		put_le32(entry + offsetof(object_section, size), sections[i].size);
+		put_le32(entry + offsetof(object_section, count), sections[i].count);
+	}
+
+	object.insert(object.end(), contents.begin(), contents.end());
+}
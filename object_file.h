@@ -22,8 +22,12 @@
 #ifndef OBJECT_FILE_H
 #define OBJECT_FILE_H
 
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
 typedef enum { NONE = -1, TEXT = 0, DATA, BSS, NUM_SEGMENTS } seg_type;
-char * seg_type_name[] = {"NONE", "TEXT", "DATA", "BSS", "NUM_SEGMENTS"};
+extern char * seg_type_name[];
 
 typedef struct {
   // This magic number identifies the file as being an object file
@@ -47,18 +51,11 @@ typedef enum {
 		TEXT_LABEL_REF, // This is a reference to our own text segment
 		DATA_LABEL_REF, // This is a reference to our own data segment
 		BSS_LABEL_REF,  // This is a reference to our own bss segment
-		EXTERNAL_REF    // This is an unresolved (ie. external) reference
+		EXTERNAL_REF,   // This is an unresolved (ie. external) reference
+		TEXT_REGION     // This starts a region of the text segment that can be dropped if unused
 } reference_type;
 
-char * reference_type_name[7] ={ 
-		"GLOBAL_DATA",    // This defines a declared global data segment label
-		"GLOBAL_TEXT",    // This defines a declared global text segment label
-		"GLOBAL_BSS",     // This defines a declared global bss segment label
-		"TEXT_LABEL_REF", // This is a reference to our own text segment
-		"DATA_LABEL_REF", // This is a reference to our own data segment
-		"BSS_LABEL_REF",  // This is a reference to our own bss segment
-		"EXTERNAL_REF"    // This is an unresolved (ie. external) reference
-};
+extern char * reference_type_name[8];
 
 typedef struct {
   unsigned int address;
@@ -70,4 +67,260 @@ typedef struct {
 
 #define OBJ_MAGIC_NUM 0xdaa1
 
+// Version 1 object files, above, are the host's own structures. Version 2
+// object files hold every field as a 32 bit little endian word so that they
+// read the same on any host. The header is followed by a table of sections,
+// each starting on an 8 byte boundary, so a file that has been mapped into
+// memory can be used where it is. Readers skip sections they don't know.
+typedef struct {
+  // OBJ_V2_MAGIC_NUM, which is "wobj" as bytes
+  uint32_t magic_number;
+  // The format version, OBJ_VERSION for files written now
+  uint32_t version;
+  // The size (in bytes) of this header, the section table follows it
+  uint32_t header_size;
+  // The number of entries in the section table
+  uint32_t num_sections;
+  // The size (in words) of each segment
+  uint32_t text_seg_size;
+  uint32_t data_seg_size;
+  uint32_t bss_seg_size;
+  // The OBJ_FLAG_ features a reader must know about to read the file
+  uint32_t flags;
+} object_header_v2;
+
+typedef enum {
+  SECTION_TEXT = 1, // The text segment's words
+  SECTION_DATA,     // The data segment's words
+  SECTION_RELOCS,   // The relocation entries, as reloc_entry_v2
+  SECTION_NAMES,    // The symbol names, each null terminated
+  SECTION_PACKED_RELOCS, // The relocation entries packed, in place of SECTION_RELOCS
+  SECTION_SYMBOL_INDEX,  // A hash index of the names, as object_symbol_v2
+  SECTION_LINES,         // The source line of each word, only written by wasm -g
+  NUM_SECTION_TYPES
+} section_type;
+
+typedef struct {
+  uint32_t type;
+  // Where the section starts, from the start of the file, a multiple of 8
+  uint32_t offset;
+  // The size (in bytes) of the section
+  uint32_t size;
+  // The number of entries in the section (words or relocations), zero for names
+  uint32_t count;
+} object_section;
+
+typedef struct {
+  uint32_t address;
+  uint32_t symbol_ptr;
+  uint32_t type;       // A reference_type
+  uint32_t source_seg; // A seg_type, with NONE as 0xffffffff
+} reloc_entry_v2;
+
+// One slot of the symbol index, an open addressing hash table of the names
+// in the name table, probed linearly from hash_name(name) & (count - 1).
+// Each name is there once, with the global that declares it, or as an
+// EXTERNAL_REF if the file only refers to it. With the index a reader can
+// tell whether a file declares a name without reading the relocations.
+typedef struct {
+  // The name, in the name table, or OBJ_NO_SYMBOL for an empty slot
+  uint32_t symbol_ptr;
+  uint32_t hash;
+  // GLOBAL_TEXT, GLOBAL_DATA, GLOBAL_BSS or EXTERNAL_REF
+  uint32_t type;
+  // Where a global is in its segment, or the number of references to an external
+  uint32_t address;
+} object_symbol_v2;
+
+#define OBJ_NO_SYMBOL 0xffffffff
+
+#define OBJ_V2_MAGIC_NUM 0x6a626f77
+#define OBJ_VERSION 2
+#define OBJ_SECTION_ALIGN 8
+
+// The relocations are in a SECTION_PACKED_RELOCS. Each entry there is a byte
+// holding the type in the top four bits and source_seg + 1 in the bottom
+// four, then the address as the difference from the previous entry's
+// address, then for the entries with a symbol, which name it is in the name
+// table (0 for the first). Numbers are varints, 7 bits to a byte with the
+// top bit set on all but the last byte, and the differences are zigzag
+// encoded (0, -1, 1, -2, ... as 0, 1, 2, 3, ...). References are written in
+// address order, so the differences are mostly small.
+#define OBJ_FLAG_PACKED_RELOCS 0x1
+#define OBJ_KNOWN_FLAGS OBJ_FLAG_PACKED_RELOCS
+
+// A SECTION_LINES holds the name of the source file, null terminated, then
+// for the text segment and then the data segment the number of runs and the
+// runs themselves. A run is a stretch of words assembled from the same line,
+// lasting until the next run starts or the segment ends. Each run is where
+// it starts, as the difference from the previous run's start, then its line,
+// as the zigzag encoded difference from the previous run's line, both as
+// varints like those of SECTION_PACKED_RELOCS. The section's count is the
+// number of runs in both segments.
+typedef struct {
+  unsigned int address; // The first word of the run
+  unsigned int line;
+} line_run;
+
+// An object file of either version held in memory, checked and split into
+// its parts. The header holds the sizes in the version 1 layout whatever the
+// version of the file.
+typedef struct {
+  unsigned int version;
+  object_header header;
+  // The words of the text and data segments, little endian in version 2
+  const char *segment[2];
+  // header.num_references relocation entries, read with a reloc_reader
+  const char *relocs;
+  size_t relocs_size;
+  bool packed_relocs;
+  // The symbol index, NULL if the file doesn't have one
+  const char *symbols;
+  unsigned int num_symbol_slots;
+  // header.symbol_name_table_size bytes of names
+  const char *names;
+  // The line table, NULL if the file doesn't have one
+  const char *lines;
+  size_t lines_size;
+} object_view;
+
+// Checks an object file of either version is whole, and fills in view.
+// Returns NULL if it is, or what is wrong with it, to be followed by the
+// file's name in a message.
+const char *open_object(const char *data, size_t length, object_view &view);
+
+// An entry of the symbol index, see object_symbol_v2
+typedef struct {
+  const char *name;
+  unsigned int hash;
+  reference_type type;
+  unsigned int address;
+} object_symbol;
+
+// Reads slot i of the symbol index, returning false if it is empty (or
+// doesn't hold a name)
+bool get_symbol(const object_view &view, unsigned int i, object_symbol &symbol);
+
+// Looks a name up in the symbol index, returning false if it isn't there.
+// The file must have an index.
+bool find_symbol(const object_view &view, const char *name, object_symbol &symbol);
+
+// Reads the line table into runs[TEXT] and runs[DATA], returning false if
+// the file doesn't have one or it is badly encoded. The source name points
+// into the file.
+bool read_line_table(const object_view &view, const char *&source_name, std::vector<line_run> runs[]);
+
+// Reads the relocation entries of an object file, one after another
+class reloc_reader
+{
+public:
+  reloc_reader(const object_view &view);
+
+  // Reads the next entry, returning false once they have all been read or
+  // if they are badly encoded
+  bool next(reloc_entry &reloc);
+
+private:
+  const object_view &view;
+  unsigned int index;
+  const char *ptr;
+  const char *end;
+  unsigned int address;
+  // Where each name starts in the name table, for packed entries
+  std::vector<unsigned int> name_starts;
+
+  bool read_number(unsigned int &value);
+};
+
+// Returns true if the segments' words can be used as they are, which they
+// can unless a version 2 file is read on a big endian host
+bool native_words(const object_view &view);
+
+// Reads a little endian word
+inline unsigned int get_le32(const char *ptr)
+{
+  const unsigned char *bytes = (const unsigned char *)ptr;
+  return bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | ((unsigned int)bytes[3] << 24);
+}
+
+// Writes a little endian word
+inline void put_le32(char *ptr, unsigned int value)
+{
+  ptr[0] = value & 0xff;
+  ptr[1] = (value >> 8) & 0xff;
+  ptr[2] = (value >> 16) & 0xff;
+  ptr[3] = (value >> 24) & 0xff;
+}
+
+// Builds a version 2 object file, one section at a time
+class object_builder
+{
+public:
+  object_builder(unsigned int text_seg_size, unsigned int data_seg_size, unsigned int bss_seg_size);
+
+  // Adds a section of words, which are written little endian. There are
+  // num_words words, making up count entries.
+  void add_words(section_type type, const unsigned int *words, unsigned int num_words, unsigned int count);
+  // Adds a section of bytes, written as they are
+  void add_bytes(section_type type, const char *bytes, unsigned int size, unsigned int count);
+  void add_relocs(const reloc_entry *relocs, unsigned int num_relocs);
+  // Adds the relocation entries packed, returning false if they can't be
+  // because a symbol isn't the start of a name. The entries are written
+  // with the globals first and the rest sorted by segment and address.
+  bool add_packed_relocs(const reloc_entry *relocs, unsigned int num_relocs, const char *names,
+                         unsigned int names_size);
+  // Adds an index of the names the relocation entries declare or refer to
+  void add_symbol_index(const reloc_entry *relocs, unsigned int num_relocs, const char *names,
+                        unsigned int names_size);
+  // Adds a line table, from runs[TEXT] and runs[DATA]
+  void add_line_table(const char *source_name, const std::vector<line_run> runs[]);
+
+  // Lays out the header, the section table and the sections
+  void finish(std::vector<char> &object);
+
+private:
+  object_header_v2 header;
+  std::vector<object_section> sections;
+  std::vector<char> contents;
+
+  void start_section(section_type type, unsigned int size, unsigned int count);
+};
+
+// An archive is a header, the members, the symbol index and the names,
+// every field a 32 bit little endian word, followed by the object files themselves, each starting on a word boundary
+// (an 8 byte boundary in archives written now, which keeps the sections of
+// version 2 members aligned)
+typedef struct {
+  // This magic number identifies the file as being an archive
+  unsigned int magic_number;
+  // The number of object files in the archive
+  unsigned int num_members;
+  // The number of slots in the symbol index, a power of two
+  unsigned int index_size;
+  // The size (in bytes) of the name table
+  unsigned int name_table_size;
+} archive_header;
+
+typedef struct {
+  // The member's filename, in the name table
+  unsigned int name_ptr;
+  // Where the object file starts, from the start of the archive
+  unsigned int offset;
+  // The size (in bytes) of the object file
+  unsigned int length;
+} archive_member;
+
+// One slot of the symbol index, an open addressing hash table of the globals
+// declared by the members, probed linearly from hash_name(name) & (index_size - 1)
+typedef struct {
+  // The global's name, in the name table
+  unsigned int symbol_ptr;
+  unsigned int hash;
+  // The member that declares it, or ARCHIVE_NO_MEMBER for an empty slot
+  unsigned int member;
+} archive_index_entry;
+
+#define ARCHIVE_MAGIC_NUM 0xdaa2
+#define ARCHIVE_NO_MEMBER 0xffffffff
+
 #endif
@@ -0,0 +1,166 @@
+/*
+########################################################################
+# This file is part of the toolchain for WRAMP assembly
+#
+# Copyright (C) 2019 The University of Waikato, Hamilton, New Zealand.
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <https://www.gnu.org/licenses/>.
+########################################################################
+*/
+
+#include <string.h>
+
+#include "sha256.h"
+
+// The first 32 bits of the fractional parts of the cube roots of the first
+// 64 primes
+static const unsigned int round_constants[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+static inline unsigned int rotate_right(unsigned int value, int bits)
+{
+	return (value >> bits) | (value << (32 - bits));
+}
+
+sha256::sha256()
+{
+	state[0] = 0x6a09e667;
+	state[1] = 0xbb67ae85;
+	state[2] = 0x3c6ef372;
+	state[3] = 0xa54ff53a;
+	state[4] = 0x510e527f;
+	state[5] = 0x9b05688c;
+	state[6] = 0x1f83d9ab;
+	state[7] = 0x5be0cd19;
+	block_used = 0;
+	total_length = 0;
+}
+
+// Mixes one 64 byte block into the state
+void sha256::compress(const unsigned char *data)
+{
+	unsigned int w[64];
+	int i;
+
+	for (i = 0; i < 16; i++)
+		w[i] = (data[4 * i] << 24) | (data[4 * i + 1] << 16) | (data[4 * i + 2] << 8) | data[4 * i + 3];
+
+	for (i = 16; i < 64; i++)
+	{
+		unsigned int s0 = rotate_right(w[i - 15], 7) ^ rotate_right(w[i - 15], 18) ^ (w[i - 15] >> 3);
+		unsigned int s1 = rotate_right(w[i - 2], 17) ^ rotate_right(w[i - 2], 19) ^ (w[i - 2] >> 10);
+		w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+	}
+
+	unsigned int a = state[0], b = state[1], c = state[2], d = state[3];
+	unsigned int e = state[4], f = state[5], g = state[6], h = state[7];
+
+	for (i = 0; i < 64; i++)
+	{
+		unsigned int s1 = rotate_right(e, 6) ^ rotate_right(e, 11) ^ rotate_right(e, 25);
+		unsigned int choose = (e & f) ^ (~e & g);
+		unsigned int temp1 = h + s1 + choose + round_constants[i] + w[i];
+		unsigned int s0 = rotate_right(a, 2) ^ rotate_right(a, 13) ^ rotate_right(a, 22);
+		unsigned int majority = (a & b) ^ (a & c) ^ (b & c);
+		unsigned int temp2 = s0 + majority;
+
+		h = g;
+		g = f;
+		f = e;
+		e = d + temp1;
+		d = c;
+		c = b;
+		b = a;
+		a = temp1 + temp2;
+	}
+
+	state[0] += a;
+	state[1] += b;
+	state[2] += c;
+	state[3] += d;
+	state[4] += e;
+	state[5] += f;
+	state[6] += g;
+	state[7] += h;
+}
+
+void sha256::update(const void *data, size_t length)
+{
+	const unsigned char *bytes = (const unsigned char *)data;
+
+	total_length += length;
+
+	// Top up a partly filled block first
+	if (block_used > 0)
+	{
+		size_t count = 64 - block_used;
+		if (count > length)
+			count = length;
+
+		memcpy(block + block_used, bytes, count);
+		block_used += count;
+		bytes += count;
+		length -= count;
+
+		if (block_used < 64)
+			return;
+		compress(block);
+		block_used = 0;
+	}
+
+	// Whole blocks are hashed where they are
+	while (length >= 64)
+	{
+		compress(bytes);
+		bytes += 64;
+		length -= 64;
+	}
+
+	memcpy(block, bytes, length);
+	block_used = length;
+}
+
+void sha256::digest(unsigned char result[digest_size])
+{
+	unsigned long long bit_length = total_length * 8;
+	int i;
+
+	// A one bit, zeros up to the last 8 bytes of a block, then the length
+	block[block_used++] = 0x80;
+	if (block_used > 56)
+	{
+		memset(block + block_used, 0, 64 - block_used);
+		compress(block);
+		block_used = 0;
+	}
+	memset(block + block_used, 0, 56 - block_used);
+	for (i = 0; i < 8; i++)
+		block[56 + i] = (unsigned char)(bit_length >> (56 - 8 * i));
+	compress(block);
+
+	for (i = 0; i < 8; i++)
+	{
+		result[4 * i] = state[i] >> 24;
+		result[4 * i + 1] = state[i] >> 16;
+		result[4 * i + 2] = state[i] >> 8;
+		result[4 * i + 3] = state[i];
+	}
+}
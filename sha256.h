@@ -0,0 +1,49 @@
+/*
+########################################################################
+# This file is part of the toolchain for WRAMP assembly
+#
+# Copyright (C) 2019 The University of Waikato, Hamilton, New Zealand.
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <https://www.gnu.org/licenses/>.
+########################################################################
+*/
+
+#ifndef SHA256_H
+#define SHA256_H
+
+#include <stddef.h>
+
+// SHA-256 (FIPS 180-4), used to name the entries in wasm's object cache.
+// Data can be added in any number of pieces before the digest is taken.
+class sha256
+{
+public:
+	static const int digest_size = 32;
+
+	sha256();
+
+	void update(const void *data, size_t length);
+	// Finishes the hash, after which the object can't be updated again
+	void digest(unsigned char result[digest_size]);
+
+private:
+	unsigned int state[8];
+	unsigned char block[64];
+	unsigned int block_used;
+	unsigned long long total_length;
+
+	void compress(const unsigned char *data);
+};
+
+#endif
@@ -0,0 +1,608 @@
+/*
+########################################################################
+# This file is part of the toolchain for WRAMP assembly
+#
+# Copyright (C) 2019 The University of Waikato, Hamilton, New Zealand.
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <https://www.gnu.org/licenses/>.
+########################################################################
+*/
+
+#include <string.h>
+#include <ctype.h>
+#include <assert.h>
+
+#include "simulator.h"
+#include "instructions.h"
+
+using namespace std;
+
+// What the simulator does for each instruction. The immediate forms are
+// kept apart from the register forms so that neither has to check which
+// it is when it runs.
+enum sim_op
+{
+	OP_UNDECODED = 0, // Not decoded yet, or written to since
+	OP_ILLEGAL,
+	OP_ADD, OP_ADDI, OP_ADDU, OP_ADDUI,
+	OP_SUB, OP_SUBI, OP_SUBU, OP_SUBUI,
+	OP_MULT, OP_MULTI, OP_MULTU, OP_MULTUI,
+	OP_DIV, OP_DIVI, OP_DIVU, OP_DIVUI,
+	OP_REM, OP_REMI, OP_REMU, OP_REMUI,
+	OP_LHI, OP_LA,
+	OP_AND, OP_ANDI, OP_OR, OP_ORI, OP_XOR, OP_XORI,
+	OP_SLL, OP_SLLI, OP_SRL, OP_SRLI, OP_SRA, OP_SRAI,
+	OP_SLT, OP_SLTI, OP_SLTU, OP_SLTUI,
+	OP_SGT, OP_SGTI, OP_SGTU, OP_SGTUI,
+	OP_SLE, OP_SLEI, OP_SLEU, OP_SLEUI,
+	OP_SGE, OP_SGEI, OP_SGEU, OP_SGEUI,
+	OP_SEQ, OP_SEQI, OP_SNE, OP_SNEI,
+	OP_J, OP_JR, OP_JAL, OP_JALR, OP_BEQZ, OP_BNEZ,
+	OP_LW, OP_SW,
+	OP_MOVGS, OP_MOVSG, OP_BREAK, OP_SYSCALL, OP_RFE
+};
+
+// How the low bits of an instruction are turned into its immediate
+enum imm_kind
+{
+	IMM_NONE,
+	IMM_SIGNED,   // 16 bits, sign extended
+	IMM_UNSIGNED, // 16 bits, zero extended
+	IMM_HIGH,	  // 16 bits, moved to the top half
+	IMM_OFFSET,	  // 20 bits, sign extended
+	IMM_ADDRESS	  // 20 bits
+};
+
+struct sim_insn
+{
+	const char *mnemonic;
+	sim_op op;
+	imm_kind imm;
+};
+
+static const sim_insn sim_insns[] = {
+	{"add", OP_ADD, IMM_NONE},
+	{"addi", OP_ADDI, IMM_SIGNED},
+	{"addu", OP_ADDU, IMM_NONE},
+	{"addui", OP_ADDUI, IMM_UNSIGNED},
+	{"sub", OP_SUB, IMM_NONE},
+	{"subi", OP_SUBI, IMM_SIGNED},
+	{"subu", OP_SUBU, IMM_NONE},
+	{"subui", OP_SUBUI, IMM_UNSIGNED},
+	{"mult", OP_MULT, IMM_NONE},
+	{"multi", OP_MULTI, IMM_SIGNED},
+	{"multu", OP_MULTU, IMM_NONE},
+	{"multui", OP_MULTUI, IMM_UNSIGNED},
+	{"div", OP_DIV, IMM_NONE},
+	{"divi", OP_DIVI, IMM_SIGNED},
+	{"divu", OP_DIVU, IMM_NONE},
+	{"divui", OP_DIVUI, IMM_UNSIGNED},
+	{"rem", OP_REM, IMM_NONE},
+	{"remi", OP_REMI, IMM_SIGNED},
+	{"remu", OP_REMU, IMM_NONE},
+	{"remui", OP_REMUI, IMM_UNSIGNED},
+	{"lhi", OP_LHI, IMM_HIGH},
+	{"la", OP_LA, IMM_ADDRESS},
+	{"and", OP_AND, IMM_NONE},
+	{"andi", OP_ANDI, IMM_UNSIGNED},
+	{"or", OP_OR, IMM_NONE},
+	{"ori", OP_ORI, IMM_UNSIGNED},
+	{"xor", OP_XOR, IMM_NONE},
+	{"xori", OP_XORI, IMM_UNSIGNED},
+	{"sll", OP_SLL, IMM_NONE},
+	{"slli", OP_SLLI, IMM_UNSIGNED},
+	{"srl", OP_SRL, IMM_NONE},
+	{"srli", OP_SRLI, IMM_UNSIGNED},
+	{"sra", OP_SRA, IMM_NONE},
+	{"srai", OP_SRAI, IMM_UNSIGNED},
+	{"slt", OP_SLT, IMM_NONE},
+	{"slti", OP_SLTI, IMM_SIGNED},
+	{"sltu", OP_SLTU, IMM_NONE},
+	{"sltui", OP_SLTUI, IMM_UNSIGNED},
+	{"sgt", OP_SGT, IMM_NONE},
+	{"sgti", OP_SGTI, IMM_SIGNED},
+	{"sgtu", OP_SGTU, IMM_NONE},
+	{"sgtui", OP_SGTUI, IMM_UNSIGNED},
+	{"sle", OP_SLE, IMM_NONE},
+	{"slei", OP_SLEI, IMM_SIGNED},
+	{"sleu", OP_SLEU, IMM_NONE},
+	{"sleui", OP_SLEUI, IMM_UNSIGNED},
+	{"sge", OP_SGE, IMM_NONE},
+	{"sgei", OP_SGEI, IMM_SIGNED},
+	{"sgeu", OP_SGEU, IMM_NONE},
+	{"sgeui", OP_SGEUI, IMM_UNSIGNED},
+	// Equality is the same signed or not, only the immediate differs
+	{"seq", OP_SEQ, IMM_NONE},
+	{"seqi", OP_SEQI, IMM_SIGNED},
+	{"sequ", OP_SEQ, IMM_NONE},
+	{"sequi", OP_SEQI, IMM_UNSIGNED},
+	{"sne", OP_SNE, IMM_NONE},
+	{"snei", OP_SNEI, IMM_SIGNED},
+	{"sneu", OP_SNE, IMM_NONE},
+	{"sneui", OP_SNEI, IMM_UNSIGNED},
+	{"j", OP_J, IMM_ADDRESS},
+	{"jr", OP_JR, IMM_NONE},
+	{"jal", OP_JAL, IMM_ADDRESS},
+	{"jalr", OP_JALR, IMM_NONE},
+	{"beqz", OP_BEQZ, IMM_OFFSET},
+	{"bnez", OP_BNEZ, IMM_OFFSET},
+	{"lw", OP_LW, IMM_OFFSET},
+	{"sw", OP_SW, IMM_OFFSET},
+	{"movgs", OP_MOVGS, IMM_NONE},
+	{"movsg", OP_MOVSG, IMM_NONE},
+	{"break", OP_BREAK, IMM_NONE},
+	{"syscall", OP_SYSCALL, IMM_NONE},
+	{"rfe", OP_RFE, IMM_NONE},
+	{NULL, OP_ILLEGAL, IMM_NONE}};
+
+// The sim_insns entry for each insn_table entry, so that decoding is a
+// decode_insn() and an index
+const int max_insns = 128;
+static const sim_insn *insn_info[max_insns];
+
+static bool build_insn_info()
+{
+	for (int i = 0; sim_insns[i].mnemonic != NULL; i++)
+	{
+		insn_type *insn = lookup_mnemonic(sim_insns[i].mnemonic);
+		assert(insn != NULL && insn - insn_table < max_insns);
+		insn_info[insn - insn_table] = &sim_insns[i];
+	}
+	return true;
+}
+
+static bool insn_info_built = false;
+
+simulator::simulator(ostream &serial)
+	: serial(serial)
+{
+	// After the static initialisation of the mnemonic hash
+	if (!insn_info_built)
+		insn_info_built = build_insn_info();
+
+	memory = new unsigned int[memory_words];
+	decoded = new decoded_insn[memory_words];
+	memset(memory, 0, memory_words * sizeof(unsigned int));
+	memset(decoded, 0, memory_words * sizeof(decoded_insn));
+	profile_instructions = NULL;
+	profile_cycles = NULL;
+
+	memset(reg, 0, sizeof(reg));
+	memset(spr, 0, sizeof(spr));
+	reg[14] = initial_stack;
+	reg[15] = exit_address;
+	// Start in kernel mode, with interrupts off
+	spr[SPR_CCTRL] = 0x8;
+	pc = 0;
+	stop_exception = 0;
+	icount = 0;
+	ccount = 0;
+}
+
+simulator::~simulator()
+{
+	delete[] memory;
+	delete[] decoded;
+	delete[] profile_instructions;
+	delete[] profile_cycles;
+}
+
+void simulator::enable_profile()
+{
+	if (profile_instructions != NULL)
+		return;
+
+	profile_instructions = new unsigned long long[memory_words];
+	profile_cycles = new unsigned long long[memory_words];
+	memset(profile_instructions, 0, memory_words * sizeof(unsigned long long));
+	memset(profile_cycles, 0, memory_words * sizeof(unsigned long long));
+}
+
+static int hex_value(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	c = tolower(c);
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	return -1;
+}
+
+bool simulator::load_srecords(const char *data, size_t length, ostream &messages)
+{
+	unsigned char bytes[256];
+	size_t start = 0;
+	int line_no = 0;
+
+	while (start < length)
+	{
+		const char *line = data + start;
+		const char *end = (const char *)memchr(line, '\n', length - start);
+		size_t line_length = (end == NULL) ? length - start : end - line;
+		start += line_length + 1;
+		line_no++;
+
+		while (line_length > 0 && isspace((unsigned char)line[line_length - 1]))
+			line_length--;
+		if (line_length == 0)
+			continue;
+
+		// The type, then the length, address, data and checksum as hex pairs
+		bool valid = (line_length >= 4 && line[0] == 'S' && isdigit((unsigned char)line[1]) && line_length % 2 == 0);
+		unsigned int num_bytes = valid ? (line_length - 2) / 2 : 0;
+		// The count is a single byte, so no record is longer than bytes
+		valid = valid && num_bytes <= sizeof(bytes);
+		unsigned char checksum = 0;
+		for (unsigned int i = 0; valid && i < num_bytes; i++)
+		{
+			int high = hex_value(line[2 + 2 * i]), low = hex_value(line[3 + 2 * i]);
+			valid = (high >= 0 && low >= 0);
+			bytes[i] = (high << 4) | low;
+			checksum += bytes[i];
+		}
+		valid = valid && bytes[0] == num_bytes - 1 && checksum == 0xff;
+
+		int type = line[1] - '0';
+		int address_bytes = (type == 1 || type == 9) ? 2 : (type == 2 || type == 8) ? 3 : 4;
+		valid = valid && num_bytes >= (unsigned int)address_bytes + 2;
+		if (!valid)
+		{
+			messages << "ERROR: Bad S-record on line " << line_no << endl;
+			return false;
+		}
+
+		// The header and record counts say nothing about memory
+		if (type == 0 || type == 5 || type == 6)
+			continue;
+
+		unsigned int address = 0;
+		for (int i = 0; i < address_bytes; i++)
+			address = (address << 8) | bytes[1 + i];
+
+		if (type >= 7)
+		{
+			pc = address & (memory_words - 1);
+			continue;
+		}
+
+		// The data is whole words, most significant byte first
+		unsigned int data_bytes = num_bytes - address_bytes - 2;
+		unsigned int num_words = data_bytes / 4;
+		if (type > 3 || data_bytes % 4 != 0 || address >= memory_words || num_words > memory_words - address)
+		{
+			messages << "ERROR: Bad S-record on line " << line_no << endl;
+			return false;
+		}
+
+		const unsigned char *word = bytes + 1 + address_bytes;
+		for (unsigned int i = 0; i < num_words; i++, word += 4)
+		{
+			memory[address + i] = ((unsigned int)word[0] << 24) | (word[1] << 16) | (word[2] << 8) | word[3];
+			decoded[address + i].op = OP_UNDECODED;
+		}
+	}
+	return true;
+}
+
+void simulator::decode(unsigned int address)
+{
+	unsigned int word = memory[address];
+	decoded_insn &insn = decoded[address];
+	insn_type *type = decode_insn(word);
+	const sim_insn *info = (type == NULL) ? NULL : insn_info[type - insn_table];
+
+	insn.rd = (word >> 24) & 0xf;
+	insn.rs = (word >> 20) & 0xf;
+	insn.rt = word & 0xf;
+	if (info == NULL)
+	{
+		insn.op = OP_ILLEGAL;
+		insn.imm = 0;
+		insn.cycles = insn_class_cycles[CLASS_SPECIAL];
+		return;
+	}
+
+	insn.op = info->op;
+	insn.cycles = insn_class_cycles[classify_insn(type)];
+	switch (info->imm)
+	{
+	case IMM_NONE:
+		insn.imm = 0;
+		break;
+	case IMM_SIGNED:
+		insn.imm = (word & 0x8000) ? (word | 0xffff0000) : (word & 0xffff);
+		break;
+	case IMM_UNSIGNED:
+		insn.imm = word & 0xffff;
+		break;
+	case IMM_HIGH:
+		insn.imm = word << 16;
+		break;
+	case IMM_OFFSET:
+		insn.imm = (word & 0x80000) ? (word | 0xfff00000) : (word & 0xfffff);
+		break;
+	case IMM_ADDRESS:
+		insn.imm = word & 0xfffff;
+		break;
+	}
+}
+
+// Takes an exception the way the processor does, saving the mode and
+// jumping to $evec. Returns false, stopping the program, if there is no
+// handler.
+bool simulator::take_exception(unsigned int status, unsigned int return_address)
+{
+	if (spr[SPR_EVEC] == 0)
+	{
+		stop_exception = status;
+		return false;
+	}
+
+	// Kernel mode with interrupts off, keeping the old mode in OKU and OIE
+	unsigned int cctrl = spr[SPR_CCTRL];
+	spr[SPR_CCTRL] = (cctrl & ~0xfu) | 0x8 | ((cctrl & 0x8) >> 1) | ((cctrl & 0x2) >> 1);
+	spr[SPR_ESTAT] = status;
+	spr[SPR_EAR] = return_address;
+	spr[SPR_ERS] = reg[13];
+	pc = spr[SPR_EVEC] & (memory_words - 1);
+	return true;
+}
+
+void simulator::flush_serial()
+{
+	serial.write(serial_buffer.data(), serial_buffer.size());
+	serial.flush();
+	serial_buffer.clear();
+}
+
+unsigned int simulator::read_word(unsigned int address)
+{
+	if (address == serial_status)
+		return 0x2;
+	if (address == serial_receive)
+		return 0;
+	return memory[address];
+}
+
+void simulator::write_word(unsigned int address, unsigned int value)
+{
+	if (address == serial_transmit)
+	{
+		serial_buffer += (char)value;
+		if (serial_buffer.size() >= 65536)
+			flush_serial();
+		return;
+	}
+
+	memory[address] = value;
+	decoded[address].op = OP_UNDECODED;
+}
+
+unsigned int simulator::read_spr(unsigned int number)
+{
+	if (number == SPR_ICOUNT)
+		return (unsigned int)icount;
+	if (number == SPR_CCOUNT)
+		return (unsigned int)ccount;
+	return spr[number];
+}
+
+void simulator::write_spr(unsigned int number, unsigned int value)
+{
+	if (number == SPR_ICOUNT)
+		icount = value;
+	else if (number == SPR_CCOUNT)
+		ccount = value;
+	else
+		spr[number] = value;
+}
+
+// The devices are in the page holding the serial port
+static inline bool is_device(unsigned int address)
+{
+	return (address & ~0xfffu) == serial_transmit;
+}
+
+// Stops the program if the exception has no handler, otherwise goes on from
+// the handler
+#define EXCEPTION(status, return_address)                  \
+	{                                                      \
+		if (!take_exception((status), (return_address)))   \
+			return STOP_EXCEPTION;                         \
+		continue;                                          \
+	}
+
+// The register and immediate forms of an ALU instruction, with the result
+// worked out from a and b
+#define ALU_OPS(op, result) \
+	case op:                \
+		b = reg[insn->rt];  \
+		reg[insn->rd] = (result); \
+		break;              \
+	case op##I:             \
+		b = insn->imm;      \
+		reg[insn->rd] = (result); \
+		break;
+
+template <bool profiling>
+stop_reason simulator::execute(unsigned long long limit)
+{
+	// Counted apart from $icount, which the program can set
+	for (unsigned long long executed = 0;; executed++)
+	{
+		if (pc == exit_address)
+			return STOP_RETURNED;
+		if (executed == limit)
+			return STOP_LIMIT;
+
+		decoded_insn *insn = &decoded[pc];
+		if (insn->op == OP_UNDECODED)
+			decode(pc);
+
+		unsigned int next = (pc + 1) & (memory_words - 1);
+		unsigned int a = reg[insn->rs], b, address;
+		long long product;
+
+		icount++;
+		ccount += insn->cycles;
+		if (profiling)
+		{
+			profile_instructions[pc]++;
+			profile_cycles[pc] += insn->cycles;
+		}
+
+		switch (insn->op)
+		{
+		case OP_ADD:
+		case OP_ADDI:
+			b = (insn->op == OP_ADD) ? reg[insn->rt] : insn->imm;
+			if ((((a + b) ^ a) & ((a + b) ^ b)) >> 31)
+				EXCEPTION(exception_arith, pc);
+			reg[insn->rd] = a + b;
+			break;
+		ALU_OPS(OP_ADDU, a + b)
+		case OP_SUB:
+		case OP_SUBI:
+			b = (insn->op == OP_SUB) ? reg[insn->rt] : insn->imm;
+			if (((a ^ b) & (a ^ (a - b))) >> 31)
+				EXCEPTION(exception_arith, pc);
+			reg[insn->rd] = a - b;
+			break;
+		ALU_OPS(OP_SUBU, a - b)
+		case OP_MULT:
+		case OP_MULTI:
+			b = (insn->op == OP_MULT) ? reg[insn->rt] : insn->imm;
+			product = (long long)(int)a * (int)b;
+			if (product != (int)product)
+				EXCEPTION(exception_arith, pc);
+			reg[insn->rd] = (unsigned int)product;
+			break;
+		ALU_OPS(OP_MULTU, a * b)
+		case OP_DIV:
+		case OP_DIVI:
+		case OP_REM:
+		case OP_REMI:
+			b = (insn->op == OP_DIV || insn->op == OP_REM) ? reg[insn->rt] : insn->imm;
+			if (b == 0 || (a == 0x80000000 && b == 0xffffffff))
+				EXCEPTION(exception_arith, pc);
+			if (insn->op == OP_DIV || insn->op == OP_DIVI)
+				reg[insn->rd] = (int)a / (int)b;
+			else
+				reg[insn->rd] = (int)a % (int)b;
+			break;
+		case OP_DIVU:
+		case OP_DIVUI:
+		case OP_REMU:
+		case OP_REMUI:
+			b = (insn->op == OP_DIVU || insn->op == OP_REMU) ? reg[insn->rt] : insn->imm;
+			if (b == 0)
+				EXCEPTION(exception_arith, pc);
+			reg[insn->rd] = (insn->op == OP_DIVU || insn->op == OP_DIVUI) ? a / b : a % b;
+			break;
+		case OP_LHI:
+		case OP_LA:
+			reg[insn->rd] = insn->imm;
+			break;
+		ALU_OPS(OP_AND, a & b)
+		ALU_OPS(OP_OR, a | b)
+		ALU_OPS(OP_XOR, a ^ b)
+		ALU_OPS(OP_SLL, a << (b & 0x1f))
+		ALU_OPS(OP_SRL, a >> (b & 0x1f))
+		ALU_OPS(OP_SRA, (unsigned int)((int)a >> (b & 0x1f)))
+		ALU_OPS(OP_SLT, (int)a < (int)b)
+		ALU_OPS(OP_SLTU, a < b)
+		ALU_OPS(OP_SGT, (int)a > (int)b)
+		ALU_OPS(OP_SGTU, a > b)
+		ALU_OPS(OP_SLE, (int)a <= (int)b)
+		ALU_OPS(OP_SLEU, a <= b)
+		ALU_OPS(OP_SGE, (int)a >= (int)b)
+		ALU_OPS(OP_SGEU, a >= b)
+		ALU_OPS(OP_SEQ, a == b)
+		ALU_OPS(OP_SNE, a != b)
+		case OP_J:
+			next = insn->imm;
+			break;
+		case OP_JR:
+			next = a & (memory_words - 1);
+			break;
+		case OP_JAL:
+			reg[15] = next;
+			next = insn->imm;
+			break;
+		case OP_JALR:
+			reg[15] = next;
+			next = a & (memory_words - 1);
+			break;
+		case OP_BEQZ:
+			if (a == 0)
+				next = (next + insn->imm) & (memory_words - 1);
+			break;
+		case OP_BNEZ:
+			if (a != 0)
+				next = (next + insn->imm) & (memory_words - 1);
+			break;
+		case OP_LW:
+			address = (a + insn->imm) & (memory_words - 1);
+			reg[insn->rd] = is_device(address) ? read_word(address) : memory[address];
+			break;
+		case OP_SW:
+			address = (a + insn->imm) & (memory_words - 1);
+			if (is_device(address))
+				write_word(address, reg[insn->rd]);
+			else
+			{
+				memory[address] = reg[insn->rd];
+				decoded[address].op = OP_UNDECODED;
+			}
+			break;
+		case OP_MOVGS:
+			write_spr(insn->rd, a);
+			break;
+		case OP_MOVSG:
+			reg[insn->rd] = read_spr(insn->rs);
+			break;
+		case OP_BREAK:
+			EXCEPTION(exception_break, next);
+		case OP_SYSCALL:
+			EXCEPTION(exception_syscall, next);
+		case OP_RFE:
+			// Back to the mode before the exception
+			spr[SPR_CCTRL] = (spr[SPR_CCTRL] & ~0xau) | ((spr[SPR_CCTRL] & 0x5) << 1);
+			next = spr[SPR_EAR] & (memory_words - 1);
+			break;
+		default:
+			EXCEPTION(exception_gpf, pc);
+		}
+
+		reg[0] = 0;
+		pc = next;
+	}
+}
+
+stop_reason simulator::run(unsigned long long limit)
+{
+	stop_reason reason;
+
+	if (limit == 0)
+		limit = ~0ULL;
+
+	stop_exception = 0;
+	if (profile_instructions != NULL)
+		reason = execute<true>(limit);
+	else
+		reason = execute<false>(limit);
+
+	flush_serial();
+	return reason;
+}
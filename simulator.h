@@ -0,0 +1,139 @@
+/*
+########################################################################
+# This file is part of the toolchain for WRAMP assembly
+#
+# Copyright (C) 2019 The University of Waikato, Hamilton, New Zealand.
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <https://www.gnu.org/licenses/>.
+########################################################################
+*/
+
+#ifndef SIMULATOR_H
+#define SIMULATOR_H
+
+#include <stddef.h>
+#include <ostream>
+#include <string>
+
+// The words of memory, the whole 20 bit address space
+const unsigned int memory_words = 0x100000;
+
+// The address $ra holds when the program starts, so returning from main
+// ends the simulation
+const unsigned int exit_address = 0xfffff;
+
+// Where $sp starts, just below the serial port
+const unsigned int initial_stack = 0x70000;
+
+// The first serial port. Words written to its transmit register go to the
+// serial output, and its status register always reads as ready to transmit.
+const unsigned int serial_transmit = 0x70000;
+const unsigned int serial_receive = 0x70001;
+const unsigned int serial_status = 0x70003;
+
+// The special registers
+enum spr_number
+{
+	SPR_CCTRL = 4,
+	SPR_ESTAT = 5,
+	SPR_ICOUNT = 6,
+	SPR_CCOUNT = 7,
+	SPR_EVEC = 8,
+	SPR_EAR = 9,
+	SPR_ESP = 10,
+	SPR_ERS = 11
+};
+
+// The $estat bit for each kind of exception
+const unsigned int exception_gpf = 0x1000;
+const unsigned int exception_syscall = 0x2000;
+const unsigned int exception_break = 0x4000;
+const unsigned int exception_arith = 0x8000;
+
+// Why the simulator stopped
+enum stop_reason
+{
+	STOP_RETURNED,  // main returned
+	STOP_EXCEPTION, // An exception with no handler ($evec is zero), such as a break or syscall
+	STOP_LIMIT		// The instruction limit was reached
+};
+
+// Simulates a WRAMP processor running a linked program. Each word is
+// decoded the first time it is run, and the decoded form kept until the
+// word is written to, so loops don't decode their instructions again.
+// Exceptions are taken as the processor takes them, jumping to $evec, but a
+// program that hasn't set $evec just stops. There are no interrupts, and
+// $ccount counts an estimate of the cycles each instruction takes.
+class simulator
+{
+public:
+	simulator(std::ostream &serial);
+	~simulator();
+
+	// Loads an image written by wlink as S-records, starting at its entry
+	// point. Returns false if it isn't valid, with the problem in messages.
+	bool load_srecords(const char *data, size_t length, std::ostream &messages);
+
+	// Runs until the program stops, or has run limit more instructions if
+	// limit isn't zero
+	stop_reason run(unsigned long long limit);
+
+	// Counts the instructions run and cycles taken at each address, from
+	// here on
+	void enable_profile();
+
+	unsigned int reg[16];
+	unsigned int spr[16];
+	unsigned int pc;
+	// The exception that stopped the program, as its $estat bit
+	unsigned int stop_exception;
+
+	// $icount and $ccount, which read as their low 32 bits
+	unsigned long long icount, ccount;
+
+	unsigned int *memory;
+	// Per address, only kept once the profile is enabled
+	unsigned long long *profile_instructions;
+	unsigned long long *profile_cycles;
+
+private:
+	struct decoded_insn
+	{
+		unsigned char op;
+		unsigned char rd, rs, rt;
+		unsigned int imm;
+		unsigned int cycles;
+	};
+	decoded_insn *decoded;
+
+	std::ostream &serial;
+	std::string serial_buffer;
+
+	void decode(unsigned int address);
+	bool take_exception(unsigned int status, unsigned int return_address);
+	unsigned int read_word(unsigned int address);
+	void write_word(unsigned int address, unsigned int value);
+	unsigned int read_spr(unsigned int number);
+	void write_spr(unsigned int number, unsigned int value);
+	void flush_serial();
+
+	template <bool profiling>
+	stop_reason execute(unsigned long long limit);
+
+	// Not copyable, the memory would end up shared
+	simulator(const simulator &);
+	simulator &operator=(const simulator &);
+};
+
+#endif
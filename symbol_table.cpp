@@ -0,0 +1,131 @@
+/*
+########################################################################
+# This file is part of the toolchain for WRAMP assembly
+#
+# Copyright (C) 2019 The University of Waikato, Hamilton, New Zealand.
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <https://www.gnu.org/licenses/>.
+########################################################################
+*/
+
+#include <string.h>
+
+#include "symbol_table.h"
+
+// The table is grown once it becomes half full
+const unsigned int initial_capacity = 64;
+
+// 32 bit FNV-1a hash of a null terminated name
+unsigned int hash_name(const char *name)
+{
+	unsigned int hash = 2166136261u;
+
+	while (*name != '\0')
+	{
+		hash ^= (unsigned char)*name++;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+symbol_table::symbol_table()
+{
+	slots = NULL;
+	capacity = 0;
+	count = 0;
+}
+
+symbol_table::~symbol_table()
+{
+	delete[] slots;
+}
+
+void *symbol_table::find(const char *name) const
+{
+	if (count == 0)
+		return NULL;
+
+	return find(name, hash_name(name));
+}
+
+void *symbol_table::find(const char *name, unsigned int hash) const
+{
+	if (count == 0)
+		return NULL;
+
+	unsigned int i = hash & (capacity - 1);
+
+	// Linear probing, stopping at the first empty slot
+	while (slots[i].name != NULL)
+	{
+		if (slots[i].hash == hash && strcmp(slots[i].name, name) == 0)
+			return slots[i].entry;
+		i = (i + 1) & (capacity - 1);
+	}
+	return NULL;
+}
+
+void symbol_table::insert(const char *name, void *entry)
+{
+	insert(name, hash_name(name), entry);
+}
+
+void symbol_table::insert(const char *name, unsigned int hash, void *entry)
+{
+	if ((count + 1) * 2 > capacity)
+		grow();
+
+	unsigned int i = hash & (capacity - 1);
+
+	while (slots[i].name != NULL)
+		i = (i + 1) & (capacity - 1);
+
+	slots[i].name = name;
+	slots[i].hash = hash;
+	slots[i].entry = entry;
+	count++;
+}
+
+void symbol_table::clear()
+{
+	delete[] slots;
+	slots = NULL;
+	capacity = 0;
+	count = 0;
+}
+
+void symbol_table::grow()
+{
+	slot *old_slots = slots;
+	unsigned int old_capacity = capacity;
+
+	capacity = (capacity == 0) ? initial_capacity : capacity * 2;
+	slots = new slot[capacity];
+	memset(slots, 0, sizeof(slot) * capacity);
+
+	// Rehash everything into the new slot array, the stored hashes save
+	// us from having to look at the names again
+	for (unsigned int j = 0; j < old_capacity; j++)
+	{
+		if (old_slots[j].name == NULL)
+			continue;
+
+		unsigned int i = old_slots[j].hash & (capacity - 1);
+		while (slots[i].name != NULL)
+			i = (i + 1) & (capacity - 1);
+		slots[i] = old_slots[j];
+	}
+
+	delete[] old_slots;
+}
@@ -0,0 +1,68 @@
+/*
+########################################################################
+# This file is part of the toolchain for WRAMP assembly
+#
+# Copyright (C) 2019 The University of Waikato, Hamilton, New Zealand.
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <https://www.gnu.org/licenses/>.
+########################################################################
+*/
+
+#ifndef SYMBOL_TABLE_H
+#define SYMBOL_TABLE_H
+
+// An open addressing hash index from symbol names to entries owned by the caller.
+// Names are not copied: the key passed to insert() must stay valid for as long
+// as it is in the table, which is normally done by using the name stored in the
+// entry itself. This makes each name interned - there is exactly one copy of it.
+class symbol_table
+{
+public:
+	symbol_table();
+	~symbol_table();
+
+	// Returns the entry stored under this name, or NULL if there is none
+	void *find(const char *name) const;
+	// Adds a new entry, the name must not already be in the table
+	void insert(const char *name, void *entry);
+	// The same, for a name whose hash_name() is already known
+	void *find(const char *name, unsigned int hash) const;
+	void insert(const char *name, unsigned int hash, void *entry);
+	// Forgets all the entries (but does not delete them)
+	void clear();
+
+	unsigned int size() const { return count; }
+
+private:
+	struct slot
+	{
+		const char *name;
+		unsigned int hash;
+		void *entry;
+	};
+
+	slot *slots;
+	unsigned int capacity; // Always zero or a power of two
+	unsigned int count;
+
+	void grow();
+
+	// Not copyable, the slot array would end up shared
+	symbol_table(const symbol_table &);
+	symbol_table &operator=(const symbol_table &);
+};
+
+extern unsigned int hash_name(const char *name);
+
+#endif
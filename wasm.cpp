@@ -0,0 +1,589 @@
+/*
+########################################################################
+# This is the assembler part of the toolchain for WRAMP assembly
+#
+# Copyright (C) 2019 The University of Waikato, Hamilton, New Zealand.
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <https://www.gnu.org/licenses/>.
+########################################################################
+*/
+
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <fcntl.h>
+
+#include "assembler.h"
+#include "object_cache.h"
+
+using namespace std;
+
+// A source file to assemble, and how it went
+struct assembly_job
+{
+	char *input_filename;
+	string output_filename;
+	bool text_regions;
+	bool line_table;
+	object_cache *cache;
+	bool done;
+	bool succeeded;
+	string messages;
+};
+
+// The files to assemble, shared between the worker threads. Workers take
+// the files in order, and stop taking more once any file has failed.
+struct job_queue
+{
+	vector<assembly_job> jobs;
+	unsigned int next_job;
+	bool failed;
+	pthread_mutex_t lock;
+	pthread_cond_t job_done;
+};
+
+// The most the object cache holds before old entries are removed
+const unsigned long long default_cache_size = 256ULL << 20;
+
+// Try to strip .S or .s and add .o
+// Failing that, just add .o
+string default_output_filename(const char *input_filename)
+{
+	string output_filename = input_filename;
+
+	int len = output_filename.size();
+
+	if (len > 1 && output_filename[len - 2] == '.' && toupper(output_filename[len - 1]) == 'S')
+		output_filename[len - 1] = 'o';
+	else
+		output_filename += ".o";
+
+	return output_filename;
+}
+
+// Reads a whole source file, returning false if it can't be read
+bool read_source_file(const char *filename, vector<char> &source)
+{
+	struct stat info;
+	char buffer[65536];
+	ssize_t count;
+
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return false;
+
+	if (fstat(fd, &info) < 0 || S_ISDIR(info.st_mode))
+	{
+		close(fd);
+		return false;
+	}
+
+	while ((count = read(fd, buffer, sizeof(buffer))) > 0)
+		source.insert(source.end(), buffer, buffer + count);
+
+	close(fd);
+	return count == 0;
+}
+
+// Assembles one file, taking the object file from the cache instead when
+// the same source has been assembled before with the same options
+bool assemble_file(assembler &as, object_cache *cache, const char *input_filename, const char *output_filename,
+				   string &messages)
+{
+	vector<char> source;
+
+	// Without a cache, or if the source can't be read, the assembler
+	// reads the file itself and reports any errors
+	if (cache == NULL || !read_source_file(input_filename, source))
+	{
+		bool succeeded = as.assemble(input_filename, output_filename);
+		messages = as.messages.str();
+		return succeeded;
+	}
+
+	string key = cache->key(source.empty() ? NULL : &source[0], source.size(), input_filename, as.text_regions,
+							  as.line_table);
+	vector<char> object;
+
+	if (!cache->fetch(key, input_filename, object, messages))
+	{
+		bool succeeded = as.assemble(source.empty() ? NULL : &source[0], source.size(), input_filename, object);
+		messages = as.messages.str();
+		if (!succeeded)
+			return false;
+
+		cache->store(key, input_filename, object, messages);
+	}
+
+	ofstream outputfile(output_filename, ios::out | ios::binary);
+
+	if (!outputfile)
+	{
+		messages += string("ERROR: Could not open output file : `") + output_filename + "'\n";
+		return false;
+	}
+
+	outputfile.write(&object[0], object.size());
+	return true;
+}
+
+void run_job(assembly_job &job)
+{
+	assembler as;
+	as.text_regions = job.text_regions;
+	as.line_table = job.line_table;
+
+	job.succeeded = assemble_file(as, job.cache, job.input_filename, job.output_filename.c_str(), job.messages);
+}
+
+void *worker(void *arg)
+{
+	job_queue *queue = (job_queue *)arg;
+
+	pthread_mutex_lock(&queue->lock);
+	while (!queue->failed && queue->next_job < queue->jobs.size())
+	{
+		assembly_job &job = queue->jobs[queue->next_job++];
+		pthread_mutex_unlock(&queue->lock);
+
+		run_job(job);
+
+		pthread_mutex_lock(&queue->lock);
+		job.done = true;
+		if (!job.succeeded)
+			queue->failed = true;
+		pthread_cond_broadcast(&queue->job_done);
+	}
+	pthread_mutex_unlock(&queue->lock);
+
+	return NULL;
+}
+
+// Assembles all the files, using num_threads threads if there is more than
+// one. Messages are printed in the order the files were given, and we stop
+// at the first file with errors.
+bool run_jobs(job_queue &queue, int num_threads)
+{
+	unsigned int i;
+
+	if (num_threads > (int)queue.jobs.size())
+		num_threads = queue.jobs.size();
+
+	if (num_threads <= 1)
+	{
+		for (i = 0; i < queue.jobs.size(); i++)
+		{
+			run_job(queue.jobs[i]);
+			cerr << queue.jobs[i].messages;
+			if (!queue.jobs[i].succeeded)
+				return false;
+		}
+		return true;
+	}
+
+	queue.next_job = 0;
+	queue.failed = false;
+	pthread_mutex_init(&queue.lock, NULL);
+	pthread_cond_init(&queue.job_done, NULL);
+
+	vector<pthread_t> threads(num_threads);
+	int num_started = 0;
+	for (int t = 0; t < num_threads; t++)
+	{
+		if (pthread_create(&threads[num_started], NULL, worker, &queue) == 0)
+			num_started++;
+	}
+
+	// Without any threads just do the work here
+	if (num_started == 0)
+		worker(&queue);
+
+	bool succeeded = true;
+	for (i = 0; i < queue.jobs.size() && succeeded; i++)
+	{
+		pthread_mutex_lock(&queue.lock);
+		while (!queue.jobs[i].done)
+			pthread_cond_wait(&queue.job_done, &queue.lock);
+		pthread_mutex_unlock(&queue.lock);
+
+		cerr << queue.jobs[i].messages;
+		succeeded = queue.jobs[i].succeeded;
+	}
+
+	for (int t = 0; t < num_started; t++)
+		pthread_join(threads[t], NULL);
+
+	pthread_mutex_destroy(&queue.lock);
+	pthread_cond_destroy(&queue.job_done);
+
+	return succeeded;
+}
+
+// Serves requests to assemble files until the input ends, reusing the one
+// assembler. Each request is a line holding the source file, optionally the
+// object file to write, then optionally -r and -g, which apply to that request
+// on top of the options the server was started with. The reply is a line with
+// OK or ERROR and the number of messages, followed by the messages
+// themselves, one per line.
+void serve(assembler &as, object_cache *cache, FILE *in, FILE *out)
+{
+	char *line = NULL;
+	size_t line_size = 0;
+	bool text_regions = as.text_regions;
+	bool line_table = as.line_table;
+
+	while (getline(&line, &line_size, in) != -1)
+	{
+		char *input_filename = strtok(line, " \t\r\n");
+		char *output_filename = strtok(NULL, " \t\r\n");
+		char *option = NULL;
+
+		// Ignore blank lines
+		if (input_filename == NULL)
+			continue;
+
+		// The object file can be left out, leaving just options
+		if (output_filename != NULL && output_filename[0] == '-')
+		{
+			option = output_filename;
+			output_filename = NULL;
+		}
+		else
+			option = strtok(NULL, " \t\r\n");
+
+		bool succeeded = false;
+		string messages;
+
+		for (; option != NULL && messages.empty(); option = strtok(NULL, " \t\r\n"))
+		{
+			if (strcmp(option, "-r") == 0)
+				as.text_regions = true;
+			else if (strcmp(option, "-g") == 0)
+				as.line_table = true;
+			else
+				messages = string("ERROR: Unknown option : `") + option + "'\n";
+		}
+
+		if (messages.empty())
+		{
+			string output = (output_filename != NULL) ? output_filename : default_output_filename(input_filename);
+
+			succeeded = assemble_file(as, cache, input_filename, output.c_str(), messages);
+			if (cache != NULL)
+				cache->update();
+		}
+
+		// Back to the server's own options for the next request
+		as.text_regions = text_regions;
+		as.line_table = line_table;
+
+		int num_messages = 0;
+		for (unsigned int i = 0; i < messages.size(); i++)
+			if (messages[i] == '\n')
+				num_messages++;
+
+		fprintf(out, "%s %d\n%s", succeeded ? "OK" : "ERROR", num_messages, messages.c_str());
+		fflush(out);
+	}
+
+	free(line);
+}
+
+// Serves requests from each client that connects to a Unix socket, one
+// client at a time. This only returns if the socket can't be used.
+void serve_socket(assembler &as, object_cache *cache, char *socket_path)
+{
+	sockaddr_un socket_address;
+
+	if (strlen(socket_path) >= sizeof(socket_address.sun_path))
+	{
+		cerr << "ERROR: Socket path too long : `" << socket_path << "'" << endl;
+		return;
+	}
+
+	memset(&socket_address, 0, sizeof(socket_address));
+	socket_address.sun_family = AF_UNIX;
+	strcpy(socket_address.sun_path, socket_path);
+
+	// Remove a socket left behind by an earlier server, but nothing else
+	struct stat info;
+	if (stat(socket_path, &info) == 0 && S_ISSOCK(info.st_mode))
+		unlink(socket_path);
+
+	int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listener < 0 ||
+		bind(listener, (sockaddr *)&socket_address, sizeof(socket_address)) < 0 ||
+		listen(listener, 16) < 0)
+	{
+		cerr << "ERROR: Could not listen on socket : `" << socket_path << "'" << endl;
+		if (listener >= 0)
+			close(listener);
+		return;
+	}
+
+	// A client going away part way through a reply mustn't stop the server
+	signal(SIGPIPE, SIG_IGN);
+
+	while (true)
+	{
+		int client = accept(listener, NULL, NULL);
+		if (client < 0)
+		{
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			cerr << "ERROR: Could not accept connection on socket : `" << socket_path << "'" << endl;
+			break;
+		}
+
+		FILE *in = fdopen(client, "r");
+		FILE *out = fdopen(dup(client), "w");
+		if (in != NULL && out != NULL)
+			serve(as, cache, in, out);
+
+		if (in != NULL)
+			fclose(in);
+		else
+			close(client);
+		if (out != NULL)
+			fclose(out);
+	}
+
+	close(listener);
+}
+
+void usage(char *progname)
+{
+	cerr << "USAGE: " << progname << " [-r] [-g] [-j threads] [cache options] [-o output] file[s]\n";
+	cerr << "       " << progname << " [-r] [-g] [cache options] -s\n";
+	cerr << "       " << progname << " [-r] [-g] [cache options] -u socket\n";
+	cerr << "       " << progname << " -c directory -cache-stats\n";
+	cerr << "Multiple files can be specified if -o is omitted\n";
+	cerr << "-s serves requests on standard input, -u on a Unix socket\n";
+	cerr << "-r splits the text segment into regions wlink -gc-sections can drop\n";
+	cerr << "-g adds a table of the source line each word came from\n";
+	cerr << "Cache options are -c directory, -cache-size bytes[K|M|G] and -cache-stats\n";
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	int i;
+	int num_threads = 1;
+	vector<char *> input_filenames;
+	char *output_filename = NULL;
+	bool serve_stdin = false;
+	char *socket_path = NULL;
+	bool text_regions = false;
+	bool line_table = false;
+	char *cache_directory = NULL;
+	unsigned long long cache_size = default_cache_size;
+	bool cache_stats = false;
+
+	if (argc < 2)
+		usage(argv[0]);
+
+	// Here we must parse the arguments
+	for (i = 1; i < argc; i++)
+	{
+		// Is this an option
+		if (argv[i][0] == '-')
+		{
+			if (strcmp(argv[i], "-o") == 0)
+			{
+				if ((i + 1) == argc)
+					usage(argv[0]);
+
+				// Redefinition of the output file
+				if (output_filename != NULL)
+					usage(argv[0]);
+
+				i++;
+				output_filename = argv[i];
+			}
+			// The number of files to assemble at once
+			else if (strncmp(argv[i], "-j", 2) == 0)
+			{
+				char *number = argv[i] + 2;
+				if (*number == '\0')
+				{
+					if ((i + 1) == argc)
+						usage(argv[0]);
+					number = argv[++i];
+				}
+
+				char *end;
+				num_threads = strtol(number, &end, 10);
+				if (*end != '\0' || num_threads < 1)
+					usage(argv[0]);
+			}
+			// Regions for wlink to drop if they are never used
+			else if (strcmp(argv[i], "-r") == 0)
+			{
+				text_regions = true;
+			}
+			// A line table, mapping the words back to the source
+			else if (strcmp(argv[i], "-g") == 0)
+			{
+				line_table = true;
+			}
+			// The directory of object files assembled before
+			else if (strcmp(argv[i], "-c") == 0)
+			{
+				if ((i + 1) == argc)
+					usage(argv[0]);
+
+				i++;
+				cache_directory = argv[i];
+			}
+			else if (strcmp(argv[i], "-cache-size") == 0)
+			{
+				if ((i + 1) == argc)
+					usage(argv[0]);
+
+				char *end;
+				cache_size = strtoull(argv[++i], &end, 10);
+				if (toupper(*end) == 'K')
+					cache_size <<= 10;
+				else if (toupper(*end) == 'M')
+					cache_size <<= 20;
+				else if (toupper(*end) == 'G')
+					cache_size <<= 30;
+				if (*end != '\0')
+					end++;
+				if (end == argv[i] || *end != '\0')
+					usage(argv[0]);
+			}
+			else if (strcmp(argv[i], "-cache-stats") == 0)
+			{
+				cache_stats = true;
+			}
+			// Server mode, on standard input or a socket
+			else if (strcmp(argv[i], "-s") == 0)
+			{
+				serve_stdin = true;
+			}
+			else if (strcmp(argv[i], "-u") == 0)
+			{
+				if ((i + 1) == argc)
+					usage(argv[0]);
+
+				i++;
+				socket_path = argv[i];
+			}
+			else
+				usage(argv[0]);
+		}
+		else
+		{
+			if (argv[i] == NULL)
+			{
+				usage(argv[0]);
+			}
+			// Otherwise it is a filename
+			input_filenames.push_back(argv[i]);
+		}
+	}
+
+	int num_filenames = input_filenames.size();
+
+	// The cache options need a cache
+	if (cache_directory == NULL && (cache_stats || cache_size != default_cache_size))
+		usage(argv[0]);
+
+	object_cache *cache = NULL;
+	if (cache_directory != NULL)
+	{
+		cache = new object_cache(cache_directory, cache_size);
+		if (!cache->open(cerr))
+			return 1;
+	}
+
+	// Just list how well the cache is doing
+	if (cache_stats && num_filenames == 0 && !serve_stdin && socket_path == NULL)
+	{
+		cache->print_stats(cout);
+		return 0;
+	}
+
+	if (serve_stdin || socket_path != NULL)
+	{
+		// Files to assemble come from the requests, so none may be given here
+		if (num_filenames != 0 || output_filename != NULL || (serve_stdin && socket_path != NULL))
+			usage(argv[0]);
+
+		assembler as;
+		as.text_regions = text_regions;
+		as.line_table = line_table;
+
+		if (socket_path != NULL)
+		{
+			serve_socket(as, cache, socket_path);
+			return 1;
+		}
+
+		serve(as, cache, stdin, stdout);
+		return 0;
+	}
+
+	// -o along with multiple filenames is disallowed
+	if (num_filenames == 0 || (num_filenames > 1 && output_filename != NULL))
+	{
+		usage(argv[0]);
+	}
+
+	job_queue queue;
+	queue.jobs.resize(num_filenames);
+
+	for (i = 0; i < num_filenames; i++)
+	{
+		assembly_job &job = queue.jobs[i];
+
+		job.input_filename = input_filenames[i];
+		job.done = false;
+		job.succeeded = false;
+		job.text_regions = text_regions;
+		job.line_table = line_table;
+		job.cache = cache;
+
+		if (output_filename == NULL)
+			job.output_filename = default_output_filename(job.input_filename);
+		else
+			job.output_filename = output_filename;
+	}
+
+	bool succeeded = run_jobs(queue, num_threads);
+
+	if (cache != NULL)
+	{
+		cache->update();
+		if (cache_stats)
+			cache->print_stats(cout);
+		delete cache;
+	}
+
+	return succeeded ? 0 : 1;
+}
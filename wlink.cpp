@@ -0,0 +1,330 @@
+/*
+########################################################################
+# This is the linker part of the toolchain for WRAMP assembly
+#
+# Copyright (C) 2019 The University of Waikato, Hamilton, New Zealand.
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <https://www.gnu.org/licenses/>.
+########################################################################
+*/
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "linker.h"
+
+using namespace std;
+
+void usage(char *progname)
+{
+	cerr << "USAGE: " << progname << " [-Ttext address] [-Tdata address] [-[T|E]bss address] [-Srecord bytes] [-S2] [-F format] [-v] [-j threads] [-gc-sections] [-i] [-g] [-o output] file1 file2 ...\n";
+	cerr << "Formats are srec (the default), binary, binary-be, mem and ihex\n";
+	exit(1);
+}
+
+// Reads everything left in a file, returning false if it can't be read
+bool read_all(int fd, string &contents)
+{
+	char buffer[65536];
+	ssize_t count;
+
+	while ((count = read(fd, buffer, sizeof(buffer))) > 0)
+		contents.append(buffer, count);
+
+	return count == 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int i;
+	char *endptr = NULL;
+	char output_filename[300] = {0};
+	link_options options;
+	bool incremental = false;
+	bool line_table = false;
+
+	if (argc < 2)
+		usage(argv[0]);
+
+	// Here we must parse the arguments
+	typedef char *char_p;
+	char **input_filename = new char_p[argc];
+	int num_files = 0;
+	for (i = 1; i < argc; i++)
+	{
+		// Is this an option
+		if (argv[i][0] == '-')
+		{
+			// This is the only valid option for now
+			if (strcmp(argv[i], "-o") == 0)
+			{
+				if ((i + 1) == argc)
+					usage(argv[0]);
+
+				// Redefinition of the output file
+				if (output_filename[0] != '\0')
+					usage(argv[0]);
+
+				i++;
+				strcpy(output_filename, argv[i]);
+			}
+			else if (strcmp(argv[i], "-Ttext") == 0)
+			{
+				if ((i + 1) == argc)
+					usage(argv[0]);
+				i++;
+
+				options.text_address = strtol(argv[i], &endptr, 0);
+
+				if (*endptr != 0)
+					usage(argv[0]);
+			}
+			else if (strcmp(argv[i], "-Tdata") == 0)
+			{
+				if ((i + 1) == argc)
+					usage(argv[0]);
+				i++;
+
+				options.data_address = strtol(argv[i], &endptr, 0);
+
+				if (*endptr != 0)
+					usage(argv[0]);
+			}
+			else if (strcmp(argv[i], "-Tbss") == 0)
+			{
+				if ((i + 1) == argc)
+					usage(argv[0]);
+				i++;
+
+				options.bss_address = strtol(argv[i], &endptr, 0);
+
+				if (*endptr != 0)
+					usage(argv[0]);
+			}
+			else if (strcmp(argv[i], "-Ebss") == 0)
+			{
+				if ((i + 1) == argc)
+					usage(argv[0]);
+				i++;
+
+				options.bss_address = strtol(argv[i], &endptr, 0);
+				options.bss_end_justify = true;
+
+				if (*endptr != 0)
+					usage(argv[0]);
+			}
+			else if (strcmp(argv[i], "-Srecord") == 0)
+			{
+				if ((i + 1) == argc)
+					usage(argv[0]);
+				i++;
+
+				options.srecord_bytes = strtol(argv[i], &endptr, 0);
+
+				if (*endptr != 0)
+					usage(argv[0]);
+			}
+			else if (strcmp(argv[i], "-S2") == 0)
+			{
+				options.srecord_s2 = true;
+			}
+			else if (strcmp(argv[i], "-F") == 0)
+			{
+				if ((i + 1) == argc)
+					usage(argv[0]);
+				i++;
+
+				if (strcmp(argv[i], "srec") == 0)
+					options.output_format = SRECORD;
+				else if (strcmp(argv[i], "binary") == 0)
+					options.output_format = BINARY_LE;
+				else if (strcmp(argv[i], "binary-be") == 0)
+					options.output_format = BINARY_BE;
+				else if (strcmp(argv[i], "mem") == 0)
+					options.output_format = VIVADO_MEM;
+				else if (strcmp(argv[i], "ihex") == 0)
+					options.output_format = INTEL_HEX;
+				else
+					usage(argv[0]);
+			}
+			else if (strcmp(argv[i], "-v") == 0)
+			{
+				options.verbose = true;
+			}
+			else if (strcmp(argv[i], "-gc-sections") == 0)
+			{
+				options.gc_sections = true;
+			}
+			else if (strcmp(argv[i], "-i") == 0)
+			{
+				incremental = true;
+			}
+			// The source line of each word, from the objects' line tables
+			else if (strcmp(argv[i], "-g") == 0)
+			{
+				line_table = true;
+			}
+			// The number of files to read and relocate at once
+			else if (strncmp(argv[i], "-j", 2) == 0)
+			{
+				char *number = argv[i] + 2;
+				if (*number == '\0')
+				{
+					if ((i + 1) == argc)
+						usage(argv[0]);
+					number = argv[++i];
+				}
+
+				options.num_threads = strtol(number, &endptr, 10);
+				if (*endptr != '\0' || options.num_threads < 1)
+					usage(argv[0]);
+			}
+			else
+				usage(argv[0]);
+		}
+		else
+		{
+			// Otherwise it is a filename
+			input_filename[num_files] = argv[i];
+			num_files++;
+		}
+	}
+
+	if (num_files == 0)
+		usage(argv[0]);
+
+	if (output_filename[0] == '\0')
+	{
+		// default to link.out
+		strcpy(output_filename, "link.out");
+	}
+
+	// Map all the object files into memory, reading in any that can't be mapped
+	vector<string> contents(num_files);
+	vector<object_buffer> objects(num_files);
+	vector<size_t> mapped_length(num_files, 0);
+	for (i = 0; i < num_files; i++)
+	{
+		objects[i].filename = input_filename[i];
+
+		int fd = open(input_filename[i], O_RDONLY);
+		struct stat info;
+		if (fd < 0 || fstat(fd, &info) < 0)
+		{
+			cerr << "ERROR: Could not open file for input : " << input_filename[i] << endl;
+			exit(1);
+		}
+
+		if (S_ISREG(info.st_mode) && info.st_size > 0)
+		{
+			void *map = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (map != MAP_FAILED)
+			{
+				mapped_length[i] = info.st_size;
+				objects[i].data = (const char *)map;
+				objects[i].length = info.st_size;
+			}
+		}
+
+		if (mapped_length[i] == 0)
+		{
+			if (!read_all(fd, contents[i]))
+			{
+				cerr << "ERROR: Could not open file for input : " << input_filename[i] << endl;
+				exit(1);
+			}
+
+			objects[i].data = contents[i].data();
+			objects[i].length = contents[i].size();
+		}
+
+		close(fd);
+	}
+
+	string image;
+	// Incremental links keep their state beside the output
+	string state_filename = string(output_filename) + ".state";
+	string previous_state, state;
+	if (incremental == true)
+	{
+		int fd = open(state_filename.c_str(), O_RDONLY);
+		if (fd >= 0)
+		{
+			if (!read_all(fd, previous_state))
+				previous_state.clear();
+			close(fd);
+		}
+	}
+
+	string lines;
+	bool linked;
+	if (incremental == true)
+		linked = link_incremental(objects, options, previous_state, state, image, cout, cerr,
+								  line_table ? &lines : NULL);
+	else
+		linked = link_objects(objects, options, image, cout, cerr, line_table ? &lines : NULL);
+
+	for (i = 0; i < num_files; i++)
+		if (mapped_length[i] > 0)
+			munmap((void *)objects[i].data, mapped_length[i]);
+
+	if (!linked)
+		exit(1);
+
+	ofstream outputfile;
+	outputfile.open(output_filename, ios::out | ios::binary);
+	if (!outputfile)
+	{
+		cerr << "ERROR: Could not open output file " << output_filename << endl;
+		exit(1);
+	}
+
+	outputfile.write(image.data(), image.size());
+
+	// The line table goes beside the output
+	if (line_table == true)
+	{
+		string lines_filename = string(output_filename) + ".lines";
+		ofstream linesfile(lines_filename.c_str(), ios::out | ios::binary);
+		if (!linesfile)
+		{
+			cerr << "ERROR: Could not open output file " << lines_filename << endl;
+			exit(1);
+		}
+		linesfile.write(lines.data(), lines.size());
+	}
+
+	if (incremental == true)
+	{
+		// A stale state must not be used for the next link
+		if (state.empty())
+			unlink(state_filename.c_str());
+		else
+		{
+			ofstream statefile;
+			statefile.open(state_filename.c_str(), ios::out | ios::binary);
+			statefile.write(state.data(), state.size());
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,322 @@
+/*
+########################################################################
+# This file is part of the toolchain for WRAMP assembly
+#
+# Copyright (C) 2019 The University of Waikato, Hamilton, New Zealand.
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <https://www.gnu.org/licenses/>.
+########################################################################
+*/
+
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <iterator>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <map>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <sys/time.h>
+
+#include "simulator.h"
+#include "instructions.h"
+
+using namespace std;
+
+// The cost of one source line, or of one address without a line table
+struct profile_entry
+{
+	string name;
+	unsigned long long instructions;
+	unsigned long long cycles;
+
+	bool operator<(const profile_entry &other) const { return cycles > other.cycles; }
+};
+
+void usage(char *progname)
+{
+	cerr << "USAGE: " << progname << " [-n instructions] [-r] [-m address words] [-p] file.srec\n";
+	cerr << "-n stops after that many instructions\n";
+	cerr << "-r lists the registers once the program stops\n";
+	cerr << "-m lists that many words of memory from the address once the program stops\n";
+	cerr << "-p lists the cycles spent on each source line, from the line table wlink -g writes\n";
+	exit(1);
+}
+
+// Reads a whole file into memory, returning false if it can't be read
+bool read_file(const char *filename, string &contents)
+{
+	ifstream file;
+	file.open(filename, ios::in | ios::binary);
+
+	if (!file)
+		return false;
+
+	contents.assign(istreambuf_iterator<char>(file), istreambuf_iterator<char>());
+	return true;
+}
+
+static double seconds_now()
+{
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	return now.tv_sec + now.tv_usec / 1e6;
+}
+
+void print_stop(const simulator &sim, stop_reason reason, double seconds)
+{
+	cerr << "wsim: ";
+	if (reason == STOP_RETURNED)
+		cerr << "main returned";
+	else if (reason == STOP_LIMIT)
+		cerr << "instruction limit reached";
+	else if (sim.stop_exception == exception_break)
+		cerr << "break";
+	else if (sim.stop_exception == exception_syscall)
+		cerr << "syscall";
+	else if (sim.stop_exception == exception_arith)
+		cerr << "arithmetic exception";
+	else
+		cerr << "general protection fault";
+	if (reason != STOP_RETURNED)
+		cerr << " at 0x" << setw(5) << setfill('0') << hex << sim.pc;
+	cerr << endl;
+
+	cerr << "instructions = " << dec << sim.icount << ", cycles = " << sim.ccount;
+	if (seconds > 0)
+		cerr << " (" << fixed << setprecision(1) << sim.icount / seconds / 1e6 << " million instructions a second)";
+	cerr << endl;
+}
+
+void print_registers(const simulator &sim)
+{
+	static const char *spr_names[16] = {
+		NULL, NULL, NULL, NULL, "$cctrl", "$estat", NULL, NULL,
+		"$evec", "$ear", "$esp", "$ers", "$ptable", "$rbase", NULL, NULL};
+
+	for (int i = 0; i < 16; i++)
+	{
+		char name[8];
+		sprintf(name, (i == 14) ? "$sp" : (i == 15) ? "$ra" : "$%d", i);
+		cerr << left << setw(4) << setfill(' ') << name << right << "= " << setw(8) << setfill('0') << hex << sim.reg[i]
+			 << ((i % 4 == 3) ? "\n" : "  ");
+	}
+
+	cerr << "pc     = " << setw(5) << setfill('0') << hex << sim.pc << endl;
+	cerr << "$icount = " << setw(8) << setfill('0') << hex << (unsigned int)sim.icount
+		 << "  $ccount = " << setw(8) << (unsigned int)sim.ccount << endl;
+	for (int i = 0, shown = 0; i < 16; i++)
+	{
+		if (spr_names[i] == NULL)
+			continue;
+		cerr << left << setw(7) << setfill(' ') << spr_names[i] << right << "= " << setw(8) << setfill('0') << hex
+			 << sim.spr[i] << ((++shown % 4 == 0) ? "\n" : "  ");
+	}
+	cerr << endl;
+}
+
+void print_memory(const simulator &sim, unsigned int address, unsigned int num_words)
+{
+	for (unsigned int i = 0; i < num_words && address + i < memory_words; i++)
+	{
+		if (i % 4 == 0)
+			cerr << "0x" << setw(5) << setfill('0') << hex << address + i << " :";
+		cerr << " " << setw(8) << setfill('0') << hex << sim.memory[address + i];
+		if (i % 4 == 3 || i + 1 == num_words || address + i + 1 == memory_words)
+			cerr << endl;
+	}
+}
+
+// Adds up the profile by the source lines in a line table, each line of
+// which is "start end source:line"
+bool profile_lines(const simulator &sim, const string &table, vector<profile_entry> &entries)
+{
+	map<string, unsigned int> line_index;
+	size_t start = 0;
+
+	while (start < table.size())
+	{
+		size_t end = table.find('\n', start);
+		if (end == string::npos)
+			end = table.size();
+		string line = table.substr(start, end - start);
+		start = end + 1;
+
+		unsigned int first, last;
+		int name_start;
+		if (sscanf(line.c_str(), "%x %x %n", &first, &last, &name_start) < 2 || last > memory_words || first > last)
+			return false;
+
+		string name = line.substr(name_start);
+		map<string, unsigned int>::iterator found = line_index.find(name);
+		if (found == line_index.end())
+		{
+			profile_entry entry = {name, 0, 0};
+			found = line_index.insert(make_pair(name, (unsigned int)entries.size())).first;
+			entries.push_back(entry);
+		}
+
+		profile_entry &entry = entries[found->second];
+		for (unsigned int address = first; address < last; address++)
+		{
+			entry.instructions += sim.profile_instructions[address];
+			entry.cycles += sim.profile_cycles[address];
+		}
+	}
+	return true;
+}
+
+// Without a line table each address that ran is listed with its instruction
+void profile_addresses(const simulator &sim, vector<profile_entry> &entries)
+{
+	for (unsigned int address = 0; address < memory_words; address++)
+	{
+		if (sim.profile_instructions[address] == 0)
+			continue;
+
+		ostringstream name;
+		name << "0x" << setw(5) << setfill('0') << hex << address << "  ";
+		disassemble(name, address, sim.memory[address]);
+
+		profile_entry entry = {name.str(), sim.profile_instructions[address], sim.profile_cycles[address]};
+		entries.push_back(entry);
+	}
+}
+
+void print_profile(const simulator &sim, const char *input_filename)
+{
+	vector<profile_entry> entries;
+	string table;
+	string lines_filename = string(input_filename) + ".lines";
+
+	if (!read_file(lines_filename.c_str(), table) || !profile_lines(sim, table, entries))
+	{
+		entries.clear();
+		profile_addresses(sim, entries);
+	}
+
+	stable_sort(entries.begin(), entries.end());
+
+	cerr << setw(14) << setfill(' ') << "cycles" << setw(14) << "instructions" << "  %cycles  where" << endl;
+	for (unsigned int i = 0; i < entries.size(); i++)
+	{
+		if (entries[i].instructions == 0)
+			continue;
+		cerr << setw(14) << setfill(' ') << dec << entries[i].cycles << setw(14) << entries[i].instructions
+			 << setw(9) << fixed << setprecision(2) << (sim.ccount ? 100.0 * entries[i].cycles / sim.ccount : 0.0)
+			 << "  " << entries[i].name << endl;
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	int i;
+	char *endptr = NULL;
+	char *input_filename = NULL;
+	unsigned long long limit = 0;
+	bool show_registers = false, profile = false;
+	vector<pair<unsigned int, unsigned int> > dumps;
+
+	if (argc < 2)
+		usage(argv[0]);
+
+	// Here we must parse the arguments
+	for (i = 1; i < argc; i++)
+	{
+		// Is this an option
+		if (argv[i][0] == '-')
+		{
+			// The most instructions to run
+			if (strcmp(argv[i], "-n") == 0)
+			{
+				if ((i + 1) == argc)
+					usage(argv[0]);
+				i++;
+
+				limit = strtoull(argv[i], &endptr, 0);
+				if (*endptr != '\0' || limit == 0)
+					usage(argv[0]);
+			}
+			else if (strcmp(argv[i], "-r") == 0)
+			{
+				show_registers = true;
+			}
+			else if (strcmp(argv[i], "-m") == 0)
+			{
+				if ((i + 2) >= argc)
+					usage(argv[0]);
+
+				unsigned int address = strtoul(argv[++i], &endptr, 0);
+				if (*endptr != '\0' || address >= memory_words)
+					usage(argv[0]);
+				unsigned int num_words = strtoul(argv[++i], &endptr, 0);
+				if (*endptr != '\0')
+					usage(argv[0]);
+
+				dumps.push_back(make_pair(address, num_words));
+			}
+			else if (strcmp(argv[i], "-p") == 0)
+			{
+				profile = true;
+			}
+			else
+				usage(argv[0]);
+		}
+		else
+		{
+			// Only the one program can be run
+			if (input_filename != NULL)
+				usage(argv[0]);
+			input_filename = argv[i];
+		}
+	}
+
+	if (input_filename == NULL)
+		usage(argv[0]);
+
+	string image;
+	if (!read_file(input_filename, image))
+	{
+		cerr << "ERROR: Could not open file for input : " << input_filename << endl;
+		exit(1);
+	}
+
+	// The program's serial output goes to standard output, everything else
+	// to standard error
+	simulator sim(cout);
+	if (!sim.load_srecords(image.data(), image.size(), cerr))
+		exit(1);
+	if (profile)
+		sim.enable_profile();
+
+	double start = seconds_now();
+	stop_reason reason = sim.run(limit);
+	double seconds = seconds_now() - start;
+
+	print_stop(sim, reason, seconds);
+	if (show_registers)
+		print_registers(sim);
+	for (unsigned int j = 0; j < dumps.size(); j++)
+		print_memory(sim, dumps[j].first, dumps[j].second);
+	if (profile)
+		print_profile(sim, input_filename);
+
+	if (reason == STOP_RETURNED)
+		return 0;
+	return (reason == STOP_LIMIT) ? 2 : 1;
+}